@@ -0,0 +1,856 @@
+// build: gcc -O2 -pthread bench.c -o bench
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
+#include <limits.h>
+
+#define SERVER_PORT "65001"
+#define BUFFER_SIZE 1024
+#define RECV_CHUNK 65536
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_REQUESTS 50
+#define DEFAULT_FILES 10000
+#define DEFAULT_TIMEOUT 30
+#define DEFAULT_MIX "findfile=4,getfiles=2,sgetfiles=1,dgetfiles=1,gettargz=1"
+#define FILES_PER_DIR 100
+#define MAX_MATRIX_CODECS 8
+
+// framed protocol, see server.c
+#define FRAME_MAGIC0 'F'
+#define FRAME_MAGIC1 'S'
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define FRAME_HELLO 1
+#define FRAME_COMMAND 2
+#define FRAME_TEXT 3
+#define FRAME_ARCHIVE 4
+#define FRAME_ERROR 5
+#define FRAME_TRANSFER 6
+
+// commands the benchmark replays
+#define CMD_FINDFILE 0
+#define CMD_GETFILES 1
+#define CMD_SGETFILES 2
+#define CMD_DGETFILES 3
+#define CMD_GETTARGZ 4
+#define NUM_COMMANDS 5
+
+// which node served a connection
+#define NODE_SERVER 0
+#define NODE_MIRROR 1
+
+// one timed request
+struct sample {
+    double ms;
+    unsigned char command;
+    unsigned char node;
+    unsigned char failed;
+    long bytes;
+};
+
+// one benchmark connection and what it measured
+struct connection {
+    int id;
+    int node;
+    char codec[32];
+    unsigned int seed;
+    struct sample *samples;
+    int num_samples;
+    int capacity;
+};
+
+int connect_to_server(const char *server_address, const char *port);
+int connect_to_mirror(char *mirror_list);
+// one run of a codec matrix
+struct matrix_row {
+    char offer[32];
+    char codec[32];
+    long bytes;
+    int errors;
+    double wall_ms;
+    double mean_ms;
+};
+
+int start_session(int server_fd, int *node, int *framed, char *codec, size_t codec_size);
+int negotiate_framing(int server_fd, char *codec, size_t codec_size);
+double run_connections(struct connection *conns, pthread_t *tids, int num_conns);
+void run_matrix(char *list, struct connection *conns, pthread_t *tids, int num_conns);
+void measure_archives(struct connection *conns, int num_conns, struct matrix_row *row);
+void free_samples(struct connection *conns, int num_conns);
+void print_server_stats();
+void *connection_main(void *arg);
+int pick_command(unsigned int *seed);
+void build_command(int command, unsigned int *seed, char *buf, size_t size);
+int run_request(int server_fd, int framed, int command, const char *text, long *bytes);
+int recv_legacy_response(int server_fd, int command, long *bytes);
+int recv_framed_response(int server_fd, uint32_t request_id, long *bytes);
+int send_frame(int server_fd, int type, uint32_t request_id, const char *payload, size_t length);
+int recv_all(int server_fd, void *buf, size_t len);
+int discard_bytes(int server_fd, uint64_t length);
+int parse_mix(const char *mix);
+int generate_tree(const char *root, int num_files);
+void file_name(int i, char *buf, size_t size);
+int compare_doubles(const void *a, const void *b);
+double percentile(double *sorted, int count, double p);
+void report(struct connection *conns, int num_conns, double wall_ms);
+double now_ms();
+
+const char *command_names[NUM_COMMANDS] = { "findfile", "getfiles", "sgetfiles", "dgetfiles", "gettargz" };
+const char *file_types[] = { "txt", "c", "log", "pdf", "bin" };
+#define NUM_FILE_TYPES 5
+
+// benchmark settings, shared read-only by the connection threads
+const char *server_host = "localhost";
+const char *server_port = SERVER_PORT;
+int num_requests = DEFAULT_REQUESTS;
+double duration_ms = 0;
+int num_files = DEFAULT_FILES;
+int use_framing = 1;
+// "name[:level]" offered in HELLO, empty leaves the server at gzip
+const char *codec_offer = "";
+int timeout_seconds = DEFAULT_TIMEOUT;
+int mix_weights[NUM_COMMANDS];
+int mix_total = 0;
+double start_time;
+
+int main(int nargs, char *args[]) {
+    int num_conns = DEFAULT_CONNECTIONS;
+    const char *mix = DEFAULT_MIX;
+    const char *generate_root = NULL;
+    char *matrix = NULL;
+    int opt;
+
+    // parse startup options
+    while ((opt = getopt(nargs, args, "c:n:d:m:f:G:h:p:P:T:z:x:")) != -1) {
+        switch (opt) {
+        case 'c':
+            num_conns = atoi(optarg);
+            break;
+        case 'n':
+            num_requests = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atof(optarg) * 1000;
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'f':
+            num_files = atoi(optarg);
+            break;
+        case 'G':
+            generate_root = optarg;
+            break;
+        case 'h':
+            server_host = optarg;
+            break;
+        case 'p':
+            server_port = optarg;
+            break;
+        case 'P':
+            use_framing = strcmp(optarg, "legacy") != 0;
+            break;
+        case 'T':
+            timeout_seconds = atoi(optarg);
+            break;
+        case 'z':
+            codec_offer = optarg;
+            break;
+        case 'x':
+            matrix = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c connections] [-n requests per connection | -d seconds] "
+                    "[-m findfile=4,getfiles=2,...] [-f files] [-h host] [-p port] [-P framed|legacy] [-T timeout] "
+                    "[-z codec[:level] | -x codec[:level],...]\n"
+                    "       %s -G home-dir [-f files]\n", args[0], args[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_conns < 1 || num_files < 1) {
+        fprintf(stderr, "need at least one connection and one file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the tree is generated once, then the server is started with HOME pointing at it
+    if (generate_root != NULL) {
+        if (generate_tree(generate_root, num_files) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        printf("Generated %d files under %s, start the server with HOME=%s\n", num_files, generate_root, generate_root);
+        return 0;
+    }
+
+    if (parse_mix(mix) == -1) {
+        fprintf(stderr, "bad command mix: %s\n", mix);
+        exit(EXIT_FAILURE);
+    }
+
+    struct connection *conns = calloc(num_conns, sizeof(struct connection));
+    pthread_t *tids = calloc(num_conns, sizeof(pthread_t));
+    if (conns == NULL || tids == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Running %d connections against %s:%s (%s protocol, mix %s)\n", num_conns, server_host, server_port,
+           use_framing ? "framed" : "legacy", mix);
+    if (matrix != NULL) {
+        run_matrix(matrix, conns, tids, num_conns);
+    } else {
+        report(conns, num_conns, run_connections(conns, tids, num_conns));
+    }
+    print_server_stats();
+
+    free_samples(conns, num_conns);
+    free(conns);
+    free(tids);
+    return 0;
+}
+
+// run every connection to the end, returns the wall time in ms
+double run_connections(struct connection *conns, pthread_t *tids, int num_conns) {
+    start_time = now_ms();
+    for (int i = 0; i < num_conns; i++) {
+        conns[i].id = i;
+        conns[i].node = -1;
+        // the same seeds replay the same requests, so runs of a matrix compare like for like
+        conns[i].seed = 0x9e3779b9u * (i + 1);
+        if (pthread_create(&tids[i], NULL, connection_main, &conns[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_conns; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return now_ms() - start_time;
+}
+
+// replay the mix once per codec and compare archive size against speed, store is the baseline
+void run_matrix(char *list, struct connection *conns, pthread_t *tids, int num_conns) {
+    struct matrix_row rows[MAX_MATRIX_CODECS + 1];
+    int num_rows = 0;
+    char *saveptr;
+
+    snprintf(rows[num_rows++].offer, sizeof(rows[0].offer), "store");
+    for (char *offer = strtok_r(list, ",", &saveptr); offer != NULL && num_rows <= MAX_MATRIX_CODECS;
+         offer = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(offer, "store") != 0) {
+            snprintf(rows[num_rows++].offer, sizeof(rows[0].offer), "%s", offer);
+        }
+    }
+
+    for (int i = 0; i < num_rows; i++) {
+        codec_offer = rows[i].offer;
+        free_samples(conns, num_conns);
+        memset(conns, 0, num_conns * sizeof(struct connection));
+        rows[i].wall_ms = run_connections(conns, tids, num_conns);
+        measure_archives(conns, num_conns, &rows[i]);
+        printf("%s: %ld archive bytes in %.2f s\n", rows[i].offer, rows[i].bytes, rows[i].wall_ms / 1000);
+    }
+
+    // tar MB/s is the uncompressed archive data delivered per second, what the client ends up with
+    printf("\n%-10s %-10s %12s %7s %10s %10s %13s %7s\n", "offer", "codec", "bytes", "ratio", "wire MB/s",
+           "tar MB/s", "archive mean", "errors");
+    for (int i = 0; i < num_rows; i++) {
+        double seconds = rows[i].wall_ms / 1000;
+        printf("%-10s %-10s %12ld %7.2f %10.2f %10.2f %10.2f ms %7d\n", rows[i].offer, rows[i].codec, rows[i].bytes,
+               rows[i].bytes > 0 ? (double)rows[0].bytes / rows[i].bytes : 0,
+               rows[i].bytes / seconds / (1 << 20), rows[0].bytes / seconds / (1 << 20), rows[i].mean_ms,
+               rows[i].errors);
+    }
+}
+
+// bytes and mean latency of the archive requests of a run, selections that match nothing would swamp a median
+void measure_archives(struct connection *conns, int num_conns, struct matrix_row *row) {
+    int count = 0;
+    double total_ms = 0;
+
+    row->bytes = 0;
+    row->errors = 0;
+    snprintf(row->codec, sizeof(row->codec), "%s", num_conns > 0 && conns[0].codec[0] != '\0' ? conns[0].codec : "-");
+    for (int i = 0; i < num_conns; i++) {
+        for (int j = 0; j < conns[i].num_samples; j++) {
+            struct sample *s = &conns[i].samples[j];
+            row->errors += s->failed;
+            if (s->command != CMD_FINDFILE) {
+                count++;
+                total_ms += s->ms;
+                row->bytes += s->bytes;
+            }
+        }
+    }
+    row->mean_ms = count > 0 ? total_ms / count : 0;
+}
+
+// the server's own counters, its syscalls per archived file show what -U saves
+void print_server_stats() {
+    char text[BUFFER_SIZE + 1];
+    char codec[32];
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint64_t length;
+    ssize_t n = -1;
+    int node, framed;
+
+    int server_fd = connect_to_server(server_host, server_port);
+    if (server_fd == -1) {
+        return;
+    }
+    server_fd = start_session(server_fd, &node, &framed, codec, sizeof(codec));
+    if (server_fd == -1) {
+        return;
+    }
+    if (framed) {
+        if (send_frame(server_fd, FRAME_COMMAND, 1, "stats", 5) == 0 && recv_all(server_fd, header, sizeof(header)) == 0) {
+            memcpy(&length, header + 8, sizeof(length));
+            length = be64toh(length);
+            if (length <= BUFFER_SIZE && recv_all(server_fd, text, length) == 0) {
+                n = length;
+            }
+        }
+        send_frame(server_fd, FRAME_COMMAND, 2, "quit", 4);
+    } else if (send(server_fd, "stats", 5, MSG_NOSIGNAL) == 5) {
+        n = recv(server_fd, text, BUFFER_SIZE, 0);
+        send(server_fd, "quit", 4, MSG_NOSIGNAL);
+    }
+    close(server_fd);
+    if (n > 0) {
+        text[n] = '\0';
+        printf("\n%s stats since it started:\n%s", node == NODE_SERVER ? "server" : "mirror", text);
+    }
+}
+
+void free_samples(struct connection *conns, int num_conns) {
+    for (int i = 0; i < num_conns; i++) {
+        free(conns[i].samples);
+        conns[i].samples = NULL;
+    }
+}
+
+// connect to primary server/mirror server
+int connect_to_server(const char *server_address, const char *port) {
+    int server_fd = -1;
+    struct addrinfo hints, *res, *p;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int status = getaddrinfo(server_address, port, &hints, &res);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    for (p = res; p != NULL; p = p->ai_next) {
+        server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (server_fd == -1) {
+            continue;
+        }
+        // a response that never completes counts as an error instead of hanging the run
+        struct timeval timeout = { timeout_seconds, 0 };
+        setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (connect(server_fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(server_fd);
+            server_fd = -1;
+            continue;
+        }
+        break;
+    }
+
+    freeaddrinfo(res);
+    return server_fd;
+}
+
+// connect to the first reachable mirror of a "host:port,host:port" list
+int connect_to_mirror(char *mirror_list) {
+    char *saveptr;
+    char *mirror = strtok_r(mirror_list, ",", &saveptr);
+
+    while (mirror != NULL) {
+        char mirror_address[256];
+        char mirror_port[16];
+        if (sscanf(mirror, "%255[^:]:%15s", mirror_address, mirror_port) == 2) {
+            int server_fd = connect_to_server(mirror_address, mirror_port);
+            if (server_fd != -1) {
+                return server_fd;
+            }
+        }
+        mirror = strtok_r(NULL, ",", &saveptr);
+    }
+    return -1;
+}
+
+// same handshake as the interactive client, returns the fd to use
+int start_session(int server_fd, int *node, int *framed, char *codec, size_t codec_size) {
+    char buffer[BUFFER_SIZE];
+
+    memset(buffer, 0, BUFFER_SIZE);
+    send(server_fd, "test", 4, MSG_NOSIGNAL);
+    recv(server_fd, buffer, BUFFER_SIZE - 1, 0);
+
+    *node = NODE_SERVER;
+    // a client turned away as busy has nothing to measure
+    if (strncmp(buffer, "BUSY", 4) == 0) {
+        close(server_fd);
+        return -1;
+    }
+    if (strncmp(buffer, "REDIRECT:", 9) == 0) {
+        close(server_fd);
+        server_fd = connect_to_mirror(buffer + 9);
+        if (server_fd == -1) {
+            return -1;
+        }
+        *node = NODE_MIRROR;
+    }
+
+    *framed = use_framing ? negotiate_framing(server_fd, codec, codec_size) : 0;
+    return server_fd;
+}
+
+// offer the framed protocol and codec, returns 1 if the server accepted it
+int negotiate_framing(int server_fd, char *codec, size_t codec_size) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    char reply[64];
+    uint64_t length;
+
+    if (send_frame(server_fd, FRAME_HELLO, 0, codec_offer, strlen(codec_offer)) != 0 ||
+        recv_all(server_fd, header, sizeof(header)) != 0) {
+        return 0;
+    }
+    if (header[0] != FRAME_MAGIC0 || header[1] != FRAME_MAGIC1 || header[2] != FRAME_VERSION || header[3] != FRAME_HELLO) {
+        return 0;
+    }
+    // the answer names the codec and level the server picked, nothing means gzip
+    memcpy(&length, header + 8, sizeof(length));
+    length = be64toh(length);
+    if (length >= sizeof(reply) || recv_all(server_fd, reply, length) != 0) {
+        return 0;
+    }
+    reply[length] = '\0';
+    // a server that offers striping says so after the level, the matrix only shows the codec
+    char *feature = strstr(reply, " stripe");
+    if (feature != NULL) {
+        *feature = '\0';
+    }
+    snprintf(codec, codec_size, "%s", length > 0 ? reply : "gzip");
+    return 1;
+}
+
+// one connection replaying the command mix until its request count or the duration runs out
+void *connection_main(void *arg) {
+    struct connection *conn = arg;
+    char text[BUFFER_SIZE];
+    int framed;
+
+    int server_fd = connect_to_server(server_host, server_port);
+    if (server_fd == -1) {
+        fprintf(stderr, "connection %d: failed to connect\n", conn->id);
+        return NULL;
+    }
+    server_fd = start_session(server_fd, &conn->node, &framed, conn->codec, sizeof(conn->codec));
+    if (server_fd == -1) {
+        fprintf(stderr, "connection %d: server busy or mirror unreachable\n", conn->id);
+        return NULL;
+    }
+
+    for (int i = 0; duration_ms > 0 ? now_ms() - start_time < duration_ms : i < num_requests; i++) {
+        struct sample s = {0};
+        int command = pick_command(&conn->seed);
+
+        build_command(command, &conn->seed, text, sizeof(text));
+        double begin = now_ms();
+        s.failed = run_request(server_fd, framed, command, text, &s.bytes) != 0;
+        s.ms = now_ms() - begin;
+        s.command = command;
+        s.node = conn->node;
+
+        if (conn->num_samples == conn->capacity) {
+            int new_capacity = conn->capacity ? conn->capacity * 2 : 256;
+            struct sample *samples = realloc(conn->samples, new_capacity * sizeof(struct sample));
+            if (samples == NULL) {
+                perror("realloc failed");
+                break;
+            }
+            conn->samples = samples;
+            conn->capacity = new_capacity;
+        }
+        conn->samples[conn->num_samples++] = s;
+
+        // a broken connection leaves nothing more to measure
+        if (s.failed) {
+            break;
+        }
+    }
+
+    if (framed) {
+        send_frame(server_fd, FRAME_COMMAND, 0, "quit", 4);
+    } else {
+        send(server_fd, "quit", 4, MSG_NOSIGNAL);
+    }
+    close(server_fd);
+    return NULL;
+}
+
+// weighted random choice from the command mix
+int pick_command(unsigned int *seed) {
+    int r = rand_r(seed) % mix_total;
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        if (r < mix_weights[i]) {
+            return i;
+        }
+        r -= mix_weights[i];
+    }
+    return CMD_FINDFILE;
+}
+
+// build a command over the files generate_tree created
+void build_command(int command, unsigned int *seed, char *buf, size_t size) {
+    char name1[64], name2[64];
+    int low, high;
+
+    file_name(rand_r(seed) % num_files, name1, sizeof(name1));
+    file_name(rand_r(seed) % num_files, name2, sizeof(name2));
+    switch (command) {
+    case CMD_FINDFILE:
+        snprintf(buf, size, "findfile %s", name1);
+        break;
+    case CMD_GETFILES:
+        snprintf(buf, size, "getfiles %s %s", name1, name2);
+        break;
+    case CMD_SGETFILES:
+        // a window of about 1% of the generated sizes
+        low = rand_r(seed) % 65000;
+        snprintf(buf, size, "sgetfiles %d %d", low, low + 650);
+        break;
+    case CMD_DGETFILES:
+        // one day out of the generated year
+        low = rand_r(seed) % 364;
+        high = low + 1;
+        snprintf(buf, size, "dgetfiles 2023-%02d-%02d 2023-%02d-%02d",
+                 low / 28 % 12 + 1, low % 28 + 1, high / 28 % 12 + 1, high % 28 + 1);
+        break;
+    default:
+        snprintf(buf, size, "gettargz %s", file_types[rand_r(seed) % NUM_FILE_TYPES]);
+        break;
+    }
+}
+
+// send one command and read its whole response, returns -1 if the connection broke
+int run_request(int server_fd, int framed, int command, const char *text, long *bytes) {
+    static uint32_t next_request_id = 1;
+
+    if (framed) {
+        uint32_t request_id = __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED);
+        if (send_frame(server_fd, FRAME_COMMAND, request_id, text, strlen(text)) != 0) {
+            return -1;
+        }
+        return recv_framed_response(server_fd, request_id, bytes);
+    }
+
+    if (send(server_fd, text, strlen(text), MSG_NOSIGNAL) == -1) {
+        return -1;
+    }
+    return recv_legacy_response(server_fd, command, bytes);
+}
+
+// findfile answers with text, the archive commands with size, body and trailer
+int recv_legacy_response(int server_fd, int command, long *bytes) {
+    char buffer[BUFFER_SIZE];
+    long file_size = 0;
+
+    if (command == CMD_FINDFILE) {
+        ssize_t n = recv(server_fd, buffer, sizeof(buffer), 0);
+        *bytes = n;
+        return n > 0 ? 0 : -1;
+    }
+
+    if (recv_all(server_fd, &file_size, sizeof(long)) != 0) {
+        return -1;
+    }
+    // an archive this small holds no files and nothing follows the size
+    if (file_size <= 50) {
+        return 0;
+    }
+    *bytes = file_size;
+    if (discard_bytes(server_fd, file_size) != 0 || recv_all(server_fd, buffer, 12) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// read frames up to the one that answers request_id
+int recv_framed_response(int server_fd, uint32_t request_id, long *bytes) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint32_t id;
+    uint64_t length;
+
+    while (1) {
+        if (recv_all(server_fd, header, sizeof(header)) != 0 || header[0] != FRAME_MAGIC0 || header[1] != FRAME_MAGIC1 ||
+            header[2] != FRAME_VERSION) {
+            return -1;
+        }
+        memcpy(&id, header + 4, sizeof(id));
+        memcpy(&length, header + 8, sizeof(length));
+        length = be64toh(length);
+        if (discard_bytes(server_fd, length) != 0) {
+            return -1;
+        }
+        // a transfer id comes ahead of the archive that answers the request
+        if (header[3] == FRAME_TRANSFER) {
+            continue;
+        }
+        *bytes = length;
+        if (be32toh(id) != request_id) {
+            return -1;
+        }
+        return header[3] == FRAME_ERROR ? -1 : 0;
+    }
+}
+
+// send a frame header followed by its payload
+int send_frame(int server_fd, int type, uint32_t request_id, const char *payload, size_t length) {
+    unsigned char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    uint32_t id = htobe32(request_id);
+    uint64_t len = htobe64(length);
+
+    if (length > BUFFER_SIZE) {
+        return -1;
+    }
+    frame[0] = FRAME_MAGIC0;
+    frame[1] = FRAME_MAGIC1;
+    frame[2] = FRAME_VERSION;
+    frame[3] = type;
+    memcpy(frame + 4, &id, sizeof(id));
+    memcpy(frame + 8, &len, sizeof(len));
+    if (length > 0) {
+        memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    }
+
+    size_t total = FRAME_HEADER_SIZE + length;
+    size_t sent = 0;
+    while (sent < total) {
+        ssize_t n = send(server_fd, frame + sent, total - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// read exactly len bytes
+int recv_all(int server_fd, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(server_fd, (char *)buf + received, len - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+// read and drop a response body, the benchmark only times it
+int discard_bytes(int server_fd, uint64_t length) {
+    char buffer[RECV_CHUNK];
+    while (length > 0) {
+        ssize_t n = recv(server_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+// parse "findfile=4,getfiles=2,..." into command weights
+int parse_mix(const char *mix) {
+    char buf[BUFFER_SIZE];
+    char *saveptr;
+
+    snprintf(buf, sizeof(buf), "%s", mix);
+    memset(mix_weights, 0, sizeof(mix_weights));
+    mix_total = 0;
+
+    for (char *item = strtok_r(buf, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(item, '=');
+        int weight = eq != NULL ? atoi(eq + 1) : 1;
+        int found = 0;
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        for (int i = 0; i < NUM_COMMANDS; i++) {
+            if (strcmp(item, command_names[i]) == 0 && weight >= 0) {
+                mix_weights[i] = weight;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        mix_total += mix_weights[i];
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+// name of the i-th generated file, unique so findfile and getfiles always hit
+void file_name(int i, char *buf, size_t size) {
+    snprintf(buf, size, "bench%d.%s", i, file_types[i % NUM_FILE_TYPES]);
+}
+
+// create num_files files spread over directories, with sizes up to 64 KiB and mtimes over 2023
+int generate_tree(const char *root, int num_files) {
+    char path[PATH_MAX];
+    char name[64];
+    char data[65536];
+    struct tm tm = {0};
+
+    tm.tm_year = 2023 - 1900;
+    tm.tm_mday = 1;
+    tm.tm_isdst = -1;
+    time_t year_start = mktime(&tm);
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        // text-like content so compression behaves as it would on real files
+        data[i] = "abcdefghij klmnopqrstuvwxyz\n"[(i * 7 + i / 13) % 28];
+    }
+
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    for (int i = 0; i < num_files; i++) {
+        if (i % FILES_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "%s/dir%d", root, i / FILES_PER_DIR);
+            if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+                perror("mkdir");
+                return -1;
+            }
+        }
+
+        file_name(i, name, sizeof(name));
+        snprintf(path, sizeof(path), "%s/dir%d/%s", root, i / FILES_PER_DIR, name);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+        size_t size = (i * 7919u) % sizeof(data);
+        if (write(fd, data, size) != (ssize_t)size) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        close(fd);
+
+        struct timeval times[2];
+        times[0].tv_sec = times[1].tv_sec = year_start + (time_t)(i * 104729u % 365) * 86400 + 43200;
+        times[0].tv_usec = times[1].tv_usec = 0;
+        utimes(path, times);
+    }
+    return 0;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of sorted values
+double percentile(double *sorted, int count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    int rank = (int)(p / 100 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank > count ? count - 1 : rank - 1];
+}
+
+// print throughput and latency percentiles per command and per node
+void report(struct connection *conns, int num_conns, double wall_ms) {
+    int total = 0;
+    int errors = 0;
+    long bytes = 0;
+    int node_conns[2] = {0};
+
+    for (int i = 0; i < num_conns; i++) {
+        total += conns[i].num_samples;
+        if (conns[i].node >= 0) {
+            node_conns[conns[i].node]++;
+        }
+    }
+    double *values = malloc((total > 0 ? total : 1) * sizeof(double));
+    if (values == NULL) {
+        perror("malloc failed");
+        return;
+    }
+
+    printf("\n%-10s %8s %7s %10s %10s %10s %10s\n", "command", "count", "errors", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (int command = 0; command < NUM_COMMANDS; command++) {
+        int count = 0;
+        int failed = 0;
+        for (int i = 0; i < num_conns; i++) {
+            for (int j = 0; j < conns[i].num_samples; j++) {
+                struct sample *s = &conns[i].samples[j];
+                if (s->command == command) {
+                    values[count++] = s->ms;
+                    failed += s->failed;
+                    bytes += s->bytes;
+                }
+            }
+        }
+        errors += failed;
+        if (count == 0) {
+            continue;
+        }
+        qsort(values, count, sizeof(double), compare_doubles);
+        printf("%-10s %8d %7d %10.2f %10.2f %10.2f %10.2f\n", command_names[command], count, failed,
+               percentile(values, count, 50), percentile(values, count, 95), percentile(values, count, 99),
+               values[count - 1]);
+    }
+
+    printf("\n%-10s %8s %8s %10s %10s\n", "node", "conns", "requests", "p50 ms", "p99 ms");
+    for (int node = NODE_SERVER; node <= NODE_MIRROR; node++) {
+        int count = 0;
+        for (int i = 0; i < num_conns; i++) {
+            for (int j = 0; j < conns[i].num_samples; j++) {
+                if (conns[i].samples[j].node == node) {
+                    values[count++] = conns[i].samples[j].ms;
+                }
+            }
+        }
+        qsort(values, count, sizeof(double), compare_doubles);
+        printf("%-10s %8d %8d %10.2f %10.2f\n", node == NODE_SERVER ? "server" : "mirror", node_conns[node], count,
+               percentile(values, count, 50), percentile(values, count, 99));
+    }
+
+    printf("\n%d requests (%d errors) in %.2f s: %.1f req/s, %.2f MB/s\n", total, errors, wall_ms / 1000,
+           total / (wall_ms / 1000), bytes / (wall_ms / 1000) / (1 << 20));
+    free(values);
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
@@ -5,23 +5,233 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <endian.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define SERVER_PORT "65001"
 #define BUFFER_SIZE 1024
-#define TAR_FILE "temp.tar.gz"
+#define MAX_PIPELINE 16
+#define RECV_CHUNK 65536
+#define RESUME_ATTEMPTS 3
+#define BUSY_ATTEMPTS 3
+#define MAX_TEXT_RESPONSE (16 * 1024 * 1024)
+#define MAX_DELTA_NAMES 10
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+#define DELTA_SIGNATURE_HEADER 16
+#define DELTA_ENTRY_LEN 20
+#define DELTA_FILE_HEADER 36
+#define DELTA_SEED0 14695981039346656037ULL
+#define DELTA_SEED1 0x9e3779b97f4a7c15ULL
+#define MAX_STRIPES 16
+#define STRIPE_MAX_CHUNKS 64
+
+// framed protocol: 16 byte header of magic "FS", version, type, request id and payload length
+#define FRAME_MAGIC0 'F'
+#define FRAME_MAGIC1 'S'
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define FRAME_HELLO 1
+#define FRAME_COMMAND 2
+#define FRAME_TEXT 3
+#define FRAME_ARCHIVE 4
+#define FRAME_ERROR 5
+#define FRAME_TRANSFER 6
+#define FRAME_DELTA 7
+#define FRAME_STRIPE 8
+
+// how far each chunk of a striped archive got
+#define CHUNK_PENDING 0
+#define CHUNK_DONE 1
+#define CHUNK_FAILED 2
+
+// delta reply operations: end of file, copy a run of our blocks, literal bytes
+#define DELTA_END 0
+#define DELTA_COPY 1
+#define DELTA_LITERAL 2
+
+// archive codecs, numbered like the server's
+#define CODEC_GZIP 0
+#define CODEC_STORE 1
+#define CODEC_ZSTD 2
+#define CODEC_LZ4 3
+#define NUM_CODECS 4
+#define LZ4F_API_VERSION 100
+
+// one validated command of an input line
+struct client_command {
+    char text[BUFFER_SIZE];
+    int is_quit;
+    int is_text;
+    int is_resume;
+    int is_delta;
+    int is_codec;
+    int is_archive;
+    int unzip;
+    // local copies the delta request was computed against, one per name
+    char *basis[MAX_DELTA_NAMES];
+};
+
+// id and full size the server keeps the current archive under, for resuming it
+struct transfer {
+    char id[64];
+    uint64_t total;
+    // set when the archive is striped: chunk size and the crc32 of every chunk
+    uint64_t chunk;
+    int num_chunks;
+    uint32_t crc[STRIPE_MAX_CHUNKS];
+};
+
+// a striped archive on its way into the archive file, shared by the connections fetching it
+struct stripe_download {
+    struct transfer *transfer;
+    int out_fd;
+    char host[256];
+    char port[16];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int state[STRIPE_MAX_CHUNKS];
+    int running;
+};
+
+// one connection fetching a striped archive and the chunks it asks for
+struct stripe {
+    struct stripe_download *download;
+    pthread_t thread;
+    // the session connection, or -1 to open one
+    int fd;
+    uint32_t first_id;
+    int chunks[STRIPE_MAX_CHUNKS];
+    int num_chunks;
+    // chunks already asked for before the stripe started
+    int num_sent;
+    int started;
+    // the session connection broke or lost track of its responses
+    int lost;
+};
+
+// an archive codec and where its downloads are kept
+struct codec {
+    const char *name;
+    const char *file;
+    int available;
+};
+
+// ZSTD_inBuffer and ZSTD_outBuffer share this layout
+struct zstd_buffer {
+    void *data;
+    size_t size;
+    size_t pos;
+};
+
+// zstd and lz4 decoders, loaded at startup; tar undoes gzip itself
+struct codec_api {
+    void *(*zstd_create)(void);
+    size_t (*zstd_free)(void *dctx);
+    size_t (*zstd_decompress)(void *dctx, struct zstd_buffer *out, struct zstd_buffer *in);
+    unsigned (*zstd_is_error)(size_t code);
+    size_t (*lz4_create)(void **dctx, unsigned version);
+    size_t (*lz4_free)(void *dctx);
+    size_t (*lz4_decompress)(void *dctx, void *dst, size_t *dst_size, const void *src, size_t *src_size,
+                             const void *options);
+    unsigned (*lz4_is_error)(size_t code);
+};
+
+// decompression state of one archive on its way into tar
+struct decoder {
+    int codec;
+    void *ctx;
+};
+
+// where the session is connected, a broken transfer reconnects here
+char session_host[256];
+char session_port[16];
+uint32_t next_request_id = 1;
+int session_generation = 0;
+
+// codecs this client can decode, offered in order of preference on every new connection
+struct codec codecs[NUM_CODECS] = {
+    { "gzip", "temp.tar.gz", 1 },
+    { "store", "temp.tar", 1 },
+    { "zstd", "temp.tar.zst", 0 },
+    { "lz4", "temp.tar.lz4", 0 },
+};
+struct codec_api codec_api;
+char codec_offer[BUFFER_SIZE];
+int session_codec = CODEC_GZIP;
+// connections a large archive is fetched over, and whether the server offers striping
+int session_stripes = 1;
+int server_stripes = 0;
+// zlib's crc32 checks the chunks of striped archives, without it archives come over one connection
+unsigned long (*zlib_crc32)(unsigned long crc, const unsigned char *buf, unsigned len);
 
 int connect_to_server(const char *server_address, const char *port);
+int open_connection(const char *server_address, const char *port);
+int connect_to_mirror(char *mirror_list);
 void communicate_with_server(int server_fd);
-int receive_tar(int serverfd);
-void extract_tar();
+int parse_command(char *text, struct client_command *cmd);
+int run_legacy_command(int server_fd, struct client_command *cmd);
+int run_framed_commands(int *server_fd, struct client_command *cmds, int num_cmds);
+int start_session(int server_fd, int *framed);
+int negotiate_framing(int server_fd);
+void codecs_init();
+int codec_by_name(const char *name);
+void set_session_codec(const char *reply);
+int decoder_open(struct decoder *d, int codec);
+int decoder_write(struct decoder *d, int fd, const void *data, size_t len);
+void decoder_close(struct decoder *d);
+int recv_archive_header(int server_fd, int *type, uint32_t *request_id, uint64_t *length, struct transfer *transfer);
+int resume_transfer(int *server_fd, struct transfer *transfer, uint64_t offset, uint64_t *length);
+int reconnect_session(int *server_fd);
+int receive_striped(int *server_fd, uint64_t length, int unzip, int last, struct transfer *transfer);
+void *stripe_main(void *arg);
+void fetch_chunks(struct stripe *stripe);
+int stripe_connect(const char *host, const char *port);
+int receive_chunk(int fd, struct stripe_download *d, int index);
+void set_chunk_state(struct stripe_download *d, int index, int state);
+int send_frame(int server_fd, int type, uint32_t request_id, const char *payload, size_t length);
+int recv_frame_header(int server_fd, int *type, uint32_t *request_id, uint64_t *length);
+int recv_all(int server_fd, void *buf, size_t len);
+int send_command(int server_fd, uint32_t request_id, struct client_command *cmd);
+int send_delta_request(int server_fd, uint32_t request_id, struct client_command *cmd);
+int append_signature(unsigned char **frame, size_t *len, size_t *capacity, const char *path);
+int receive_delta(int server_fd, uint64_t length, struct client_command *cmd);
+int apply_delta(int server_fd, const char *basis, uint64_t *consumed);
+int write_delta_ops(int server_fd, int fd, int basis_fd, uint64_t basis_size, unsigned long long *sum,
+                    uint64_t *written, uint64_t *consumed);
+int find_local_copy(const char *dir, const char *name, char *out, size_t size);
+void make_parent_dirs(const char *path);
+uint32_t delta_block_size(uint64_t size);
+void weak_sum(const unsigned char *data, uint32_t len, uint32_t *a, uint32_t *b);
+void strong_sum(unsigned long long *sum, const void *data, size_t len);
+void put_be(unsigned char *ptr, uint64_t value, int bytes);
+uint64_t get_be(const unsigned char *ptr, int bytes);
+int write_all(int fd, const void *buf, size_t len);
+int receive_tar(int serverfd, int unzip, int append);
+int receive_archive(int *serverfd, uint64_t length, int unzip, int append, struct transfer *transfer);
+int start_extractor(pid_t *pid, int gzip);
+int finish_extractor(pid_t pid);
 void invalid_command();
 int validate_dgetfiles(char *date1, char *date2);
 
 int main() {
+    // an extractor that exits early must not kill the client mid-download
+    signal(SIGPIPE, SIG_IGN);
+    codecs_init();
+
     int server_fd = connect_to_server("localhost", SERVER_PORT);
     if (server_fd == -1) {
         fprintf(stderr, "Failed to connect to the main server.\n");
@@ -33,8 +243,20 @@ int main() {
     return 0;
 }
 
-// connect to primary server/mirror server
+// connect to primary server/mirror server, later reconnects go to the same one
 int connect_to_server(const char *server_address, const char *port) {
+    int server_fd = open_connection(server_address, port);
+
+    // a reconnect passes the session's own host and port back in
+    if (server_fd != -1 && server_address != session_host) {
+        snprintf(session_host, sizeof(session_host), "%s", server_address);
+        snprintf(session_port, sizeof(session_port), "%s", port);
+    }
+    return server_fd;
+}
+
+// open a TCP connection to address and port
+int open_connection(const char *server_address, const char *port) {
     int server_fd;
     struct addrinfo hints, *res, *p;
 
@@ -67,6 +289,7 @@ int connect_to_server(const char *server_address, const char *port) {
 
     if (p == NULL) {
         fprintf(stderr, "Failed to connect\n");
+        freeaddrinfo(res);
         return -1;
     }
 
@@ -74,240 +297,1637 @@ int connect_to_server(const char *server_address, const char *port) {
     return server_fd;
 }
 
+// connect to the first reachable mirror of a "host:port,host:port" list
+int connect_to_mirror(char *mirror_list) {
+    char *saveptr;
+    char *mirror = strtok_r(mirror_list, ",", &saveptr);
+
+    while (mirror != NULL) {
+        char mirror_address[256];
+        int mirror_port;
+        if (sscanf(mirror, "%255[^:]:%d", mirror_address, &mirror_port) == 2) {
+            printf("Redirecting to mirror server at %s:%d...\n", mirror_address, mirror_port);
+
+            // Connect to the mirror server
+            char mirror_port_str[16];
+            snprintf(mirror_port_str, sizeof(mirror_port_str), "%d", mirror_port);
+            int server_fd = connect_to_server(mirror_address, mirror_port_str);
+            if (server_fd != -1) {
+                return server_fd;
+            }
+        }
+        // mirror is down, fail over to the next one
+        mirror = strtok_r(NULL, ",", &saveptr);
+    }
+    return -1;
+}
+
 // send commands to server
 void communicate_with_server(int server_fd) {
     char buffer[BUFFER_SIZE];
-    ssize_t num_bytes_received, num_bytes_sent;
-    const char *quit_command = "quit";
-    int input_cmd_size = 0;
-    int is_quit = 0;
-    int is_first_cmd = 1;
+    struct client_command cmds[MAX_PIPELINE];
+    int framed;
+
+    server_fd = start_session(server_fd, &framed);
+    if (server_fd == -1) {
+        return;
+    }
 
     while (1) {
-        // check if the command will be processed by primary server or mirror server
-        if (is_first_cmd == 1) {
-            send(server_fd, "test", 4, 0);
-            recv(server_fd, buffer, BUFFER_SIZE, 0);
-
-            if (strncmp(buffer, "REDIRECT:", 9) == 0) {
-                char mirror_address[256];
-                int mirror_port;
-                sscanf(buffer, "REDIRECT:%255[^:]:%d", mirror_address, &mirror_port);
-
-                printf("Redirecting to mirror server at %s:%d...\n", mirror_address, mirror_port);
-                close(server_fd);
-
-                // Connect to the mirror server
-                char mirror_port_str[16];
-                snprintf(mirror_port_str, sizeof(mirror_port_str), "%d", mirror_port);
-                server_fd = connect_to_server(mirror_address, mirror_port_str);
-                if (server_fd == -1) {
-                    fprintf(stderr, "Failed to connect to the mirror server.\n");
+        fflush(stdout);
+        printf("Enter command: ");
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+            strcpy(buffer, "quit\n");
+        }
+
+        // several commands may be given on one line separated by ';'
+        int num_cmds = 0;
+        char *saveptr;
+        char *text = strtok_r(buffer, ";\n", &saveptr);
+        while (text != NULL && num_cmds < MAX_PIPELINE) {
+            if (parse_command(text, &cmds[num_cmds]) == 0) {
+                num_cmds++;
+                // nothing after a quit is sent
+                if (cmds[num_cmds - 1].is_quit) {
                     break;
                 }
             }
-            is_first_cmd = 0;
+            text = strtok_r(NULL, ";\n", &saveptr);
+        }
+        if (num_cmds == 0) {
             continue;
         }
-        fflush(stdout);
-        printf("Enter command: ");
-        char* command;
-        fgets(buffer, BUFFER_SIZE, stdin);
-        input_cmd_size = strlen(buffer);
-        command = malloc(input_cmd_size + 1);
-        strcpy(command, buffer);
-
-        // splitting command entered by user based on delimiter(space)
-        char *token = strtok(buffer, " ");
-        int argc = 0;
-        char *argv[10];
-        while (token != NULL) {
-            argv[argc++] = token;
-            token = strtok(NULL, " ");
-        }
-
-        if (argc == 1) {
-            if (strncmp(argv[0], "quit", 4) == 0) {
-                is_quit = 1;
-            } else {
-                invalid_command();
-                continue;
+
+        if (framed) {
+            int done = run_framed_commands(&server_fd, cmds, num_cmds);
+            for (int i = 0; i < num_cmds; i++) {
+                for (int j = 0; j < MAX_DELTA_NAMES; j++) {
+                    free(cmds[i].basis[j]);
+                }
             }
+            if (done) {
+                break;
+            }
+            continue;
         }
 
-        // Validate command entered by user
-        if (strncmp(argv[0], "findfile", 8) == 0) {
-            if (argc != 2) {
-                invalid_command();
-                continue;
-            }     
-        } else if (strcmp(argv[0], "sgetfiles") == 0) {
-            if (argc < 3 || argc > 4 || (argc == 4 && strncmp(argv[3], "-u", 2) != 0)) {
-                invalid_command();
-                continue;
-            }
+        int done = 0;
+        for (int i = 0; i < num_cmds && !done; i++) {
+            done = run_legacy_command(server_fd, &cmds[i]);
+        }
+        if (done) {
+            break;
+        }
+    }
+}
 
-            int size1 = atoi(argv[1]);
-            int size2 = atoi(argv[2]);
-            if (!(size1 >= 0 && size2 >= 0 && size1 <= size2)) {
-                invalid_command();
-                printf("Usage2: sgets size1 size2 <-u>\n");
-                printf("size >= 0, size2 >= 0 and size1 <= 2\n");
-                continue;
-            }
-        } else if (strncmp(argv[0], "dgetfiles", 9) == 0) {
-            if (argc < 3 || argc > 4 || ( argc == 4 && strncmp(argv[3], "-u", 2) != 0)) {
+// pick primary or mirror and the protocol for a new connection, returns the fd to use
+int start_session(int server_fd, int *framed) {
+    char buffer[BUFFER_SIZE];
+
+    // check if the commands will be processed by primary server or mirror server
+    memset(buffer, 0, BUFFER_SIZE);
+    send(server_fd, "test", 4, 0);
+    recv(server_fd, buffer, BUFFER_SIZE - 1, 0);
+
+    // a full server says when to come back instead of keeping us in its queue
+    for (int attempt = 1; strncmp(buffer, "BUSY", 4) == 0; attempt++) {
+        int retry_after = 1;
+        sscanf(buffer, "BUSY retry-after %d", &retry_after);
+        close(server_fd);
+        if (attempt > BUSY_ATTEMPTS) {
+            fprintf(stderr, "Server busy, giving up.\n");
+            return -1;
+        }
+        printf("Server busy, retrying in %d s...\n", retry_after);
+        sleep(retry_after > 0 ? retry_after : 1);
+
+        server_fd = connect_to_server(session_host, session_port);
+        if (server_fd == -1) {
+            return -1;
+        }
+        memset(buffer, 0, BUFFER_SIZE);
+        send(server_fd, "test", 4, MSG_NOSIGNAL);
+        recv(server_fd, buffer, BUFFER_SIZE - 1, 0);
+    }
+
+    if (strncmp(buffer, "REDIRECT:", 9) == 0) {
+        close(server_fd);
+        server_fd = connect_to_mirror(buffer + 9);
+        if (server_fd == -1) {
+            fprintf(stderr, "Failed to connect to the mirror server.\n");
+            return -1;
+        }
+    }
+
+    // servers that know the framed protocol answer HELLO, older ones keep the text protocol
+    *framed = negotiate_framing(server_fd);
+    return server_fd;
+}
+
+// validate one command entered by user, returns 1 if it is invalid
+int parse_command(char *text, struct client_command *cmd) {
+    char buffer[BUFFER_SIZE];
+
+    while (*text == ' ') {
+        text++;
+    }
+    memset(cmd, 0, sizeof(*cmd));
+    snprintf(cmd->text, sizeof(cmd->text), "%s", text);
+    snprintf(buffer, sizeof(buffer), "%s", text);
+
+    // splitting command entered by user based on delimiter(space)
+    char *token = strtok(buffer, " ");
+    int argc = 0;
+    char *argv[10];
+    while (token != NULL && argc < 10) {
+        argv[argc++] = token;
+        token = strtok(NULL, " ");
+    }
+
+    if (argc == 0) {
+        invalid_command();
+        return 1;
+    }
+    if (argc == 1) {
+        if (strncmp(argv[0], "quit", 4) == 0) {
+            cmd->is_quit = 1;
+        } else if (strcmp(argv[0], "stats") == 0) {
+            // counters and latencies of the server, answered with text like findfile
+            cmd->is_text = 1;
+            return 0;
+        } else {
+            invalid_command();
+            return 1;
+        }
+    }
+
+    // Validate command entered by user
+    if (strncmp(argv[0], "findfile", 8) == 0) {
+        if (argc < 2) {
+            invalid_command();
+            return 1;
+        }
+        cmd->is_text = 1;
+    } else if (strcmp(argv[0], "stripes") == 0) {
+        int stripes = atoi(argv[1]);
+        if (argc != 2 || stripes < 1 || stripes > MAX_STRIPES) {
+            invalid_command();
+            printf("Usage: stripes connections (1 to %d)\n", MAX_STRIPES);
+            return 1;
+        }
+        // a setting of this client, nothing is sent
+        session_stripes = stripes;
+        printf("Large archives are fetched over %d connection%s\n", stripes, stripes > 1 ? "s" : "");
+        return 1;
+    } else if (strcmp(argv[0], "sgetfiles") == 0) {
+        if (argc < 3 || argc > 4 || (argc == 4 && strncmp(argv[3], "-u", 2) != 0)) {
+            invalid_command();
+            return 1;
+        }
+
+        int size1 = atoi(argv[1]);
+        int size2 = atoi(argv[2]);
+        if (!(size1 >= 0 && size2 >= 0 && size1 <= size2)) {
+            invalid_command();
+            printf("Usage2: sgets size1 size2 <-u>\n");
+            printf("size >= 0, size2 >= 0 and size1 <= 2\n");
+            return 1;
+        }
+    } else if (strncmp(argv[0], "dgetfiles", 9) == 0) {
+        if (argc < 3 || argc > 4 || ( argc == 4 && strncmp(argv[3], "-u", 2) != 0)) {
+            invalid_command();
+            return 1;
+        }
+
+        if (validate_dgetfiles(argv[1], argv[2]) == 1) {
+            return 1;
+        }
+    } else if (strcmp(argv[0], "codec") == 0) {
+        int codec = codec_by_name(argv[1]);
+        if (argc > 3 || codec == -1) {
+            invalid_command();
+            printf("Usage: codec gzip|zstd|lz4|store <level>\n");
+            return 1;
+        }
+        if (!codecs[codec].available) {
+            printf("This client cannot decode %s\n", argv[1]);
+            return 1;
+        }
+        // asked for on its own, with gzip to fall back on if the server lacks it
+        cmd->is_codec = 1;
+        snprintf(cmd->text, sizeof(cmd->text), "%s%s%s gzip", argv[1], argc == 3 ? ":" : "", argc == 3 ? argv[2] : "");
+        return 0;
+    } else if (strncmp(argv[0], "getfiles", 8) == 0 || strncmp(argv[0], "gettargz", 8) == 0) {
+        if ((argc < 2 || argc > 8) || ( argc == 8 && strncmp(argv[7], "-u", 2) != 0 && strcmp(argv[7], "-d") != 0)) {
+            invalid_command();
+            return 1;
+        }
+
+        // -d updates local copies in place from the blocks that changed
+        if (strcmp(argv[0], "getfiles") == 0 && strcmp(argv[argc - 1], "-d") == 0) {
+            if (argc < 3) {
                 invalid_command();
-                continue;
-            }
-            
-            int res = validate_dgetfiles(argv[1], argv[2]);
-            if (res == 1) {
-                continue;
+                printf("Usage: getfiles file1 <file2 ... file6> -d\n");
+                return 1;
             }
-        } else if (strncmp(argv[0], "getfiles", 8) == 0 || strncmp(argv[0], "gettargz", 8) == 0) {
-            if ((argc < 2 || argc > 8) || ( argc == 8 && strncmp(argv[7], "-u", 2) != 0)) {
-                invalid_command();
-                continue;
+            cmd->is_delta = 1;
+            snprintf(cmd->text, sizeof(cmd->text), "%s", argv[0]);
+            for (int i = 1; i < argc - 1; i++) {
+                snprintf(cmd->text + strlen(cmd->text), sizeof(cmd->text) - strlen(cmd->text), " %s", argv[i]);
             }
         }
-        else if (strncmp(argv[0], "quit", 4) == 0) {
-            
-        } else {
+    } else if (strcmp(argv[0], "resume") == 0) {
+        struct stat sb;
+        if (argc < 2 || argc > 3 || (argc == 3 && strncmp(argv[2], "-u", 2) != 0)) {
             invalid_command();
-            continue;
+            printf("Usage: resume transfer-id <-u>\n");
+            return 1;
+        }
+
+        // continue after what the partial archive already holds
+        cmd->is_resume = 1;
+        snprintf(cmd->text, sizeof(cmd->text), "resume %s %ld", argv[1],
+                 stat(codecs[session_codec].file, &sb) == 0 ? (long)sb.st_size : 0L);
+    } else if (strncmp(argv[0], "quit", 4) != 0) {
+        invalid_command();
+        return 1;
+    }
+
+    cmd->unzip = argc > 1 && strncmp(argv[argc - 1], "-u", 2) == 0;
+    cmd->is_archive = !cmd->is_quit && !cmd->is_text && !cmd->is_resume && !cmd->is_delta;
+    return 0;
+}
+
+// send one command with the text protocol and handle its response, returns 1 when done
+int run_legacy_command(int server_fd, struct client_command *cmd) {
+    char buffer[BUFFER_SIZE];
+    ssize_t num_bytes_received;
+    const char *quit_command = "quit";
+
+    if (cmd->is_delta) {
+        printf("Delta transfer needs a server that speaks the framed protocol\n");
+        return 0;
+    }
+    if (cmd->is_codec) {
+        printf("Choosing a codec needs a server that speaks the framed protocol\n");
+        return 0;
+    }
+
+    // Send the command to the server
+    if (send(server_fd, cmd->text, strlen(cmd->text), 0) == -1) {
+        perror("send");
+        return 1;
+    }
+
+    // handle server response based on command entered by user
+    if (!cmd->is_quit && !cmd->is_text) {
+        int res = receive_tar(server_fd, cmd->unzip, cmd->is_resume);
+        if (res == 1) {
+            printf("No files found\n");
+        } else if (res == -1) {
+            return 1;
         }
+        fflush(stdout);
+        return 0;
+    }
+
+    memset(buffer, 0, BUFFER_SIZE);
+
+    // Receive the server's response
+    // reachable only for text replies such as findfile, stats and quit
+    num_bytes_received = recv(server_fd, buffer, BUFFER_SIZE - 1, 0);
+    if (num_bytes_received <= 0) {
+        perror("recv");
+        return 1;
+    }
+
+    buffer[num_bytes_received] = '\0';
+
+    if (strncmp(buffer, quit_command, strlen(quit_command)) == 0) {
+        printf("Quitting\n");
+        close(server_fd);
+        return 1;
+    }
+    printf("Server response: %s\n", buffer);
+    return 0;
+}
+
+// send all commands of a line at once and read their responses in order, returns 1 when done
+int run_framed_commands(int *server_fd, struct client_command *cmds, int num_cmds) {
+    uint32_t ids[MAX_PIPELINE];
+    char buffer[BUFFER_SIZE];
 
-        // Send the command to the server
-        num_bytes_sent = send(server_fd, command, strlen(command), 0);
-        if (num_bytes_sent == -1) {
+    for (int i = 0; i < num_cmds; i++) {
+        ids[i] = next_request_id++;
+        if (send_command(*server_fd, ids[i], &cmds[i]) != 0) {
             perror("send");
-            break;
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < num_cmds; i++) {
+        struct transfer transfer = {0};
+        int type;
+        uint32_t request_id;
+        uint64_t length;
+
+        if (recv_archive_header(*server_fd, &type, &request_id, &length, &transfer) != 0) {
+            fprintf(stderr, "Connection to server lost\n");
+            return 1;
         }
-        
-        // handle server response based on command entered by user
-        if (is_quit == 0 && strncmp(argv[0], "findfile", 8) != 0) {
-            int res = receive_tar(server_fd);
-            if (res == 1){
-                printf("No files found\n");
+        if (request_id != ids[i]) {
+            fprintf(stderr, "Response out of order (request %u)\n", request_id);
+            return 1;
+        }
+
+        if (type == FRAME_ARCHIVE) {
+            int generation = session_generation;
+            if (length == 0) {
+                printf(cmds[i].is_resume ? "Transfer expired\n" : "No files found\n");
                 continue;
-            } else if (strncmp(argv[argc - 1], "-u", 2) == 0) {
-                extract_tar();
-                // after extraction, delete the tar file received   
-                remove(TAR_FILE);
+            }
+            // a striped archive sent only its first chunk, the others are fetched over more connections
+            if (transfer.chunk > 0 ? receive_striped(server_fd, length, cmds[i].unzip, i == num_cmds - 1, &transfer) != 0
+                                   : receive_archive(server_fd, length, cmds[i].unzip, cmds[i].is_resume, &transfer) != 0) {
+                return 1;
+            }
+            fflush(stdout);
+
+            // a resumed transfer is on a new connection, the rest of the line was lost with the old one
+            if (session_generation != generation) {
+                for (int j = i + 1; j < num_cmds; j++) {
+                    ids[j] = next_request_id++;
+                    if (send_command(*server_fd, ids[j], &cmds[j]) != 0) {
+                        perror("send");
+                        return 1;
+                    }
+                }
+            }
+            continue;
+        }
+        if (type == FRAME_DELTA) {
+            if (receive_delta(*server_fd, length, &cmds[i]) != 0) {
+                return 1;
             }
             fflush(stdout);
             continue;
         }
 
-        memset(buffer, 0, BUFFER_SIZE);
-
-        // Receive the server's response
-        // reachable only if findfile command or quit command is entered
-        num_bytes_received = recv(server_fd, buffer, BUFFER_SIZE - 1, 0);
-        if (num_bytes_received <= 0) {
-            perror("recv");
-            break;
+        // a findfile with many matches does not fit the stack buffer
+        char *text = buffer;
+        if (length >= BUFFER_SIZE) {
+            text = length < MAX_TEXT_RESPONSE ? malloc(length + 1) : NULL;
+            if (text == NULL) {
+                fprintf(stderr, "Response too large (%lu bytes)\n", (unsigned long)length);
+                return 1;
+            }
         }
+        if (recv_all(*server_fd, text, length) != 0) {
+            fprintf(stderr, "Connection to server lost\n");
+            if (text != buffer) {
+                free(text);
+            }
+            return 1;
+        }
+        text[length] = '\0';
 
-        buffer[num_bytes_received] = '\0';
-        
-        if (strncmp(buffer, quit_command, strlen(quit_command)) == 0) {
+        if (type == FRAME_ERROR) {
+            printf("Server error for: %s\n", cmds[i].text);
+        } else if (type == FRAME_HELLO) {
+            set_session_codec(text);
+            // what the server offers besides the codec is not news to the user
+            char *feature = strstr(text, " stripe");
+            if (feature != NULL) {
+                *feature = '\0';
+            }
+            printf("Archives now use %s\n", text);
+        } else if (cmds[i].is_quit) {
             printf("Quitting\n");
-            close(server_fd);
-            break;
+            close(*server_fd);
+            return 1;
+        } else if (strncmp(text, "BUSY retry-after ", 17) == 0) {
+            printf("Server busy, try %s again in %d s\n", cmds[i].text, atoi(text + 17));
         } else {
-            printf("Server response: %s\n", buffer);
+            printf("Server response: %s\n", text);
+        }
+        if (text != buffer) {
+            free(text);
         }
     }
+    return 0;
 }
 
-// receive tar sent by server
-int receive_tar(int serverfd) {
-    FILE *fp;
-    long file_size = 0;
-    char *file_buffer;
-    int valread;
-    char buffer[1024] = {0};
+// send one command as its own request, delta getfiles carry the signatures of the local copies
+int send_command(int server_fd, uint32_t request_id, struct client_command *cmd) {
+    if (cmd->is_delta) {
+        return send_delta_request(server_fd, request_id, cmd);
+    }
+    // a new HELLO only changes the codec, and a reconnect asks for the same one
+    if (cmd->is_codec) {
+        snprintf(codec_offer, sizeof(codec_offer), "%s", cmd->text);
+        return send_frame(server_fd, FRAME_HELLO, request_id, cmd->text, strlen(cmd->text));
+    }
+    if (cmd->is_archive && session_stripes > 1 && server_stripes && zlib_crc32 != NULL) {
+        return send_frame(server_fd, FRAME_STRIPE, request_id, cmd->text, strlen(cmd->text));
+    }
+    return send_frame(server_fd, FRAME_COMMAND, request_id, cmd->text, strlen(cmd->text));
+}
 
-    // Get file size
-    recv(serverfd, &file_size, sizeof(long), 0);
+// read the next response header, taking in the transfer id that may come before an archive
+int recv_archive_header(int server_fd, int *type, uint32_t *request_id, uint64_t *length, struct transfer *transfer) {
+    char buffer[BUFFER_SIZE];
 
-    // if file size is zero, it means there is no tar to be sent by server
-    if (file_size <= 50) {
-        return 1;
+    while (1) {
+        if (recv_frame_header(server_fd, type, request_id, length) != 0) {
+            return -1;
+        }
+        if (*type != FRAME_TRANSFER) {
+            return 0;
+        }
+        if (*length >= BUFFER_SIZE || recv_all(server_fd, buffer, *length) != 0) {
+            return -1;
+        }
+        buffer[*length] = '\0';
+        unsigned long long total, chunk;
+        int used = 0;
+        if (sscanf(buffer, "%63s %llu%n", transfer->id, &total, &used) == 2) {
+            transfer->total = total;
+        }
+
+        // a striped archive also lists its chunk size and the crc32 of each chunk
+        transfer->chunk = 0;
+        transfer->num_chunks = 0;
+        char *ptr = buffer + used;
+        if (used > 0 && sscanf(ptr, " %llu%n", &chunk, &used) == 1 && chunk > 0 &&
+            (transfer->total + chunk - 1) / chunk <= STRIPE_MAX_CHUNKS) {
+            ptr += used;
+            while (transfer->num_chunks < STRIPE_MAX_CHUNKS && sscanf(ptr, " %x%n", &transfer->crc[transfer->num_chunks], &used) == 1) {
+                transfer->num_chunks++;
+                ptr += used;
+            }
+            if ((uint64_t)transfer->num_chunks == (transfer->total + chunk - 1) / chunk) {
+                transfer->chunk = chunk;
+            }
+        }
     }
+}
 
-    // create a tar file on client
-    fp = fopen(TAR_FILE, "wb");
-    if (fp == NULL){
-        perror("file open failed");
-        exit(EXIT_FAILURE);
+// reconnect after a broken archive download and ask for the rest of it
+int resume_transfer(int *server_fd, struct transfer *transfer, uint64_t offset, uint64_t *length) {
+    char command[BUFFER_SIZE];
+    int type;
+    uint32_t request_id;
+
+    close(*server_fd);
+    *server_fd = -1;
+    snprintf(command, sizeof(command), "resume %s %llu", transfer->id, (unsigned long long)offset);
+
+    for (int attempt = 1; attempt <= RESUME_ATTEMPTS; attempt++) {
+        sleep(attempt);
+        printf("Connection lost at byte %llu, resuming (attempt %d)...\n", (unsigned long long)offset, attempt);
+
+        if (reconnect_session(server_fd) != 0) {
+            continue;
+        }
+        if (send_frame(*server_fd, FRAME_COMMAND, next_request_id++, command, strlen(command)) != 0 ||
+            recv_archive_header(*server_fd, &type, &request_id, length, transfer) != 0 ||
+            type != FRAME_ARCHIVE || *length == 0) {
+            // a node that does not have the transfer will not have it on the next attempt either
+            close(*server_fd);
+            *server_fd = -1;
+            return -1;
+        }
+        return 0;
     }
+    return -1;
+}
 
-    // Allocate memory for file buffer
-    file_buffer = (char *)malloc(file_size * sizeof(char));
-    if (file_buffer == NULL){
-        perror("malloc failed");
-        exit(EXIT_FAILURE);
+// open a new framed session where the broken one was, the caller resends what was lost with it
+int reconnect_session(int *server_fd) {
+    int framed;
+
+    int fd = connect_to_server(session_host, session_port);
+    if (fd == -1) {
+        return -1;
     }
+    fd = start_session(fd, &framed);
+    if (fd == -1) {
+        return -1;
+    }
+    if (!framed) {
+        close(fd);
+        return -1;
+    }
+    *server_fd = fd;
+    session_generation++;
+    return 0;
+}
 
-    // Receive file into server and store in buffer
-    valread = recv(serverfd, file_buffer, file_size, 0);
+// offer the framed protocol and our codecs, returns 1 if the server accepted it
+int negotiate_framing(int server_fd) {
+    struct timeval timeout = { 2, 0 };
+    struct timeval no_timeout = { 0, 0 };
+    char reply[64];
+    int type;
+    uint32_t request_id;
+    uint64_t length;
+    int framed = 0;
+
+    // a server that does not understand HELLO may never answer it
+    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    session_codec = CODEC_GZIP;
+    server_stripes = 0;
+    if (send_frame(server_fd, FRAME_HELLO, 0, codec_offer, strlen(codec_offer)) == 0 &&
+        recv_frame_header(server_fd, &type, &request_id, &length) == 0 &&
+        type == FRAME_HELLO && length < sizeof(reply) && recv_all(server_fd, reply, length) == 0) {
+        // a server from before codecs answers with nothing and sends gzip
+        reply[length] = '\0';
+        set_session_codec(reply);
+        framed = 1;
+    }
+    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    return framed;
+}
 
-    // Write buffer to file
-    fwrite(file_buffer, sizeof(char), file_size, fp);
+// load the decoders this client can offer beyond gzip and store
+void codecs_init() {
+    void *zstd = dlopen("libzstd.so.1", RTLD_NOW);
+    void *lz4 = dlopen("liblz4.so.1", RTLD_NOW);
+    void *zlib = dlopen("libz.so.1", RTLD_NOW);
 
-    free(file_buffer);
-    fclose(fp);
+    if (zstd != NULL) {
+        codec_api.zstd_create = dlsym(zstd, "ZSTD_createDCtx");
+        codec_api.zstd_free = dlsym(zstd, "ZSTD_freeDCtx");
+        codec_api.zstd_decompress = dlsym(zstd, "ZSTD_decompressStream");
+        codec_api.zstd_is_error = dlsym(zstd, "ZSTD_isError");
+        codecs[CODEC_ZSTD].available = codec_api.zstd_create != NULL && codec_api.zstd_free != NULL &&
+            codec_api.zstd_decompress != NULL && codec_api.zstd_is_error != NULL;
+    }
+    if (lz4 != NULL) {
+        codec_api.lz4_create = dlsym(lz4, "LZ4F_createDecompressionContext");
+        codec_api.lz4_free = dlsym(lz4, "LZ4F_freeDecompressionContext");
+        codec_api.lz4_decompress = dlsym(lz4, "LZ4F_decompress");
+        codec_api.lz4_is_error = dlsym(lz4, "LZ4F_isError");
+        codecs[CODEC_LZ4].available = codec_api.lz4_create != NULL && codec_api.lz4_free != NULL &&
+            codec_api.lz4_decompress != NULL && codec_api.lz4_is_error != NULL;
+    }
+    if (zlib != NULL) {
+        zlib_crc32 = dlsym(zlib, "crc32");
+    }
 
-    // completion message sent by server
-    valread = recv(serverfd, buffer, 12, 0);
-    printf("%s\n", buffer);
+    // zstd compresses about as well as gzip at a fraction of the cost, lz4 is faster still
+    static const int preference[] = { CODEC_ZSTD, CODEC_LZ4, CODEC_GZIP, CODEC_STORE };
+    codec_offer[0] = '\0';
+    for (int i = 0; i < NUM_CODECS; i++) {
+        if (codecs[preference[i]].available) {
+            snprintf(codec_offer + strlen(codec_offer), sizeof(codec_offer) - strlen(codec_offer), "%s%s",
+                     codec_offer[0] != '\0' ? " " : "", codecs[preference[i]].name);
+        }
+    }
+}
+
+// index of the codec called name, -1 if there is none
+int codec_by_name(const char *name) {
+    for (int i = 0; i < NUM_CODECS; i++) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// take the "name level [stripe]" the server answered a HELLO with, an empty answer means gzip
+void set_session_codec(const char *reply) {
+    char name[16] = "";
+    char feature[16] = "";
+
+    sscanf(reply, "%15s %*d %15s", name, feature);
+    int codec = codec_by_name(name);
+    session_codec = codec != -1 && codecs[codec].available ? codec : CODEC_GZIP;
+    server_stripes = strcmp(feature, "stripe") == 0;
+}
+
+// start decoding an archive of the given codec
+int decoder_open(struct decoder *d, int codec) {
+    d->codec = codec;
+    d->ctx = NULL;
+    if (codec == CODEC_ZSTD) {
+        d->ctx = codec_api.zstd_create();
+    } else if (codec == CODEC_LZ4 && codec_api.lz4_is_error(codec_api.lz4_create(&d->ctx, LZ4F_API_VERSION))) {
+        d->ctx = NULL;
+    }
+    if ((codec == CODEC_ZSTD || codec == CODEC_LZ4) && d->ctx == NULL) {
+        fprintf(stderr, "Failed to start the %s decoder\n", codecs[codec].name);
+        return -1;
+    }
     return 0;
 }
 
-// extract the tar file sent by server
-void extract_tar() {
-    int pid = fork();
-    int status;
+// write len archive bytes to fd, decompressed unless tar reads the codec itself
+int decoder_write(struct decoder *d, int fd, const void *data, size_t len) {
+    unsigned char out[RECV_CHUNK];
 
-    printf("Extracting tar...\n");
+    if (d->codec == CODEC_ZSTD) {
+        struct zstd_buffer in = { (void *)data, len, 0 };
+        struct zstd_buffer dst;
+        // output left inside the decoder comes out while dst keeps filling up
+        do {
+            dst.data = out;
+            dst.size = sizeof(out);
+            dst.pos = 0;
+            size_t ret = codec_api.zstd_decompress(d->ctx, &dst, &in);
+            if (codec_api.zstd_is_error(ret)) {
+                fprintf(stderr, "Corrupt zstd archive\n");
+                return -1;
+            }
+            if (write_all(fd, out, dst.pos) == -1) {
+                return -1;
+            }
+        } while (in.pos < in.size || dst.pos == dst.size);
+        return 0;
+    }
 
-    if (pid < 0) {
-        fprintf(stderr, "Error: Failed to create child process\n");
-        return;
+    if (d->codec == CODEC_LZ4) {
+        const unsigned char *src = data;
+        size_t dst_size;
+        do {
+            size_t src_size = len;
+            dst_size = sizeof(out);
+            size_t ret = codec_api.lz4_decompress(d->ctx, out, &dst_size, src, &src_size, NULL);
+            if (codec_api.lz4_is_error(ret)) {
+                fprintf(stderr, "Corrupt lz4 archive\n");
+                return -1;
+            }
+            if (write_all(fd, out, dst_size) == -1) {
+                return -1;
+            }
+            src += src_size;
+            len -= src_size;
+        } while (len > 0 || dst_size == sizeof(out));
+        return 0;
     }
 
-    if (pid == 0) {
-        // Child process to extract tar file
-        char *args[4];
-        args[0] = "tar";
-        args[1] = "-xf";
-        args[2] = "temp.tar.gz";
-        args[3] = NULL;
+    return write_all(fd, data, len);
+}
 
-        execvp(args[0], args);
+// release the decoder of an archive
+void decoder_close(struct decoder *d) {
+    if (d->codec == CODEC_ZSTD && d->ctx != NULL) {
+        codec_api.zstd_free(d->ctx);
+    } else if (d->codec == CODEC_LZ4 && d->ctx != NULL) {
+        codec_api.lz4_free(d->ctx);
+    }
+    d->ctx = NULL;
+}
 
-        /* If execvp returns, there was an error */
-        fprintf(stderr, "Error: Failed to execute tar command\n");
-        exit(1);
-    } else {
-        // Parent process will wait until the tar is extracted
-        waitpid(pid, &status, 0);
+// send getfiles in delta mode: the names, then the block signature of the local copy of each
+int send_delta_request(int server_fd, uint32_t request_id, struct client_command *cmd) {
+    char buffer[BUFFER_SIZE];
+    char *saveptr;
+    size_t len = FRAME_HEADER_SIZE;
+    size_t capacity = FRAME_HEADER_SIZE + BUFFER_SIZE;
+    unsigned char *frame = malloc(capacity);
 
-        if (WIFEXITED(status)) {
-            // Child process exited normally
-            if (WEXITSTATUS(status) == 0) {
-                printf("Tar command completed successfully\n");
-            } else {
-                fprintf(stderr, "Error: Tar command exited with status %d\n", WEXITSTATUS(status));
+    if (frame == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    len += snprintf((char *)frame + len, capacity - len, "%s\n", cmd->text);
+
+    // the first name is the command itself
+    snprintf(buffer, sizeof(buffer), "%s", cmd->text);
+    strtok_r(buffer, " ", &saveptr);
+    for (int i = 0; i < MAX_DELTA_NAMES; i++) {
+        free(cmd->basis[i]);
+        cmd->basis[i] = NULL;
+    }
+    int num_names = 0;
+    char *name;
+    while ((name = strtok_r(NULL, " ", &saveptr)) != NULL && num_names < MAX_DELTA_NAMES) {
+        char path[PATH_MAX];
+        if (find_local_copy(".", name, path, sizeof(path))) {
+            cmd->basis[num_names] = strdup(path);
+        }
+        if (append_signature(&frame, &len, &capacity, cmd->basis[num_names]) != 0) {
+            free(frame);
+            return -1;
+        }
+        num_names++;
+    }
+
+    // header written last, the payload length is only known now
+    uint32_t id = htobe32(request_id);
+    uint64_t length = htobe64(len - FRAME_HEADER_SIZE);
+    frame[0] = FRAME_MAGIC0;
+    frame[1] = FRAME_MAGIC1;
+    frame[2] = FRAME_VERSION;
+    frame[3] = FRAME_DELTA;
+    memcpy(frame + 4, &id, sizeof(id));
+    memcpy(frame + 8, &length, sizeof(length));
+
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(server_fd, frame + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            free(frame);
+            return -1;
+        }
+        sent += n;
+    }
+    free(frame);
+    return 0;
+}
+
+// append block size, file size, block count and per block weak and strong checksums of path (none if NULL)
+int append_signature(unsigned char **frame, size_t *len, size_t *capacity, const char *path) {
+    struct stat sb;
+    uint64_t size = 0;
+    int fd = -1;
+
+    if (path != NULL) {
+        fd = open(path, O_RDONLY);
+        if (fd == -1 || fstat(fd, &sb) == -1) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = -1;
+        } else {
+            size = sb.st_size;
+        }
+    }
+    uint32_t block = delta_block_size(size);
+    uint32_t count = (size + block - 1) / block;
+    size_t needed = *len + DELTA_SIGNATURE_HEADER + (size_t)count * DELTA_ENTRY_LEN;
+
+    if (needed > *capacity) {
+        unsigned char *grown = realloc(*frame, needed);
+        if (grown == NULL) {
+            perror("realloc failed");
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        *frame = grown;
+        *capacity = needed;
+    }
+    unsigned char *ptr = *frame + *len;
+    put_be(ptr, block, 4);
+    put_be(ptr + 4, size, 8);
+    put_be(ptr + 12, count, 4);
+    ptr += DELTA_SIGNATURE_HEADER;
+
+    unsigned char *data = malloc(block);
+    if (data == NULL) {
+        perror("malloc failed");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t a, b;
+        unsigned long long strong[2] = { DELTA_SEED0, DELTA_SEED1 };
+        uint32_t block_len = size - (uint64_t)i * block < block ? size - (uint64_t)i * block : block;
+
+        // a copy that shrank while read is sent as what was read, the server's result is checked anyway
+        ssize_t n = pread(fd, data, block_len, (off_t)i * block);
+        if (n != (ssize_t)block_len) {
+            memset(data, 0, block_len);
+        }
+        weak_sum(data, block_len, &a, &b);
+        strong_sum(strong, data, block_len);
+        put_be(ptr, (a & 0xffff) | (b << 16), 4);
+        put_be(ptr + 4, strong[0], 8);
+        put_be(ptr + 12, strong[1], 8);
+        ptr += DELTA_ENTRY_LEN;
+    }
+    free(data);
+    if (fd != -1) {
+        close(fd);
+    }
+    *len = needed;
+    return 0;
+}
+
+// rebuild each file of a delta reply from the local copies it was computed against
+int receive_delta(int server_fd, uint64_t length, struct client_command *cmd) {
+    uint64_t consumed = 0;
+
+    for (int i = 0; i < MAX_DELTA_NAMES && consumed < length; i++) {
+        unsigned char found;
+        if (recv_all(server_fd, &found, 1) != 0) {
+            fprintf(stderr, "Connection to server lost\n");
+            return -1;
+        }
+        consumed++;
+        if (!found) {
+            printf("File not found\n");
+            continue;
+        }
+        if (apply_delta(server_fd, cmd->basis[i], &consumed) != 0) {
+            return -1;
+        }
+    }
+    if (consumed != length) {
+        fprintf(stderr, "Malformed delta reply\n");
+        return -1;
+    }
+    return 0;
+}
+
+// write one file from copy and literal operations, verify it and move it into place
+int apply_delta(int server_fd, const char *basis, uint64_t *consumed) {
+    unsigned char header[DELTA_FILE_HEADER];
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 16];
+    unsigned long long sum[2] = { DELTA_SEED0, DELTA_SEED1 };
+    uint64_t written = 0;
+    uint64_t start = *consumed - 1;
+    uint64_t basis_size = 0;
+    struct stat sb;
+    int basis_fd = -1;
+
+    if (recv_all(server_fd, header, 2) != 0) {
+        fprintf(stderr, "Connection to server lost\n");
+        return -1;
+    }
+    size_t path_len = get_be(header, 2);
+    if (path_len == 0 || path_len >= sizeof(path) || recv_all(server_fd, path, path_len) != 0 ||
+        recv_all(server_fd, header, DELTA_FILE_HEADER) != 0) {
+        fprintf(stderr, "Connection to server lost\n");
+        return -1;
+    }
+    path[path_len] = '\0';
+    *consumed += 2 + path_len + DELTA_FILE_HEADER;
+    uint64_t size = get_be(header, 8);
+    time_t mtime = get_be(header + 8, 8);
+    mode_t mode = get_be(header + 16, 4);
+
+    // the same place extracting the archive would have used, never above the current directory
+    if (path[0] == '/' || strncmp(path, "../", 3) == 0 || strstr(path, "/../") != NULL) {
+        fprintf(stderr, "Refusing delta for %s\n", path);
+        return -1;
+    }
+    make_parent_dirs(path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.delta", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("delta open");
+        return -1;
+    }
+    if (basis != NULL && (basis_fd = open(basis, O_RDONLY)) != -1 && fstat(basis_fd, &sb) == 0) {
+        basis_size = sb.st_size;
+    }
+
+    int ret = write_delta_ops(server_fd, fd, basis_fd, basis_size, sum, &written, consumed);
+    if (basis_fd != -1) {
+        close(basis_fd);
+    }
+    // the rebuilt file must be exactly the server's, block checksums can collide
+    if (ret == 0 && (written != size || sum[0] != get_be(header + 20, 8) || sum[1] != get_be(header + 28, 8))) {
+        fprintf(stderr, "Delta check failed for %s, fetch it again without -d\n", path);
+        ret = 1;
+    }
+    if (ret == 0) {
+        struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+        fchmod(fd, mode);
+        futimens(fd, times);
+    }
+    close(fd);
+    if (ret != 0 || rename(tmp_path, path) == -1) {
+        if (ret == 0) {
+            perror("delta rename");
+        }
+        unlink(tmp_path);
+        // after a failed check the rest of the reply is still readable, only this file is lost
+        return ret == 1 ? 0 : -1;
+    }
+    printf("Updated %s: %llu bytes from %llu bytes of delta\n", path,
+           (unsigned long long)size, (unsigned long long)(*consumed - start));
+    return 0;
+}
+
+// copy blocks of the local copy and literal data from the server into fd until the end of the file
+int write_delta_ops(int server_fd, int fd, int basis_fd, uint64_t basis_size, unsigned long long *sum,
+                    uint64_t *written, uint64_t *consumed) {
+    unsigned char op[9];
+    uint32_t block = delta_block_size(basis_size);
+    char *buf = malloc(RECV_CHUNK);
+    int ret = -1;
+
+    if (buf == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    while (recv_all(server_fd, op, 1) == 0) {
+        *consumed += 1;
+        if (op[0] == DELTA_END) {
+            ret = 0;
+            break;
+        }
+        uint64_t remaining = 0;
+        uint64_t offset = 0;
+        if (op[0] == DELTA_COPY && recv_all(server_fd, op + 1, 8) == 0) {
+            *consumed += 8;
+            // copied from our own file, nothing of it crosses the network
+            offset = get_be(op + 1, 4) * (uint64_t)block;
+            remaining = get_be(op + 5, 4) * (uint64_t)block;
+            if (offset > basis_size) {
+                offset = basis_size;
+            }
+            if (remaining > basis_size - offset) {
+                remaining = basis_size - offset;
             }
+        } else if (op[0] == DELTA_LITERAL && recv_all(server_fd, op + 1, 4) == 0) {
+            remaining = get_be(op + 1, 4);
+            *consumed += 4 + remaining;
         } else {
-            // Child process exited abnormally
-            fprintf(stderr, "Error: Tar command exited abnormally\n");
+            fprintf(stderr, "Malformed delta reply\n");
+            break;
+        }
+
+        while (remaining > 0) {
+            size_t chunk = remaining > RECV_CHUNK ? RECV_CHUNK : remaining;
+            ssize_t n = chunk;
+            if (op[0] == DELTA_COPY) {
+                n = pread(basis_fd, buf, chunk, offset);
+            } else if (recv_all(server_fd, buf, chunk) != 0) {
+                n = -1;
+            }
+            if (n <= 0 || write_all(fd, buf, n) != 0) {
+                fprintf(stderr, "Delta transfer failed\n");
+                free(buf);
+                return -1;
+            }
+            strong_sum(sum, buf, n);
+            offset += n;
+            remaining -= n;
+            *written += n;
+        }
+    }
+    free(buf);
+    if (ret == -1) {
+        fprintf(stderr, "Connection to server lost\n");
+    }
+    return ret;
+}
+
+// depth first search below dir for a regular file called name
+int find_local_copy(const char *dir, const char *name, char *out, size_t size) {
+    struct dirent *entry;
+    DIR *d = opendir(dir);
+    int found = 0;
+
+    if (d == NULL) {
+        return 0;
+    }
+    while (!found && (entry = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        struct stat sb;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path) ||
+            lstat(path, &sb) == -1) {
+            continue;
+        }
+        if (S_ISREG(sb.st_mode) && strcmp(entry->d_name, name) == 0) {
+            snprintf(out, size, "%s", path);
+            found = 1;
+        } else if (S_ISDIR(sb.st_mode)) {
+            found = find_local_copy(path, name, out, size);
+        }
+    }
+    closedir(d);
+    return found;
+}
+
+// create the missing directories leading to path
+void make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+}
+
+// block size for a file, about the square root of its size like rsync picks
+uint32_t delta_block_size(uint64_t size) {
+    uint32_t block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (uint64_t)block * block < size) {
+        block *= 2;
+    }
+    return block;
+}
+
+// rsync's rolling checksum of a block, its two 16 bit halves
+void weak_sum(const unsigned char *data, uint32_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        s1 += data[i];
+        s2 += (len - i) * data[i];
+    }
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+}
+
+// 128 bit checksum from two differently seeded FNV-1a runs, the same as the server's
+void strong_sum(unsigned long long *sum, const void *data, size_t len) {
+    const unsigned char *ptr = data;
+    for (size_t i = 0; i < len; i++) {
+        sum[0] = (sum[0] ^ ptr[i]) * 1099511628211ULL;
+        sum[1] = (sum[1] ^ ptr[i]) * 1099511628211ULL;
+    }
+}
+
+// store the low bytes of value big endian
+void put_be(unsigned char *ptr, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        *ptr++ = (value >> (i * 8)) & 0xff;
+    }
+}
+
+// read a big endian number of the given size
+uint64_t get_be(const unsigned char *ptr, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | ptr[i];
+    }
+    return value;
+}
+
+// write all of buf to fd
+int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, ptr, len);
+        if (n == -1) {
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// send a frame header followed by its payload
+int send_frame(int server_fd, int type, uint32_t request_id, const char *payload, size_t length) {
+    unsigned char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    uint32_t id = htobe32(request_id);
+    uint64_t len = htobe64(length);
+
+    if (length > BUFFER_SIZE) {
+        return -1;
+    }
+    frame[0] = FRAME_MAGIC0;
+    frame[1] = FRAME_MAGIC1;
+    frame[2] = FRAME_VERSION;
+    frame[3] = type;
+    memcpy(frame + 4, &id, sizeof(id));
+    memcpy(frame + 8, &len, sizeof(len));
+    if (length > 0) {
+        memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    }
+
+    size_t total = FRAME_HEADER_SIZE + length;
+    size_t sent = 0;
+    while (sent < total) {
+        ssize_t n = send(server_fd, frame + sent, total - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// read and check the header of the next response frame
+int recv_frame_header(int server_fd, int *type, uint32_t *request_id, uint64_t *length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint32_t id;
+    uint64_t len;
+
+    if (recv_all(server_fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    if (header[0] != FRAME_MAGIC0 || header[1] != FRAME_MAGIC1) {
+        return -1;
+    }
+    // a server speaking another version frames its payloads differently
+    if (header[2] != FRAME_VERSION) {
+        fprintf(stderr, "Server uses protocol version %d, this client speaks %d\n", header[2], FRAME_VERSION);
+        return -1;
+    }
+    memcpy(&id, header + 4, sizeof(id));
+    memcpy(&len, header + 8, sizeof(len));
+    *type = header[3];
+    *request_id = be32toh(id);
+    *length = be64toh(len);
+    return 0;
+}
+
+// read exactly len bytes
+int recv_all(int server_fd, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(server_fd, (char *)buf + received, len - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+// receive tar sent by server, returns 1 if there was none and -1 if the connection broke
+int receive_tar(int serverfd, int unzip, int append) {
+    long file_size = 0;
+    char buffer[16] = {0};
+
+    // Get file size
+    if (recv_all(serverfd, &file_size, sizeof(long)) != 0) {
+        fprintf(stderr, "Connection to server lost\n");
+        return -1;
+    }
+
+    // if file size is zero, it means there is no tar to be sent by server
+    if (file_size <= 50) {
+        return 1;
+    }
+
+    if (receive_archive(&serverfd, file_size, unzip, append, NULL) != 0) {
+        return -1;
+    }
+
+    // completion message sent by server
+    if (recv_all(serverfd, buffer, 12) != 0) {
+        fprintf(stderr, "Connection to server lost\n");
+        return -1;
+    }
+    return 0;
+}
+
+// stream an archive body of known length to the tar file, and straight into tar too when unzipping
+int receive_archive(int *serverfd, uint64_t length, int unzip, int append, struct transfer *transfer) {
+    char buffer[RECV_CHUNK];
+    pid_t pid = -1;
+    int pipe_fd = -1;
+    int pipe_failed = 0;
+    uint64_t offset = 0;
+    struct stat sb;
+    struct decoder decoder = { CODEC_GZIP, NULL };
+    // the archive is kept as the server sent it, text protocol servers only send gzip
+    const char *archive_file = codecs[session_codec].file;
+
+    // the partial file is what a later resume continues from
+    int out_fd = open(archive_file, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+    if (out_fd == -1) {
+        perror("file open failed");
+        return -1;
+    }
+    if (append && fstat(out_fd, &sb) == 0) {
+        offset = sb.st_size;
+    }
+
+    if (unzip) {
+        // extraction runs alongside the download instead of after it
+        printf("Extracting tar...\n");
+        pipe_fd = start_extractor(&pid, session_codec == CODEC_GZIP);
+        if (pipe_fd != -1 && decoder_open(&decoder, session_codec) == -1) {
+            pipe_failed = 1;
+        }
+
+        // a resumed archive is extracted from its first byte
+        int in_fd = append ? open(archive_file, O_RDONLY) : -1;
+        ssize_t n;
+        while (in_fd != -1 && pipe_fd != -1 && !pipe_failed && (n = read(in_fd, buffer, sizeof(buffer))) > 0) {
+            if (decoder_write(&decoder, pipe_fd, buffer, n) == -1) {
+                pipe_failed = 1;
+            }
+        }
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+    }
+
+    while (length > 0) {
+        size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+        ssize_t n = recv(*serverfd, buffer, chunk, 0);
+        if (n <= 0) {
+            if (transfer != NULL && transfer->id[0] != '\0' && resume_transfer(serverfd, transfer, offset, &length) == 0) {
+                continue;
+            }
+            fprintf(stderr, "Connection to server lost\n");
+            if (transfer != NULL && transfer->id[0] != '\0') {
+                printf("Partial archive kept in %s, continue it with: resume %s\n", archive_file, transfer->id);
+            }
+            close(out_fd);
+            decoder_close(&decoder);
+            if (pipe_fd != -1) {
+                close(pipe_fd);
+                finish_extractor(pid);
+            }
+            return -1;
+        }
+        length -= n;
+        offset += n;
+
+        if (write(out_fd, buffer, n) != n) {
+            perror("write");
+        }
+        // keep draining the socket even if tar is gone, the next response follows this one
+        if (pipe_fd != -1 && !pipe_failed && decoder_write(&decoder, pipe_fd, buffer, n) == -1) {
+            perror("write");
+            pipe_failed = 1;
+        }
+    }
+
+    close(out_fd);
+    decoder_close(&decoder);
+    printf("Tar received\n");
+    if (pipe_fd != -1) {
+        close(pipe_fd);
+        // after extraction, delete the tar file received
+        if (finish_extractor(pid) == 0 && !pipe_failed) {
+            remove(archive_file);
+        }
+    }
+    return 0;
+}
+
+// receive an archive whose first chunk came on the session connection, the others over extra ones too
+int receive_striped(int *server_fd, uint64_t length, int unzip, int last, struct transfer *transfer) {
+    char buffer[RECV_CHUNK];
+    struct stripe_download d;
+    struct stripe stripes[MAX_STRIPES];
+    int num_chunks = transfer->num_chunks;
+    int num_stripes = session_stripes < num_chunks ? session_stripes : num_chunks;
+    // responses to the rest of the line are queued behind the first chunk, then the session only carries that
+    int first_shared = last ? 0 : 1;
+    pid_t pid = -1;
+    int pipe_fd = -1;
+    int pipe_failed = 0;
+    int next = 0;
+    struct decoder decoder = { CODEC_GZIP, NULL };
+    const char *archive_file = codecs[session_codec].file;
+
+    if (length != (transfer->total < transfer->chunk ? transfer->total : transfer->chunk)) {
+        fprintf(stderr, "Striped archive does not start with its first chunk\n");
+        return -1;
+    }
+
+    memset(&d, 0, sizeof(d));
+    d.transfer = transfer;
+    d.out_fd = open(archive_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (d.out_fd == -1) {
+        perror("file open failed");
+        return -1;
+    }
+    // the extra connections go through the same redirect as the session, to the server or a mirror
+    snprintf(d.host, sizeof(d.host), "%s", session_host);
+    snprintf(d.port, sizeof(d.port), "%s", session_port);
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.changed, NULL);
+
+    // chunks are dealt out in turn, so every connection works its way from the front of the archive
+    memset(stripes, 0, sizeof(stripes));
+    for (int i = 0; i < num_stripes; i++) {
+        stripes[i].download = &d;
+        stripes[i].fd = -1;
+    }
+    stripes[0].fd = *server_fd;
+    stripes[0].chunks[stripes[0].num_chunks++] = 0;
+    stripes[0].num_sent = 1;
+    for (int chunk = 1; chunk < num_chunks; chunk++) {
+        struct stripe *stripe = &stripes[first_shared + (chunk - 1) % (num_stripes - first_shared)];
+        stripe->chunks[stripe->num_chunks++] = chunk;
+    }
+    // ids of the session connection go on from the command's, the extra connections start their own
+    stripes[0].first_id = next_request_id;
+    next_request_id += stripes[0].num_chunks;
+
+    for (int i = 0; i < num_stripes; i++) {
+        pthread_mutex_lock(&d.lock);
+        d.running++;
+        pthread_mutex_unlock(&d.lock);
+        stripes[i].started = pthread_create(&stripes[i].thread, NULL, stripe_main, &stripes[i]) == 0;
+        if (!stripes[i].started) {
+            perror("pthread_create");
+            pthread_mutex_lock(&d.lock);
+            d.running--;
+            pthread_mutex_unlock(&d.lock);
+            // its chunks are fetched again later, and nobody read what the session connection has for it
+            stripes[i].lost = i == 0;
+            for (int j = 0; j < stripes[i].num_chunks; j++) {
+                set_chunk_state(&d, stripes[i].chunks[j], CHUNK_FAILED);
+            }
+        }
+    }
+
+    if (unzip) {
+        printf("Extracting tar...\n");
+        pipe_fd = start_extractor(&pid, session_codec == CODEC_GZIP);
+        if (pipe_fd != -1 && decoder_open(&decoder, session_codec) == -1) {
+            pipe_failed = 1;
+        }
+    }
+
+    for (int attempt = 0; attempt <= RESUME_ATTEMPTS; attempt++) {
+        // tar gets each chunk once it and all before it have arrived
+        pthread_mutex_lock(&d.lock);
+        while (next < num_chunks) {
+            if (d.state[next] == CHUNK_DONE) {
+                pthread_mutex_unlock(&d.lock);
+                uint64_t offset = next * transfer->chunk;
+                uint64_t end = offset + transfer->chunk < transfer->total ? offset + transfer->chunk : transfer->total;
+                while (pipe_fd != -1 && !pipe_failed && offset < end) {
+                    size_t n = end - offset < sizeof(buffer) ? end - offset : sizeof(buffer);
+                    if (pread(d.out_fd, buffer, n, offset) != (ssize_t)n || decoder_write(&decoder, pipe_fd, buffer, n) == -1) {
+                        pipe_failed = 1;
+                    }
+                    offset += n;
+                }
+                pthread_mutex_lock(&d.lock);
+                next++;
+            } else if (d.running == 0) {
+                break;
+            } else {
+                pthread_cond_wait(&d.changed, &d.lock);
+            }
+        }
+        pthread_mutex_unlock(&d.lock);
+
+        if (attempt == 0) {
+            for (int i = 0; i < num_stripes; i++) {
+                if (stripes[i].started) {
+                    pthread_join(stripes[i].thread, NULL);
+                }
+            }
+        }
+        if (next == num_chunks || attempt == RESUME_ATTEMPTS) {
+            break;
+        }
+
+        // a connection broke or reached a node without the transfer, its chunks are asked for again
+        struct stripe retry = { .download = &d };
+        retry.fd = -1;
+        for (int chunk = next; chunk < num_chunks; chunk++) {
+            if (d.state[chunk] == CHUNK_FAILED) {
+                d.state[chunk] = CHUNK_PENDING;
+                retry.chunks[retry.num_chunks++] = chunk;
+            }
+        }
+        sleep(attempt);
+        printf("Fetching %d chunk%s again (attempt %d)...\n", retry.num_chunks, retry.num_chunks > 1 ? "s" : "", attempt + 1);
+        fetch_chunks(&retry);
+    }
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.changed);
+
+    decoder_close(&decoder);
+    if (next < num_chunks) {
+        // what is kept is the verified front of the archive, resume continues after it
+        if (ftruncate(d.out_fd, next * transfer->chunk) == -1) {
+            perror("ftruncate");
+        }
+        fprintf(stderr, "Striped download failed at chunk %d of %d\n", next + 1, num_chunks);
+        printf("Partial archive kept in %s, continue it with: resume %s\n", archive_file, transfer->id);
+    } else {
+        printf("Tar received in %d chunks over %d connections\n", num_chunks, num_stripes);
+    }
+    close(d.out_fd);
+    if (pipe_fd != -1) {
+        close(pipe_fd);
+        // after extraction, delete the tar file received
+        if (finish_extractor(pid) == 0 && !pipe_failed && next == num_chunks) {
+            remove(archive_file);
+        }
+    }
+
+    // the session goes on over a new connection, the rest of the line is sent again
+    if (stripes[0].lost) {
+        close(*server_fd);
+        *server_fd = -1;
+        if (reconnect_session(server_fd) != 0) {
+            fprintf(stderr, "Connection to server lost\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// fetch the chunks of one connection, then let the download know it is done
+void *stripe_main(void *arg) {
+    struct stripe *stripe = arg;
+
+    fetch_chunks(stripe);
+    pthread_mutex_lock(&stripe->download->lock);
+    stripe->download->running--;
+    pthread_cond_broadcast(&stripe->download->changed);
+    pthread_mutex_unlock(&stripe->download->lock);
+    return NULL;
+}
+
+// ask for the chunks of a stripe all at once and take them in, marking what did not arrive
+void fetch_chunks(struct stripe *stripe) {
+    struct stripe_download *d = stripe->download;
+    struct transfer *transfer = d->transfer;
+    // the session connection is lent to the stripe, any other connection is its own
+    int fd = stripe->fd != -1 ? stripe->fd : stripe_connect(d->host, d->port);
+    int sent = stripe->num_sent;
+    int received = 0;
+    int cork = 1;
+
+    if (fd != -1) {
+        // one round trip for all requests, the server answers them in order
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        for (; sent < stripe->num_chunks; sent++) {
+            char command[BUFFER_SIZE];
+            int chunk = stripe->chunks[sent];
+            snprintf(command, sizeof(command), "resume %s %llu %llu", transfer->id,
+                     (unsigned long long)(chunk * transfer->chunk), (unsigned long long)transfer->chunk);
+            if (send_frame(fd, FRAME_COMMAND, stripe->first_id + sent, command, strlen(command)) != 0) {
+                break;
+            }
+        }
+        cork = 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+        for (; received < sent; received++) {
+            struct transfer resumed = {0};
+            int chunk = stripe->chunks[received];
+            uint64_t offset = chunk * transfer->chunk;
+            uint64_t expected = transfer->total - offset < transfer->chunk ? transfer->total - offset : transfer->chunk;
+            int type;
+            uint32_t request_id;
+            uint64_t length = expected;
+
+            // chunks the server was already sending when the stripe started have no header left to read
+            if (received >= stripe->num_sent &&
+                (recv_archive_header(fd, &type, &request_id, &length, &resumed) != 0 || type != FRAME_ARCHIVE ||
+                 request_id != stripe->first_id + received || (length != 0 && length != expected))) {
+                break;
+            }
+            // a node without the transfer answers with nothing
+            if (length == 0) {
+                set_chunk_state(d, chunk, CHUNK_FAILED);
+                continue;
+            }
+            if (receive_chunk(fd, d, chunk) == -1) {
+                received++;
+                break;
+            }
+        }
+        if (fd != stripe->fd) {
+            close(fd);
+        }
+    }
+    if (received < stripe->num_chunks && fd != -1 && fd == stripe->fd) {
+        stripe->lost = 1;
+    }
+    for (; received < stripe->num_chunks; received++) {
+        set_chunk_state(d, stripe->chunks[received], CHUNK_FAILED);
+    }
+}
+
+// connect for extra chunks the way a session starts, following a redirect to a mirror
+int stripe_connect(const char *host, const char *port) {
+    char buffer[BUFFER_SIZE];
+    char *saveptr;
+
+    int fd = open_connection(host, port);
+    if (fd == -1) {
+        return -1;
+    }
+    memset(buffer, 0, sizeof(buffer));
+    if (send(fd, "test", 4, MSG_NOSIGNAL) != 4 || recv(fd, buffer, sizeof(buffer) - 1, 0) <= 0) {
+        close(fd);
+        return -1;
+    }
+    // a busy server fails the chunks like a broken connection, they are retried on another one
+    if (strncmp(buffer, "BUSY", 4) == 0) {
+        close(fd);
+        return -1;
+    }
+    if (strncmp(buffer, "REDIRECT:", 9) != 0) {
+        return fd;
+    }
+    close(fd);
+
+    for (char *mirror = strtok_r(buffer + 9, ",", &saveptr); mirror != NULL; mirror = strtok_r(NULL, ",", &saveptr)) {
+        char mirror_address[256];
+        char mirror_port[16];
+        if (sscanf(mirror, "%255[^:]:%15s", mirror_address, mirror_port) == 2 &&
+            (fd = open_connection(mirror_address, mirror_port)) != -1) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// read chunk index from fd into its place in the archive file and check its crc32, -1 if the connection broke
+int receive_chunk(int fd, struct stripe_download *d, int index) {
+    char buffer[RECV_CHUNK];
+    struct transfer *transfer = d->transfer;
+    uint64_t offset = index * transfer->chunk;
+    uint64_t length = transfer->total - offset < transfer->chunk ? transfer->total - offset : transfer->chunk;
+    unsigned long crc = 0;
+
+    while (length > 0) {
+        ssize_t n = recv(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), 0);
+        if (n <= 0) {
+            set_chunk_state(d, index, CHUNK_FAILED);
+            return -1;
+        }
+        if (pwrite(d->out_fd, buffer, n, offset) != n) {
+            perror("write");
+        }
+        crc = zlib_crc32(crc, (const unsigned char *)buffer, n);
+        offset += n;
+        length -= n;
+    }
+
+    if (crc != transfer->crc[index]) {
+        fprintf(stderr, "Chunk %d failed its checksum\n", index + 1);
+        set_chunk_state(d, index, CHUNK_FAILED);
+        return 0;
+    }
+    set_chunk_state(d, index, CHUNK_DONE);
+    return 0;
+}
+
+// record how a chunk went and wake whoever waits for it
+void set_chunk_state(struct stripe_download *d, int index, int state) {
+    pthread_mutex_lock(&d->lock);
+    d->state[index] = state;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+}
+
+// fork tar reading the archive from a pipe, returns the write end of the pipe
+int start_extractor(pid_t *pid, int gzip) {
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    *pid = fork();
+    if (*pid < 0) {
+        fprintf(stderr, "Error: Failed to create child process\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (*pid == 0) {
+        // Child process extracts the archive from its stdin
+        signal(SIGPIPE, SIG_DFL);
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        char *args[4];
+        args[0] = "tar";
+        args[1] = gzip ? "-xzf" : "-xf";
+        args[2] = "-";
+        args[3] = NULL;
+
+        execvp(args[0], args);
+
+        /* If execvp returns, there was an error */
+        fprintf(stderr, "Error: Failed to execute tar command\n");
+        exit(1);
+    }
+
+    close(fds[0]);
+    return fds[1];
+}
+
+// wait for the extractor to finish the archive
+int finish_extractor(pid_t pid) {
+    int status;
+
+    // Parent process will wait until the tar is extracted
+    waitpid(pid, &status, 0);
+
+    if (WIFEXITED(status)) {
+        // Child process exited normally
+        if (WEXITSTATUS(status) == 0) {
+            printf("Tar command completed successfully\n");
+            return 0;
         }
+        fprintf(stderr, "Error: Tar command exited with status %d\n", WEXITSTATUS(status));
+    } else {
+        // Child process exited abnormally
+        fprintf(stderr, "Error: Tar command exited abnormally\n");
     }
+    return -1;
 }
 
 // print the error response in case of invalid command entered by user
@@ -1,3 +1,5 @@
+// build: gcc -O2 -pthread mirror.c -o mirror -lz -ldl
+#define _GNU_SOURCE
 #include <errno.h>
 #include <netdb.h>
 #include <signal.h>
@@ -7,44 +9,1091 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <ftw.h>
 #include <time.h>
 #include <stdbool.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <zlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #define PORT "65002"
 #define BACKLOG 10
+#define DEFAULT_LISTEN_BACKLOG 128
+#define DEFAULT_MAX_CONNECTIONS 256
+#define DEFAULT_MAX_JOBS 8
+#define DEFAULT_ADMIT_QUEUE 64
+#define ADMIT_WAIT 10
+#define ADMIT_POLL_MS 50
+#define ADMIT_OWNERS 1024
+#define ADMIT_ARRIVED 0
+#define ADMIT_WAITING 1
+#define ADMIT_RUNNING 2
+#define BUSY_RETRY_AFTER 2
+#define MAX_SHARDS 256
+#define SHARD_RESTART_DELAY 1
 #define BUFFER_SIZE 1024
-#define TAR_FILE "temp.tar.gz"
 #define MAX_FILE_TYPES 6
+#define MAX_EVENTS 256
+
+// framed protocol: 16 byte header of magic "FS", version, type, request id and payload length
+#define FRAME_MAGIC0 'F'
+#define FRAME_MAGIC1 'S'
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define MAX_FRAME_PAYLOAD BUFFER_SIZE
+#define FRAME_HELLO 1
+#define FRAME_COMMAND 2
+#define FRAME_TEXT 3
+#define FRAME_ARCHIVE 4
+#define FRAME_ERROR 5
+#define FRAME_TRANSFER 6
+#define FRAME_DELTA 7
+#define FRAME_STRIPE 8
+#define HEARTBEAT_PORT "65003"
+#define HEARTBEAT_INTERVAL 1
+#define MAX_HEARTBEAT_ADDRS 4
+#define HEARTBEAT_TIMEOUT_MS 3000
+#define DEFAULT_WORKERS 8
+#define DEFAULT_WALK_THREADS 4
+#define WALK_DENTS_SIZE (64 * 1024)
+#define WALK_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME)
+#define URING_STAT_BATCH 64
+#define URING_BATCH 16
+#define URING_ENTRIES (4 * URING_BATCH)
+#define INDEX_BUCKETS (1 << 20)
+#define INDEX_PATH "file_index.db"
+#define INDEX_MAGIC "FSINDEX"
+#define INDEX_VERSION 1
+#define INDEX_SAVE_INTERVAL 60
+#define SEND_CHUNK (64 * 1024)
+#define SENDFILE_MAX (1 << 30)
+#define TAR_BLOCK 512
+#define TAR_RECORD 10240
+#define ARCHIVE_CHUNK (64 * 1024)
+#define MAX_QUERY_NAMES 10
+#define MAX_FIND_MATCHES 1000
+#define MATCHER_RARE_BYTES 4
+#define PGZ_BLOCK (128 * 1024)
+#define PGZ_DICT (32 * 1024)
+#define PASSTHROUGH_MIN (16 * 1024)
+#define PASSTHROUGH_SAMPLE (8 * 1024)
+#define DEDUP_MIN_SIZE TAR_BLOCK
+#define DEDUP_BUCKETS 4096
+#define DEDUP_CACHE_SLOTS 65536
+#define DEDUP_SEED 0x9e3779b97f4a7c15ULL
+#define CACHE_KEY_LEN 32
+#define DEFAULT_CACHE_BUDGET (1ULL << 30)
+#define TRANSFER_DIR "transfers"
+#define DEFAULT_TRANSFER_TTL 600
+#define TRANSFER_SWEEP_INTERVAL 60
+#define STRIPE_MAX_CHUNKS 64
+#define STRIPE_MIN_CHUNK (1 << 20)
+#define STRIPE_ALIGN (64 * 1024)
+#define METRICS_PORT "65006"
+#define REPLICATION_PORT "65004"
+#define REPLICATION_RETRY 1
+#define REPLICATION_ATTEMPTS 3
+#define MAX_DELTA_REQUEST (64 << 20)
+#define DELTA_SIGNATURE_HEADER 16
+#define DELTA_ENTRY_LEN 20
+#define DELTA_MAX_BLOCK (1 << 20)
+#define DELTA_MAX_LITERAL (1 << 20)
+#define DELTA_SEED0 14695981039346656037ULL
+#define DELTA_SEED1 0x9e3779b97f4a7c15ULL
+#define METRIC_BUCKETS 28
+
+// archive builders selectable at startup with -a
+#define ARCHIVE_BUILTIN 0
+#define ARCHIVE_SHELL 1
+// builtin, with files of the same content stored once and linked to after that
+#define ARCHIVE_DEDUP 2
+
+// archive codecs, gzip is what every client understands
+#define CODEC_GZIP 0
+#define CODEC_STORE 1
+#define CODEC_ZSTD 2
+#define CODEC_LZ4 3
+#define NUM_CODECS 4
+
+// values from zstd.h and lz4frame.h, the libraries are loaded at runtime
+#define ZSTD_LEVEL_PARAM 100
+#define ZSTD_CHECKSUM_PARAM 201
+#define ZSTD_WORKERS_PARAM 400
+#define ZSTD_CONTINUE 0
+#define ZSTD_END 2
+#define LZ4F_API_VERSION 100
+
+// records of the index replication stream, one byte each before the record
+#define REPLICA_SNAPSHOT 'S'
+#define REPLICA_ADD 'A'
+#define REPLICA_REMOVE 'D'
+#define REPLICA_READY 'R'
+#define REPLICA_KEEPALIVE 'K'
+
+// kinds of file selection behind the archive commands
+#define QUERY_SIZE 0
+#define QUERY_DATE 1
+#define QUERY_TYPES 2
+#define QUERY_NAMES 3
+
+// connection engines selectable at startup with -m
+#define ENGINE_FORK 0
+#define ENGINE_EPOLL 1
+
+// delta reply operations: end of file, copy a run of the client's blocks, literal bytes
+#define DELTA_END 0
+#define DELTA_COPY 1
+#define DELTA_LITERAL 2
+
+// commands latencies are kept for, everything else counts as other
+#define METRIC_FINDFILE 0
+#define METRIC_SGETFILES 1
+#define METRIC_DGETFILES 2
+#define METRIC_GETTARGZ 3
+#define METRIC_GETFILES 4
+#define METRIC_RESUME 5
+#define METRIC_OTHER 6
+#define NUM_METRIC_COMMANDS 7
+
+// io_uring operations of an archive build, kept in the low bits of user_data
+#define URING_OPEN 0
+#define URING_READ 1
+#define URING_STAT 2
+#define URING_CLOSE 3
+
+// parts of a request that are timed on their own
+#define PHASE_REQUEST 0
+#define PHASE_WALK 1
+#define PHASE_BUILD 2
+#define NUM_METRIC_PHASES 3
+
+struct sorted_column;
+struct file_list;
+struct uring;
+struct histogram;
+struct delta_signature;
+struct delta_run;
+
+// an io_uring instance driven through raw syscalls, both rings share one mapping
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    // queued but not yet handed to the kernel
+    unsigned to_submit;
+    // io_uring_enter failed, whatever is still queued must never be submitted
+    int broken;
+    // every syscall made for this ring, for the metrics
+    unsigned long syscalls;
+};
+
+// directories waiting to be read by one walker thread, the owner works at the tail and thieves take the head
+struct walk_deque {
+    char **paths;
+    int head;
+    int tail;
+    int capacity;
+    pthread_mutex_t lock;
+};
+
+// parallel directory walk, callbacks run one at a time and a non-zero return stops the walk
+struct walk {
+    const char *root;
+    int (*on_dir)(struct walk *w, const char *path);
+    int (*on_file)(struct walk *w, const char *path, const char *name, const struct stat *sb);
+    void *arg;
+    int want_stat;
+    struct walk_deque *deques;
+    int num_threads;
+    int pending;
+    int idle;
+    volatile int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// patterns of a findfile request, the literal part of each is in one Aho-Corasick automaton
+struct name_matcher {
+    char **patterns;
+    int num_patterns;
+    int num_globs;
+    int *next;
+    uint32_t *out;
+    int num_states;
+    uint32_t always;
+    unsigned char rare[MATCHER_RARE_BYTES];
+    int num_rare;
+};
+
+// one file findfile reports
+struct find_match {
+    char *path;
+    off_t size;
+    time_t ctime;
+};
+
+// files matching a findfile request, total keeps counting past the ones kept
+struct find_result {
+    const struct name_matcher *matcher;
+    struct find_match *items;
+    int count;
+    int capacity;
+    int total;
+};
+
+// block checksums of the client's copy of one file, entries are a weak sum and two strong halves each
+struct delta_signature {
+    uint32_t block_size;
+    uint64_t basis_size;
+    uint32_t count;
+    const unsigned char *entries;
+};
+
+// client blocks first to first + count - 1, found one after another
+struct delta_run {
+    int first;
+    int count;
+};
+
+// one thread of a walk
+struct walk_thread {
+    struct walk *walk;
+    int self;
+};
+
+// one client connection and the bytes of its not yet complete frame
+struct conn {
+    int fd;
+    int framed;
+    int responded;
+    // the current request came as FRAME_STRIPE, its archive may be sent in chunks
+    int striped;
+    uint32_t request_id;
+    int codec;
+    int level;
+    // handed to a worker by the ready queue, which counts it in queued_jobs until the worker is done
+    int queued;
+    size_t len;
+    char buf[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD];
+};
 
 void processclient(int client_fd);
-void redirect_to_mirror(int client_fd);
+int handle_client_message(struct conn *c);
+int handle_frames(struct conn *c);
+int run_command(char *command);
+int run_delta_frame(struct conn *c, size_t *offset, uint64_t length);
+int send_frame_header(int type, uint32_t request_id, uint64_t length);
+void send_hello(struct conn *c, const char *offer, size_t length);
+void run_fork_loop(int server_fd);
+void fork_client(int server_fd, int client_fd);
+void set_nodelay(int fd);
+void run_event_loop(int server_fd, int num_workers);
+void start_client(int client_fd);
+int admission_init();
+int admit_connection(int client_fd);
+int next_waiting_client();
+void reject_client(int client_fd);
+int archive_job_admit();
+void admit_lock();
+void admit_reclaim();
+int archive_job_fits();
+void archive_job_done();
+void send_busy();
+void *worker_main(void *arg);
+void queue_push(struct conn *c);
+struct conn *queue_pop();
+int start_heartbeat_sender(const char *primary);
+void *heartbeat_send_main(void *arg);
+void reap_children(int sig);
+void run_shards();
+pid_t start_shard(int id);
+void pin_shard(int id);
+void close_client(struct conn *c);
 void executeCommand(char *command);
-int iterate_over_files(const char *fpath, const struct stat *sb, int typeflag);
 void sendResponse(char* response);
 void remove_trailing_spaces(char *str);
 void create_tar(char *command);
-void send_tar();
+void send_archive_fd(int fd);
+void send_archive_range(int fd, off_t offset, off_t length);
+void send_transfer_id(const char *id, off_t size);
+off_t stripe_chunk_size(off_t size);
+int send_stripe_layout(const char *id, int fd, off_t size, off_t chunk);
+int transfer_store(int fd, char *id);
+int link_open_file(int fd, const char *dir, const char *name);
+void transfer_expire();
+int transfer_init();
+void handle_resume_command();
+void handle_delta_request(char *payload, size_t length);
+int delta_file(FILE *out, const char *path, const struct delta_signature *sig);
+int delta_match(const struct delta_signature *sig, const int *buckets, const int *next, int num_buckets,
+                uint32_t weak, const unsigned char *window, uint32_t len, const struct delta_run *run);
+void delta_emit(FILE *out, const unsigned char *data, off_t literal, off_t end, struct delta_run *run, int id);
+int delta_bucket(uint32_t weak, int num_buckets);
+void weak_sum(const unsigned char *data, uint32_t len, uint32_t *a, uint32_t *b);
+void strong_sum(unsigned long long *sum, const void *data, size_t len);
+void put_be(FILE *out, uint64_t value, int bytes);
+uint64_t get_be(const unsigned char *ptr, int bytes);
+int send_all(int sock, const void *buf, size_t len);
+int recv_all(int sock, void *buf, size_t len);
+int send_file_range(int sock, int fd, off_t offset, off_t length);
 int get_file_types(char *arg[], int argc, char *file_types[]);
-char* generate_cmd();
+char* generate_cmd(const char *tar_path);
 void search_files(const char *dir_name, char *file_names[], int num_files, bool *found_files);
+void send_find_result(struct find_result *found);
+int find_result_add(struct find_result *found, const char *path, off_t size, time_t ctime);
+void find_result_free(struct find_result *found);
+int compare_find_matches(const void *a, const void *b);
+int matcher_init(struct name_matcher *m, char **patterns, int num_patterns);
+void matcher_free(struct name_matcher *m);
+const char *glob_literal(const char *pattern, size_t *len);
+int matcher_match(const struct name_matcher *m, const char *name);
+int matcher_prefilter(const struct name_matcher *m, const char *name, size_t len);
+unsigned int hash_name(const char *name);
+int index_init(const char *root);
+int index_alloc();
+int index_build(const char *root);
+int index_visit_dir(struct walk *w, const char *path);
+int index_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb);
+int walk_tree(struct walk *w, const char *root);
+void *walk_thread_main(void *arg);
+void walk_dir(struct walk *w, int self, char *path, struct uring *ring);
+void walk_flush_stats(struct walk *w, int self, struct uring *ring, int dir_fd, char *child, size_t path_len,
+                      const char **names, struct statx *stx, int count);
+void walk_entry(struct walk *w, int self, char *child, size_t path_len, const char *name, int type, const struct stat *sb);
+void statx_to_stat(const struct statx *stx, struct stat *sb);
+int uring_init(struct uring *ring, unsigned entries);
+void uring_free(struct uring *ring);
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned wait);
+struct io_uring_cqe *uring_wait(struct uring *ring);
+void uring_seen(struct uring *ring);
+char *walk_next_dir(struct walk *w, int self);
+void walk_push_dir(struct walk *w, int self, char *path);
+int walk_stat(int dir_fd, const char *name, struct stat *sb);
+int search_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb);
+int findfile_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb);
+void index_scan_dir(const char *dir);
+int index_add_watch(const char *dir);
+int index_load(const char *root, int *rescanned);
+int index_file_valid(const void *map, size_t size, const char *root);
+long index_file_find_dir(const void *map, const char *path);
+void index_rescan_dir(const char *dir, const void *map);
+int index_save();
+void *index_persist_main(void *arg);
+void index_verify();
+int compare_saved_files(const void *a, const void *b);
+int compare_saved_dirs(const void *a, const void *b);
+struct saved_dir;
+int index_write(FILE *out, const char *root, const struct saved_dir *dirs, int num_dirs, const int *ids, int num_ids);
+void index_add_file(const char *path, const struct stat *sb);
+void index_insert_file(const char *path, const struct stat *sb);
+void index_remove_file(const char *path);
+void index_remove_dir(const char *dir);
+void index_apply_event(const struct inotify_event *event);
+void *index_watch_main(void *arg);
+void index_recover();
+void index_find_files(struct find_result *found);
+int column_position(const struct sorted_column *col, int64_t key, int id);
+void column_insert(struct sorted_column *col, int64_t key, int id);
+void column_remove(struct sorted_column *col, int64_t key, int id);
+int column_build(struct sorted_column *col, int by_mtime);
+int compare_column_pairs(const void *a, const void *b);
+int column_select(const struct sorted_column *col, int64_t low, int64_t high, struct file_list *list);
+void index_atfork_prepare();
+void index_atfork_parent();
+void index_atfork_child();
+int start_replica(const char *primary);
+void *replica_main(void *arg);
+int replica_connect(const char *host);
+void replica_receive(int fd, int *replicated);
+void index_clear();
+
+// file selection of an archive command
+struct file_query {
+    int type;
+    off_t min_size;
+    off_t max_size;
+    time_t after;
+    time_t until;
+    char *types[MAX_FILE_TYPES];
+    int num_types;
+    char *names[MAX_QUERY_NAMES];
+    int num_names;
+};
+
+// one selected file
+struct file_item {
+    char *path;
+    off_t size;
+    time_t mtime;
+};
+
+struct file_list {
+    struct file_item *items;
+    int count;
+    int capacity;
+};
+
+struct archive;
+
+// an archive codec and the levels it takes, level 0 asks for the default
+struct codec {
+    const char *name;
+    int min_level;
+    int max_level;
+    int default_level;
+    int available;
+};
+
+// ZSTD_inBuffer and ZSTD_outBuffer share this layout
+struct zstd_buffer {
+    void *data;
+    size_t size;
+    size_t pos;
+};
+
+// LZ4F_preferences_t, frame info first
+struct lz4_preferences {
+    int block_size_id;
+    int block_mode;
+    int content_checksum;
+    int frame_type;
+    unsigned long long content_size;
+    unsigned dict_id;
+    int block_checksum;
+    int level;
+    unsigned auto_flush;
+    unsigned favor_dec_speed;
+    unsigned reserved[3];
+};
+
+// zstd and lz4 entry points, resolved at startup so the server runs without either library
+struct codec_api {
+    void *(*zstd_create)(void);
+    size_t (*zstd_free)(void *cctx);
+    size_t (*zstd_set_parameter)(void *cctx, int param, int value);
+    size_t (*zstd_compress)(void *cctx, struct zstd_buffer *out, struct zstd_buffer *in, int end);
+    unsigned (*zstd_is_error)(size_t code);
+    int (*zstd_min_level)(void);
+    size_t (*lz4_create)(void **cctx, unsigned version);
+    size_t (*lz4_free)(void *cctx);
+    size_t (*lz4_begin)(void *cctx, void *dst, size_t capacity, const struct lz4_preferences *prefs);
+    size_t (*lz4_bound)(size_t src_size, const struct lz4_preferences *prefs);
+    size_t (*lz4_update)(void *cctx, void *dst, size_t capacity, const void *src, size_t src_size, const void *options);
+    size_t (*lz4_end)(void *cctx, void *dst, size_t capacity, const void *options);
+    unsigned (*lz4_is_error)(size_t code);
+};
+
+// one block of tar data deflated on the compression pool
+struct pgz_job {
+    struct archive *ar;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char dict[PGZ_DICT];
+    size_t dict_len;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_cap;
+    unsigned long crc;
+    int level;
+    int last;
+    int done;
+    int failed;
+    struct pgz_job *next_in_archive;
+    struct pgz_job *next_in_pool;
+};
+
+// a member of a deduplicated archive that later files with the same content link to
+struct dedup_member {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    unsigned long long hash;
+    // next member in the same size bucket, -1 at the end
+    int next;
+};
+
+// the content hash of one inode, valid while size, mtime and ctime are unchanged
+struct dedup_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long hash;
+};
+
+// tar stream being compressed into a file
+struct archive {
+    int fd;
+    int codec;
+    int level;
+    // members that will not compress are written at the lowest level
+    int stored;
+    z_stream zs;
+    void *zstd;
+    void *lz4;
+    unsigned char *lz4_out;
+    size_t lz4_out_cap;
+    struct lz4_preferences lz4_prefs;
+    unsigned long long tar_bytes;
+    int num_files;
+    unsigned long syscalls;
+    unsigned char out[ARCHIVE_CHUNK];
+
+    // members already written with -a dedup, bucketed by size, and the hash of the member being written
+    int dedup;
+    struct dedup_member *members;
+    int num_members;
+    int members_capacity;
+    int *size_buckets;
+    unsigned long long member_hash;
+    int num_linked;
+    unsigned long long bytes_linked;
+
+    // parallel compression state, blocks are written out in submission order
+    int parallel;
+    unsigned char *block;
+    size_t block_len;
+    unsigned char dict[PGZ_DICT];
+    size_t dict_len;
+    unsigned long crc;
+    struct pgz_job *jobs;
+    struct pgz_job *jobs_tail;
+    int in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+};
+
+// batched file reads of one archive: a fixed file slot and registered buffer per file in flight
+struct archive_reader {
+    struct uring ring;
+    // URING_BATCH + 1 chunks, the last one takes the next read of a large file
+    unsigned char *buffers;
+    // slots still holding the file of the previous batch
+    int used[URING_BATCH];
+};
+
+// a finished archive in the cache directory
+struct cache_file {
+    char name[64];
+    off_t size;
+    struct timespec used;
+};
+
+// compression threads shared by every archive of the process
+struct pgz_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    struct pgz_job *head;
+    struct pgz_job *tail;
+    pid_t pid;
+};
+
+int parse_file_query(struct file_query *query);
+int parse_date(const char *date, time_t *result);
+int query_match(const struct file_query *query, const char *name, off_t size, time_t mtime);
+int file_list_add(struct file_list *list, const char *path, off_t size, time_t mtime);
+void file_list_free(struct file_list *list);
+int select_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb);
+int select_files(const struct file_query *query, struct file_list *list);
+int write_all(int fd, const void *buf, size_t len);
+void codecs_init();
+int codec_by_name(const char *name);
+int archive_open(struct archive *ar, int fd, int codec, int level);
+int zstd_open(struct archive *ar);
+int lz4_open(struct archive *ar);
+int archive_write(struct archive *ar, const void *data, size_t len, int flush);
+int codec_write(struct archive *ar, const void *data, size_t len, int flush);
+int archive_passthrough(struct archive *ar, int stored);
+int member_compressible(const char *path, const unsigned char *data, size_t len);
+void tar_number(char *field, int width, unsigned long long value);
+void tar_header(unsigned char *block, char typeflag, mode_t mode, off_t size, time_t mtime, uid_t uid, gid_t gid);
+int tar_write_header(struct archive *ar, const char *name, char typeflag, const char *linkname,
+                     mode_t mode, off_t size, time_t mtime, uid_t uid, gid_t gid);
+size_t pax_record(char *out, const char *key, const char *value);
+int tar_pad(struct archive *ar, off_t size);
+int archive_add_file(struct archive *ar, const char *path);
+int reader_init(struct archive_reader *reader);
+void reader_free(struct archive_reader *reader);
+int archive_add_files_uring(struct archive *ar, struct archive_reader *reader, const struct file_list *list);
+int archive_add_member_uring(struct archive *ar, struct archive_reader *reader, int slot, const char *path,
+                             const struct statx *stx, ssize_t first);
+int dedup_init();
+int dedup_open(struct archive *ar);
+void dedup_free(struct archive *ar);
+int dedup_link(struct archive *ar, const char *path, const char *name, const struct stat *sb);
+void dedup_remember(struct archive *ar, const char *path, const struct stat *sb);
+struct dedup_cache_entry *dedup_cache_slot(const struct stat *sb);
+int file_content_hash(const char *path, const struct stat *sb, unsigned long long *hash);
+unsigned long long content_hash(unsigned long long hash, const void *data, size_t len);
+int files_equal(const char *a, const char *b, off_t size);
+ssize_t read_chunk(int fd, unsigned char *buf, size_t len);
+int archive_close(struct archive *ar);
+void archive_abort(struct archive *ar);
+int pgz_write(struct archive *ar, const void *data, size_t len, int flush);
+int pgz_submit(struct archive *ar, int last);
+int pgz_flush(struct archive *ar, int all);
+void pgz_compress(struct pgz_job *job);
+void pgz_job_free(struct pgz_job *job);
+void *pgz_worker_main(void *arg);
+int pgz_pool_start();
+int archive_tmpfile(const char *dir);
+int create_archive(int fd, const struct file_list *list, int codec, int level);
+void create_archive_shell(int fd);
+void handle_archive_command();
+int compare_file_items(const void *a, const void *b);
+unsigned long long hash64(unsigned long long hash, const void *data, size_t len);
+void cache_key(const struct file_query *query, const struct file_list *list, int codec, int level, char *key);
+void normalize_query(const struct file_query *query, char *out, size_t size);
+int compare_strings(const void *a, const void *b);
+int cache_lookup(const char *key);
+int cache_insert(int fd, const char *key);
+void cache_evict();
+int compare_cache_files(const void *a, const void *b);
+int cache_init(const char *dir);
+double elapsed_ms(const struct timespec *start, const struct timespec *end);
+double cpu_ms(const struct timeval *start, const struct timeval *end);
+int metric_command_for(const char *name);
+void metrics_observe(int phase, const struct timespec *start);
+double histogram_quantile(const struct histogram *h, double q);
+void send_stats();
+int start_metrics_listener();
+int listen_local(const char *port);
+void *metrics_main(void *arg);
+void write_metrics(FILE *out);
+void write_histogram(FILE *out, const char *family, const char *command, const struct histogram *h);
+
+// per-request state, thread local so the epoll engine's workers can share the handlers
+__thread int argc = 0;
+__thread char *argv[10];
+__thread int clientfd;
+__thread struct conn *current_conn;
+__thread char *response;
+__thread char *home_dir;
+__thread int metric_command = METRIC_OTHER;
+// this thread's entry in load->owners while it waits for or holds an archive slot
+__thread int admit_owner = -1;
+
+int archive_mode = ARCHIVE_BUILTIN;
+
+// content hashes by inode, shared with forked clients and shards so repeated archives rarely read a file twice
+struct dedup_cache_entry *dedup_cache;
+
+// threads of each directory walk, more than cores helps on slow or network disks
+int walk_threads = DEFAULT_WALK_THREADS;
+
+// batch stats, opens and reads through io_uring, turned off at startup if the kernel refuses it
+int use_uring = 0;
+
+// gzip threads per process, 1 keeps the serial compressor
+int compress_threads = 1;
+struct pgz_pool pgz_pool;
+pthread_mutex_t pgz_start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// zstd and lz4 are offered to clients only if their library loads
+struct codec codecs[NUM_CODECS] = {
+    { "gzip", 1, 9, 6, 1 },
+    { "store", 0, 0, 0, 1 },
+    { "zstd", 1, 19, 3, 0 },
+    { "lz4", 1, 12, 1, 0 },
+};
+struct codec_api codec_api;
+
+// finished archive cache, enabled with -C and shareable between server and mirror
+const char *cache_dir = NULL;
+unsigned long long cache_budget = DEFAULT_CACHE_BUDGET;
+
+// finished archives stay resumable under their transfer id for this many seconds, 0 disables
+int transfer_ttl = DEFAULT_TRANSFER_TTL;
+
+// a process waiting for or holding an archive slot, so the slot can be taken back should it die
+struct admit_owner {
+    pid_t pid;
+    int state;
+};
+
+// load of this node, in shared memory so forked children update it too
+struct load_stats {
+    long active_connections;
+    long queued_jobs;
+    long bytes_in_flight;
+    // one per shard, whoever restarts a dead shard drops the clients it had queued
+    long waiting_clients[MAX_SHARDS];
+    long archive_jobs;
+    long waiting_jobs;
+    // archive jobs of every child process wait for a slot here; the owners are what the two counts
+    // above are worked out from again when a process dies holding the lock
+    pthread_mutex_t admit_lock;
+    pthread_cond_t admit_cond;
+    struct admit_owner owners[ADMIT_OWNERS];
+};
+struct load_stats *load;
+
+// admission limits, 0 lifts one; past them clients and archive jobs wait in queues of admit_queue entries
+int max_connections = DEFAULT_MAX_CONNECTIONS;
+int max_jobs = DEFAULT_MAX_JOBS;
+// off by default, one archive larger than the limit would hold back every build until it is sent
+long max_bytes = 0;
+int admit_queue = DEFAULT_ADMIT_QUEUE;
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+
+// with -N several processes accept on the same port, shard 0 also runs the listeners there is one of
+int num_shards = 1;
+int shard = 0;
+
+// accepted clients waiting for a connection slot, oldest first, only the accept loop touches it
+struct waiting_clients {
+    int *fds;
+    struct timespec *since;
+    int head;
+    int count;
+} waiting;
+
+// log2 latency buckets, bucket i counts samples under 2^i microseconds and the last one everything slower
+struct histogram {
+    unsigned long buckets[METRIC_BUCKETS];
+    unsigned long count;
+    unsigned long sum_us;
+};
+
+// what this node did since it started, shared like load and only ever changed with atomic adds
+struct metrics {
+    struct histogram latency[NUM_METRIC_COMMANDS][NUM_METRIC_PHASES];
+    unsigned long bytes_sent;
+    unsigned long connections;
+    unsigned long redirects;
+    unsigned long rejected;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long striped_archives;
+    unsigned long walk_syscalls;
+    unsigned long archive_syscalls;
+    unsigned long files_archived;
+    unsigned long files_deduplicated;
+    unsigned long bytes_deduplicated;
+    time_t started;
+};
+struct metrics *metrics;
+
+const char *metric_command_names[NUM_METRIC_COMMANDS] = {
+    "findfile", "sgetfiles", "dgetfiles", "gettargz", "getfiles", "resume", "other"
+};
+const char *metrics_port = METRICS_PORT;
+const char *replication_port = REPLICATION_PORT;
+
+// the index is saved here and loaded at the next start, "0" disables it
+const char *index_path = INDEX_PATH;
+
+// name the primary should hand to clients it redirects here
+const char *advertise_host = "localhost";
+
+// one connected socket per address of the primary
+int heartbeat_fds[MAX_HEARTBEAT_ADDRS];
+int num_heartbeat_fds = 0;
+
+// ready client connections waiting for a worker thread
+struct conn_queue {
+    struct conn **conns;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} ready_queue = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+int epoll_fd = -1;
+
+// one regular file known to the index
+struct file_entry {
+    char *path;
+    char *name;
+    off_t size;
+    time_t ctime;
+    time_t mtime;
+    int next;
+    int in_use;
+};
+
+// entry ids ordered by size or mtime, so a range query is two binary searches
+struct sorted_column {
+    int64_t *keys;
+    int *ids;
+    int count;
+    int capacity;
+};
 
-char *target_filename;
-int found = 0;
-int argc = 0;
-char *argv[10];
-int clientfd;
-char *response;
-char *home_dir;
+// a watched directory and its mtime when it was read, zero once something in it changed
+struct index_dir {
+    char *path;
+    struct timespec mtime;
+};
 
-int main() {
-    int server_fd, client_fd;
+// index file: this header, the directory records, the file records and the string table, in native byte order
+struct index_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_dirs;
+    uint32_t num_files;
+    uint64_t root;
+    uint64_t strings_size;
+};
+
+// a directory of the index file sorted by path, its files are the num_files records from first_file
+struct index_file_dir {
+    uint64_t path;
+    uint32_t first_file;
+    uint32_t num_files;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+// a file of the index file, name is relative to its directory
+struct index_file_entry {
+    uint64_t name;
+    int64_t size;
+    int64_t ctime;
+    int64_t mtime;
+};
+
+// name -> file hash index of the home directory, kept current with inotify
+struct file_index {
+    struct file_entry *entries;
+    int num_entries;
+    int capacity;
+    int num_files;
+    int *buckets;
+    int num_buckets;
+    int free_head;
+    struct sorted_column by_size;
+    struct sorted_column by_mtime;
+    int columns_ready;
+    struct index_dir *dirs;
+    int num_dirs;
+    unsigned long generation;
+    unsigned long saved_generation;
+    int inotify_fd;
+    int watch_warned;
+    const char *root;
+    volatile int ready;
+    pthread_rwlock_t lock;
+} file_index = { .inotify_fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+int main(int nargs, char *args[]) {
+    int server_fd;
     struct addrinfo hints, *res, *p;
-    struct sockaddr_in *server_addr, client_addr;
-    socklen_t client_addr_size;
-    pid_t child_pid;
+    struct sockaddr_in *server_addr;
+    int engine = ENGINE_FORK;
+    int num_workers = DEFAULT_WORKERS;
+    int opt;
+    char *cache_path = NULL;
+    char *primary = "localhost:" HEARTBEAT_PORT;
+
+    // parse startup options
+    while ((opt = getopt(nargs, args, "m:t:a:z:C:B:W:R:S:I:P:Uc:j:F:q:b:N:H:A:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0) {
+                engine = ENGINE_EPOLL;
+            } else if (strcmp(optarg, "fork") == 0) {
+                engine = ENGINE_FORK;
+            } else {
+                fprintf(stderr, "unknown engine: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            num_workers = atoi(optarg);
+            if (num_workers < 1) {
+                num_workers = 1;
+            }
+            break;
+        case 'a':
+            if (strcmp(optarg, "shell") == 0) {
+                archive_mode = ARCHIVE_SHELL;
+            } else if (strcmp(optarg, "builtin") == 0) {
+                archive_mode = ARCHIVE_BUILTIN;
+            } else if (strcmp(optarg, "dedup") == 0) {
+                archive_mode = ARCHIVE_DEDUP;
+            } else {
+                fprintf(stderr, "unknown archive mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            compress_threads = atoi(optarg);
+            if (compress_threads < 1) {
+                compress_threads = 1;
+            }
+            break;
+        case 'C':
+            cache_path = optarg;
+            break;
+        case 'B':
+            cache_budget = strtoull(optarg, NULL, 10);
+            break;
+        case 'W':
+            walk_threads = atoi(optarg);
+            if (walk_threads < 1) {
+                walk_threads = 1;
+            }
+            break;
+        case 'R':
+            transfer_ttl = atoi(optarg);
+            break;
+        case 'S':
+            metrics_port = optarg;
+            break;
+        case 'I':
+            // the primary's port to follow the index from
+            replication_port = optarg;
+            break;
+        case 'P':
+            index_path = optarg;
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'c':
+            max_connections = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'j':
+            max_jobs = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'F':
+            max_bytes = atol(optarg) > 0 ? atol(optarg) : 0;
+            break;
+        case 'q':
+            admit_queue = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'N':
+            num_shards = atoi(optarg);
+            if (num_shards < 1 || num_shards > MAX_SHARDS) {
+                fprintf(stderr, "shards must be between 1 and %d\n", MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H':
+            primary = optarg;
+            break;
+        case 'A':
+            advertise_host = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m fork|epoll] [-t workers] [-a builtin|shell|dedup] [-z gzip threads] "
+                    "[-C cache dir] [-B cache bytes] [-W walk threads] [-R transfer seconds] [-S metrics port] [-I replication port] [-P index file] [-U] "
+                    "[-c max connections] [-j max archive jobs] [-F max bytes in flight] [-q queue length] [-b listen backlog] [-N shards] [-H primary host:port] [-A advertised host]\n", args[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (cache_path != NULL && cache_init(cache_path) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (transfer_ttl > 0 && transfer_init() == -1) {
+        fprintf(stderr, "transfers will not be resumable\n");
+        transfer_ttl = 0;
+    }
+
+    load = mmap(NULL, sizeof(struct load_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (load == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    metrics->started = time(NULL);
+    if (archive_mode == ARCHIVE_DEDUP && dedup_init() == -1) {
+        fprintf(stderr, "no content hash cache, duplicates are hashed again by every archive\n");
+    }
+    if (admission_init() == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    codecs_init();
+
+    // io_uring may be missing, too old or blocked by a seccomp filter
+    if (use_uring) {
+        struct uring ring;
+        if (uring_init(&ring, URING_ENTRIES) == -1) {
+            fprintf(stderr, "io_uring unavailable, files are read with plain syscalls\n");
+            use_uring = 0;
+        } else {
+            uring_free(&ring);
+        }
+    }
+
+    // the shards share everything mapped above, each one indexes and listens on its own
+    if (num_shards > 1) {
+        run_shards();
+    }
+
+    // report our load to the primary, it only redirects clients to mirrors it hears from
+    if (shard == 0 && start_heartbeat_sender(primary) == -1) {
+        fprintf(stderr, "no heartbeat, the primary will not redirect clients here\n");
+    }
+
+    // a client hanging up mid transfer must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    // follow the primary's index so the tree is not walked twice, port "0" indexes it here
+    home_dir = getenv("HOME");
+    if (home_dir != NULL && strcmp(replication_port, "0") != 0) {
+        if (start_replica(primary) == -1) {
+            fprintf(stderr, "file index unavailable, findfile will walk the tree\n");
+        }
+    } else if (home_dir == NULL || index_init(home_dir) == -1) {
+        fprintf(stderr, "file index unavailable, findfile will walk the tree\n");
+    }
+
+    // port "0" turns the scrape endpoint off, the stats command still works
+    if (shard == 0 && strcmp(metrics_port, "0") != 0 && start_metrics_listener() == -1) {
+        fprintf(stderr, "metrics endpoint unavailable\n");
+    }
 
     // Configure server address
     memset(&hints, 0, sizeof(hints));
@@ -65,6 +1114,16 @@ int main() {
             continue;
         }
 
+        // allow a restarted server to rebind while old connections sit in TIME_WAIT
+        int reuse = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        // every shard binds its own socket to the port and the kernel spreads new connections over them
+        if (num_shards > 1 && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+            perror("SO_REUSEPORT");
+            close(server_fd);
+            continue;
+        }
+
         // Bind the socket
         if (bind(server_fd, p->ai_addr, p->ai_addrlen) == -1) {
             perror("bind");
@@ -83,304 +1142,5604 @@ int main() {
     freeaddrinfo(res);
 
     // Listen for clients
-    if (listen(server_fd, BACKLOG) == -1) {
+    if (listen(server_fd, listen_backlog) == -1) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
     server_addr = (struct sockaddr_in *)p->ai_addr;
-    printf("Server is listening on port %d...\n", ntohs(server_addr->sin_port));
+    if (num_shards > 1) {
+        printf("Shard %d of %d is listening on port %d...\n", shard, num_shards, ntohs(server_addr->sin_port));
+    } else {
+        printf("Server is listening on port %d...\n", ntohs(server_addr->sin_port));
+    }
 
-    while (1) {
-        client_addr_size = sizeof(client_addr);
+    if (engine == ENGINE_EPOLL) {
+        printf("Using epoll engine with %d workers\n", num_workers);
+        run_event_loop(server_fd, num_workers);
+    } else {
+        run_fork_loop(server_fd);
+    }
 
-        // Accept a client connection
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_size);
-        if (client_fd == -1) {
-            perror("accept");
-            continue;
-        }
-        
-        // Fork a child process to handle the client request
-        child_pid = fork();
-        if (child_pid < 0) {
-            perror("fork");
-            exit(EXIT_FAILURE);
-        }
+    return 0;
+}
 
-        if (child_pid == 0) {
-            // Closing server socket in child
-            close(server_fd);
-            processclient(client_fd);
-            exit(EXIT_SUCCESS);
-        } else {
-            // Closing client socket in parent process
-            close(client_fd);
+// set up the queue of waiting clients and the slots archive jobs wait for
+int admission_init() {
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+
+    if (admit_queue > 0) {
+        waiting.fds = malloc(admit_queue * sizeof(int));
+        waiting.since = malloc(admit_queue * sizeof(struct timespec));
+        if (waiting.fds == NULL || waiting.since == NULL) {
+            perror("malloc failed");
+            return -1;
         }
     }
 
+    // the lock lives in the shared load, so jobs of forked children wait on the same slots;
+    // robust, so a child killed while holding it does not stall every other one
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&load->admit_lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&load->admit_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
     return 0;
 }
 
-// Process client connection request
-void processclient(int client_fd) {
-    clientfd = client_fd;
-    char buffer[BUFFER_SIZE];
-    ssize_t num_bytes_received;
-    const char *quit_command = "quit";
+// decide about a client just accepted, 1 when it is served now; otherwise it was queued, redirected or turned away
+int admit_connection(int client_fd) {
+    if (waiting.count == 0 &&
+        (max_connections == 0 || __atomic_load_n(&load->active_connections, __ATOMIC_RELAXED) < max_connections)) {
+        return 1;
+    }
+    if (waiting.count < admit_queue) {
+        int slot = (waiting.head + waiting.count) % admit_queue;
+        waiting.fds[slot] = client_fd;
+        clock_gettime(CLOCK_MONOTONIC, &waiting.since[slot]);
+        waiting.count++;
+        __atomic_add_fetch(&load->waiting_clients[shard], 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    reject_client(client_fd);
+    return 0;
+}
 
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
+// the oldest queued client once a connection slot is free, -1 when there is none;
+// clients that waited ADMIT_WAIT seconds are turned away on the way
+int next_waiting_client() {
+    struct timespec now;
 
-        // Receive client command
-        num_bytes_received = recv(client_fd, buffer, BUFFER_SIZE, 0);
-        if (num_bytes_received <= 0) {
-            perror("recv");
-            close(client_fd);
-            return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (waiting.count > 0) {
+        int client_fd = waiting.fds[waiting.head];
+        int expired = elapsed_ms(&waiting.since[waiting.head], &now) > ADMIT_WAIT * 1000;
+        if (!expired && max_connections != 0 &&
+            __atomic_load_n(&load->active_connections, __ATOMIC_RELAXED) >= max_connections) {
+            return -1;
         }
-
-        // Check for quit command
-        if (strncmp(buffer, quit_command, strlen(quit_command)) == 0) {
-            printf("Client has issued quit command. Closing connection.\n");
-	        sendResponse("quit");
-            close(client_fd);
-            return;
+        waiting.head = (waiting.head + 1) % admit_queue;
+        waiting.count--;
+        __atomic_sub_fetch(&load->waiting_clients[shard], 1, __ATOMIC_RELAXED);
+        if (!expired) {
+            return client_fd;
         }
-
-        // Process client command and send response
-        executeCommand(buffer);
+        reject_client(client_fd);
     }
+    return -1;
 }
 
-// Method to process command sent by client
-void executeCommand(char *command) {
-    remove_trailing_spaces(command);
-    printf("Received command: %s\n", command);
+// turn away a client nobody has room for
+void reject_client(int client_fd) {
+    char msg[BUFFER_SIZE];
 
-    home_dir = getenv("HOME");
-    if (!home_dir) {
-        printf("Error: Home directory not found\n");
-        return;
-    }
-    
-    // Splitting command by delimiter(space)
-    char *token = strtok(command, " ");
-    argc = 0;
-    while (token != NULL) {
-        argv[argc++] = token;
-        token = strtok(NULL, " ");
-    }
+    // answered before the client's "test" is read, like a redirect
+    __atomic_add_fetch(&metrics->rejected, 1, __ATOMIC_RELAXED);
+    snprintf(msg, sizeof(msg), "BUSY retry-after %d", BUSY_RETRY_AFTER);
+    send(client_fd, msg, strlen(msg), MSG_NOSIGNAL);
+    close(client_fd);
+}
 
-    // filtering commands
-    if (strncmp(argv[0], "findfile", 8) == 0) {
-        target_filename = argv[1];
-        int result = ftw(home_dir, &iterate_over_files, 20);
-        if (result == 0) {
-            sendResponse("File not found");
-        }
-    } else if (strncmp(argv[0], "sgetfiles", 9) == 0 || strncmp(argv[0], "dgetfiles", 9) == 0 || strcmp(argv[0], "gettargz") == 0) {
-        char *cmd = generate_cmd();
-        printf("command: %s\n", cmd);
-        system(cmd);
-        send_tar();
-    } else if (strncmp(argv[0], "getfiles", 8) == 0) {
-        bool unzip = strcmp(argv[1], "-u") == 0;
-        int file_end_index = unzip ? 1 : 0;
-        int num_files = argc - file_end_index;
-        char *file_names[num_files];
-        bool found_files[num_files];
+// wait for a slot to build an archive in, -1 when the queue is full or the wait ran out
+int archive_job_admit() {
+    struct timespec deadline, next;
+    int ret = 0;
 
-        for (int i = 0; i < num_files; i++) {
-            file_names[i] = argv[i+file_end_index];
-            found_files[i] = false;
+    if (max_jobs == 0 && max_bytes == 0) {
+        return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ADMIT_WAIT;
+
+    admit_lock();
+    for (int i = 0; i < ADMIT_OWNERS && admit_owner == -1; i++) {
+        if (load->owners[i].pid == 0) {
+            admit_owner = i;
         }
-        search_files(home_dir, file_names, num_files, found_files);
+    }
+    if (admit_owner == -1) {
+        // every entry is taken, which only happens with -j 0 and thousands of jobs
+        pthread_mutex_unlock(&load->admit_lock);
+        return -1;
+    }
+    load->owners[admit_owner].pid = getpid();
+    load->owners[admit_owner].state = ADMIT_ARRIVED;
 
-        char cmd[2048] = "tar czf temp.tar.gz";
-        for (int i = 0; i < num_files; i++) {
-            if (found_files[i]) {
-                snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " %s", file_names[i]);
+    if (!archive_job_fits()) {
+        // slots of processes that died with them come back before anyone is made to wait
+        admit_reclaim();
+    }
+    if (!archive_job_fits()) {
+        if (load->waiting_jobs >= admit_queue) {
+            ret = -1;
+        } else {
+            load->waiting_jobs++;
+            load->owners[admit_owner].state = ADMIT_WAITING;
+            while (!archive_job_fits()) {
+                clock_gettime(CLOCK_REALTIME, &next);
+                if (next.tv_sec >= deadline.tv_sec) {
+                    ret = -1;
+                    break;
+                }
+                // bytes drain as archives are sent and that signals nobody, so the limits are looked at again
+                next.tv_nsec += ADMIT_POLL_MS * 1000000L;
+                if (next.tv_nsec >= 1000000000) {
+                    next.tv_sec++;
+                    next.tv_nsec -= 1000000000;
+                }
+                if (pthread_cond_timedwait(&load->admit_cond, &load->admit_lock, &next) == EOWNERDEAD) {
+                    admit_reclaim();
+                    pthread_mutex_consistent(&load->admit_lock);
+                }
             }
+            load->waiting_jobs--;
+            load->owners[admit_owner].state = ADMIT_ARRIVED;
         }
-        system(cmd);
-        send_tar();
+    }
+    if (ret == 0) {
+        load->archive_jobs++;
+        load->owners[admit_owner].state = ADMIT_RUNNING;
     } else {
-        sendResponse("Invalid command\n");
+        load->owners[admit_owner].pid = 0;
+        admit_owner = -1;
     }
-
-    return;
+    pthread_mutex_unlock(&load->admit_lock);
+    return ret;
 }
 
-int get_file_types(char *arg[], int argc, char *file_types[]) {
-    int i, num_types = 0;
-    for (i = 1; i < argc && num_types < MAX_FILE_TYPES; i++) {
-        if (strlen(arg[i]) <= 5 && strncmp(arg[i], ".", 1) != 0) {
-            file_types[num_types++] = arg[i];
-        }
+// take admit_lock, the counts are worked out again if its last holder died with it
+void admit_lock() {
+    if (pthread_mutex_lock(&load->admit_lock) == EOWNERDEAD) {
+        admit_reclaim();
+        pthread_mutex_consistent(&load->admit_lock);
     }
-    return num_types;
 }
 
-// generate command for creating tar file
-char* generate_cmd() {
-    char *cmd;
+// drop the owners whose process is gone and count running and waiting jobs again, caller holds admit_lock
+void admit_reclaim() {
+    long running = 0, waiting = 0;
 
-    if (strncmp("dgetfiles", argv[0], 9) == 0) {
-        cmd = malloc(BUFFER_SIZE);
-        snprintf(cmd, BUFFER_SIZE, "find ~ -type f -newermt %s ! -newermt %s | tar -czf %s -T -", argv[1], argv[2], TAR_FILE);
-    } else if (strncmp("sgetfiles", argv[0], 9) == 0) {
-        cmd = malloc(BUFFER_SIZE);
-        snprintf(cmd, BUFFER_SIZE, "find %s -type f -size +%ldc -size -%ldc -print0 | tar -czf %s --null -T -", home_dir, atol(argv[1]), atol(argv[2]), TAR_FILE);
-    } else {
-        char buf[BUFFER_SIZE], *filename;
-        char *file_types[MAX_FILE_TYPES];
-        int num_types = get_file_types(argv, argc, file_types);
-        cmd = malloc(BUFFER_SIZE);
-        filename = malloc(BUFFER_SIZE);
-        snprintf(cmd, BUFFER_SIZE, "find ~ -type f \\( -name '*.%s'", file_types[0]);
-        int i;
-        for (i = 1; i < num_types; i++) {
-            snprintf(buf, BUFFER_SIZE, " -o -name '*.%s'", file_types[i]);
-            strncat(cmd, buf, BUFFER_SIZE - strlen(cmd));
+    for (int i = 0; i < ADMIT_OWNERS; i++) {
+        struct admit_owner *o = &load->owners[i];
+        if (o->pid != 0 && kill(o->pid, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "process %d died with an archive %s, taking it back\n", (int)o->pid,
+                    o->state == ADMIT_RUNNING ? "slot" : "request queued");
+            o->pid = 0;
+        }
+        if (o->pid != 0) {
+            running += o->state == ADMIT_RUNNING;
+            waiting += o->state == ADMIT_WAITING;
         }
-        snprintf(buf, BUFFER_SIZE, " \\) -print0 | tar -czf %s -T -", TAR_FILE);
-        strncat(cmd, buf, BUFFER_SIZE - strlen(cmd));
-        free(filename);
     }
-    return cmd;
+    if (running != load->archive_jobs || waiting != load->waiting_jobs) {
+        load->archive_jobs = running;
+        load->waiting_jobs = waiting;
+        pthread_cond_broadcast(&load->admit_cond);
+    }
 }
 
-// for findfiles command, method will iterate over files in home directory
-int iterate_over_files(const char *fpath, const struct stat *sb, int typeflag) {
-    if (typeflag == FTW_F) {
-        char *file_name = strrchr(fpath, '/') + 1;
+// whether another archive job may start, caller holds admit_lock
+int archive_job_fits() {
+    return (max_jobs == 0 || load->archive_jobs < max_jobs) &&
+           (max_bytes == 0 || __atomic_load_n(&load->bytes_in_flight, __ATOMIC_RELAXED) < max_bytes);
+}
 
-        // if file is found, then will send details to client
-        if (strcmp(target_filename, file_name) == 0) {
+// give back the slot of a finished archive job
+void archive_job_done() {
+    if (max_jobs == 0 && max_bytes == 0) {
+        return;
+    }
+    admit_lock();
+    if (admit_owner != -1) {
+        load->owners[admit_owner].pid = 0;
+        admit_owner = -1;
+        load->archive_jobs--;
+    }
+    pthread_cond_broadcast(&load->admit_cond);
+    pthread_mutex_unlock(&load->admit_lock);
+}
 
-            int size = snprintf(NULL, 0, "File found: %s\nSize: %ld bytes\n", fpath, sb->st_size);
-            char date_created[20];
-            strftime(date_created, sizeof(date_created), "%Y-%m-%d %H:%M:%S", localtime(&(sb->st_ctime)));
-            size += snprintf(NULL, 0, "Date created: %s\n", date_created);
+// tell the client its archive request was turned away, a text protocol client can only be sent an empty archive
+void send_busy() {
+    char msg[32];
 
-            // allocate memory for the output buffer
-            response = malloc(size + 1);
+    __atomic_add_fetch(&metrics->rejected, 1, __ATOMIC_RELAXED);
+    if (current_conn == NULL || !current_conn->framed) {
+        send_archive_fd(-1);
+        return;
+    }
+    snprintf(msg, sizeof(msg), "BUSY retry-after %d", BUSY_RETRY_AFTER);
+    sendResponse(msg);
+}
 
-            // write the output to the buffer
-            sprintf(response, "File found: %s\nSize: %ld bytes\n", fpath, sb->st_size);
-            strftime(date_created, sizeof(date_created), "%Y-%m-%d %H:%M:%S", localtime(&(sb->st_ctime)));
-            sprintf(response + strlen(response), "Date created: %s\n", date_created);
+// connect UDP sockets to the primary's heartbeat port and start reporting on them
+int start_heartbeat_sender(const char *primary) {
+    struct addrinfo hints, *res, *p;
+    char host[256];
+    pthread_t tid;
 
-            // sending data to client
-            sendResponse(response);
+    const char *colon = strrchr(primary, ':');
+    if (colon == NULL || (size_t)(colon - primary) >= sizeof(host)) {
+        fprintf(stderr, "bad primary %s, expected host:port\n", primary);
+        return -1;
+    }
+    memcpy(host, primary, colon - primary);
+    host[colon - primary] = '\0';
 
-            found = 1;
-            return 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        perror("getaddrinfo");
+        return -1;
+    }
+    // UDP gives no hint which address the primary listens on, so report to all of them
+    for (p = res; p != NULL && num_heartbeat_fds < MAX_HEARTBEAT_ADDRS; p = p->ai_next) {
+        int fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(fd);
+            continue;
         }
+        heartbeat_fds[num_heartbeat_fds++] = fd;
+    }
+    freeaddrinfo(res);
+    if (num_heartbeat_fds == 0) {
+        perror("heartbeat connect");
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, heartbeat_send_main, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
     }
+    pthread_detach(tid);
     return 0;
 }
 
-// remove trailing spaces from command send by client
-void remove_trailing_spaces(char *str) {
-    int i = strlen(str) - 1;
-    while (i >= 0 && (str[i] == ' ' || str[i] == '\n' || str[i] == '\r')) {
-        str[i] = '\0';
-        i--;
+// send "HB host port active queued bytes" to the primary every second
+void *heartbeat_send_main(void *arg) {
+    char msg[512];
+    (void)arg;
+
+    while (1) {
+        snprintf(msg, sizeof(msg), "HB %s %s %ld %ld %ld", advertise_host, PORT,
+                 __atomic_load_n(&load->active_connections, __ATOMIC_RELAXED),
+                 __atomic_load_n(&load->queued_jobs, __ATOMIC_RELAXED),
+                 __atomic_load_n(&load->bytes_in_flight, __ATOMIC_RELAXED));
+        // a primary that is not up yet just makes this fail until it is
+        for (int i = 0; i < num_heartbeat_fds; i++) {
+            send(heartbeat_fds[i], msg, strlen(msg), MSG_NOSIGNAL);
+        }
+        sleep(HEARTBEAT_INTERVAL);
     }
+    return NULL;
 }
 
-// send the response back to client
-void sendResponse(char* response) {
-    if (send(clientfd, response, strlen(response), 0) == -1) {
-        perror("send");
-        close(clientfd);
-        return;
+// collect exited children so each one is taken off the active count
+void reap_children(int sig) {
+    int saved_errno = errno;
+    (void)sig;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        __atomic_sub_fetch(&load->active_connections, 1, __ATOMIC_RELAXED);
     }
+    errno = saved_errno;
 }
 
-// send the generate tar to client
-void send_tar() {
-
-    // opening the tar file
-    FILE *fp = fopen(TAR_FILE, "rb");
-    long file_size = 0;
-    char *file_buffer;
+// fork num_shards copies of the server and start a new one whenever one dies;
+// returns in each shard, the process that looks after them never does
+void run_shards() {
+    pid_t pids[MAX_SHARDS];
 
-    // if tar file does not exist
-    if (fp == NULL){
-        perror("file open failed");
-        send(clientfd, &file_size, sizeof(long), 0);
-        return;
+    printf("Starting %d shards\n", num_shards);
+    fflush(stdout);
+    for (int i = 0; i < num_shards; i++) {
+        pids[i] = start_shard(i);
+        if (pids[i] == 0) {
+            return;
+        }
+        if (pids[i] == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Get file size
-    fseek(fp, 0L, SEEK_END);
-    file_size = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-
-    // Allocate memory for file buffer
-    file_buffer = (char *)malloc(file_size * sizeof(char));
-    if (file_buffer == NULL){
-        perror("malloc failed");
+    while (1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_shards; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            fprintf(stderr, "shard %d exited with status %d, restarting it\n", i, status);
+            __atomic_store_n(&load->waiting_clients[i], 0, __ATOMIC_RELAXED);
+            // a shard that dies right at startup must not make this spin
+            sleep(SHARD_RESTART_DELAY);
+            pids[i] = start_shard(i);
+            if (pids[i] == 0) {
+                return;
+            }
+            if (pids[i] == -1) {
+                perror("fork");
+            }
+        }
+    }
+}
+
+// fork shard id, 0 in the new shard and its pid (or -1) in the parent
+pid_t start_shard(int id) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+    shard = id;
+    // shards go down with the process that started them instead of holding the port
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
         exit(EXIT_FAILURE);
     }
+    pin_shard(id);
+    return 0;
+}
 
-    // send file size to client
-    send(clientfd, &file_size, sizeof(long), 0);
+// keep shard id on its own slice of the CPUs we may run on, shards share CPUs only when there are fewer CPUs than shards
+void pin_shard(int id) {
+    cpu_set_t allowed, mine;
+    int cpus[CPU_SETSIZE];
+    int num_cpus = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[num_cpus++] = cpu;
+        }
+    }
+    if (num_cpus == 0) {
+        return;
+    }
 
-    if (file_size < 50) {
-	    free(file_buffer);
-	    return;
+    CPU_ZERO(&mine);
+    int first = id % num_cpus;
+    int last = first + 1;
+    if (num_shards < num_cpus) {
+        first = id * num_cpus / num_shards;
+        last = (id + 1) * num_cpus / num_shards;
+    }
+    for (int i = first; i < last; i++) {
+        CPU_SET(cpus[i], &mine);
+    }
+    // threads and client processes started later inherit the mask
+    if (sched_setaffinity(0, sizeof(mine), &mine) == -1) {
+        perror("sched_setaffinity");
+        return;
     }
+    printf("Shard %d runs on %d of %d CPUs\n", id, last - first, num_cpus);
+}
+
+// close a client handled by the event loop
+void close_client(struct conn *c) {
+    close(c->fd);
+    free(c);
+    __atomic_sub_fetch(&load->active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// accept loop forking a process per client
+void run_fork_loop(int server_fd) {
+    int client_fd;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_size;
+    struct sigaction sa;
+    struct pollfd pfd = { server_fd, POLLIN, 0 };
 
-    // Read file into buffer
-    fread(file_buffer, sizeof(char), file_size, fp);
+    // children are reaped as they exit, which also keeps the connection count right
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reap_children;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
 
-    // Send file to client
-    send(clientfd, file_buffer, file_size, 0);
+    while (1) {
+        // queued clients go first, an exiting child wakes nobody so the queue is looked at every ADMIT_POLL_MS
+        while ((client_fd = next_waiting_client()) != -1) {
+            fork_client(server_fd, client_fd);
+        }
+        if (waiting.count > 0 && poll(&pfd, 1, ADMIT_POLL_MS) <= 0) {
+            continue;
+        }
+        client_addr_size = sizeof(client_addr);
 
-    // Send completion message
-    send(clientfd, "Tar received\n", 12, 0);
-    fclose(fp);
+        // Accept a client connection
+        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_size);
+        if (client_fd == -1) {
+            perror("accept");
+            continue;
+        }
+        set_nodelay(client_fd);
+        __atomic_add_fetch(&metrics->connections, 1, __ATOMIC_RELAXED);
 
-    // after file transfer, deleting the tar file
-    remove(TAR_FILE);
-    free(file_buffer);
+        // serve the client now, or leave it queued, redirected or turned away
+        if (admit_connection(client_fd)) {
+            fork_client(server_fd, client_fd);
+        }
+    }
 }
 
-// search for list of files
-void search_files(const char *dir_name, char *file_names[], int num_files, bool *found_files) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat path_stat;
+// fork a child process to handle the client request
+void fork_client(int server_fd, int client_fd) {
+    __atomic_add_fetch(&load->active_connections, 1, __ATOMIC_RELAXED);
 
-    if (!(dir = opendir(dir_name))) {
+    pid_t child_pid = fork();
+    if (child_pid < 0) {
+        // out of processes is overload too, the client is told to come back instead of the server exiting
+        perror("fork");
+        __atomic_sub_fetch(&load->active_connections, 1, __ATOMIC_RELAXED);
+        reject_client(client_fd);
         return;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
-        stat(path, &path_stat);
+    if (child_pid == 0) {
+        // Closing server socket in child
+        signal(SIGCHLD, SIG_DFL);
+        close(server_fd);
+        processclient(client_fd);
+        exit(EXIT_SUCCESS);
+    }
+    // Closing client socket in parent process
+    close(client_fd);
+}
+
+// event loop owning all client sockets, commands run on a fixed worker pool
+void run_event_loop(int server_fd, int num_workers) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    pthread_t tid;
+    int client_fd;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    // the listening socket is the one entry without a connection
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+
+    while (1) {
+        // as in the fork loop, a closed connection wakes nobody so queued clients are looked at every ADMIT_POLL_MS
+        while ((client_fd = next_waiting_client()) != -1) {
+            start_client(client_fd);
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, waiting.count > 0 ? ADMIT_POLL_MS : -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
 
-        if (S_ISDIR(path_stat.st_mode)) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (c != NULL) {
+                // client socket is readable, a worker will run its command
+                queue_push(c);
                 continue;
             }
-            search_files(path, file_names, num_files, found_files);
-        } else {
-            for (int i = 0; i < num_files; i++) {
-                if (strcmp(file_names[i], entry->d_name) == 0) {
-                    file_names[i] = malloc(strlen(path) * sizeof(char));
-                    strcpy(file_names[i], path);
-                    printf("%s\n", path);
-                    found_files[i] = true;
+
+            // drain all pending connections
+            while (1) {
+                client_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (client_fd == -1) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror("accept");
+                    }
+                    break;
+                }
+                set_nodelay(client_fd);
+                __atomic_add_fetch(&metrics->connections, 1, __ATOMIC_RELAXED);
+
+                if (admit_connection(client_fd)) {
+                    start_client(client_fd);
                 }
             }
         }
     }
+}
+
+// hand a new client to the event loop
+void start_client(int client_fd) {
+    struct epoll_event ev;
+
+    __atomic_add_fetch(&load->active_connections, 1, __ATOMIC_RELAXED);
+    struct conn *c = calloc(1, sizeof(struct conn));
+    if (c == NULL) {
+        perror("calloc failed");
+        close(client_fd);
+        __atomic_sub_fetch(&load->active_connections, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    c->fd = client_fd;
+
+    // one shot so only one worker at a time handles a client
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        close_client(c);
+    }
+}
+
+// worker thread running client commands handed over by the event loop
+void *worker_main(void *arg) {
+    struct epoll_event ev;
+    (void)arg;
+
+    while (1) {
+        struct conn *c = queue_pop();
+        int done = handle_client_message(c);
+        // counted from queue_push() until here, waiting and running alike
+        __atomic_sub_fetch(&load->queued_jobs, 1, __ATOMIC_RELAXED);
+        if (done != 0) {
+            close_client(c);
+            continue;
+        }
+
+        // re-arm the socket for its next command
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close_client(c);
+        }
+    }
+    return NULL;
+}
+
+// responses go out as a header write followed by the body, Nagle would hold the body back
+// until the client's delayed ACK of the header
+void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// add a ready connection to the worker queue
+void queue_push(struct conn *c) {
+    pthread_mutex_lock(&ready_queue.lock);
+    if (ready_queue.count == ready_queue.capacity) {
+        int new_capacity = ready_queue.capacity ? ready_queue.capacity * 2 : MAX_EVENTS;
+        struct conn **conns = malloc(new_capacity * sizeof(struct conn *));
+        if (conns == NULL) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ready_queue.count; i++) {
+            conns[i] = ready_queue.conns[(ready_queue.head + i) % ready_queue.capacity];
+        }
+        free(ready_queue.conns);
+        ready_queue.conns = conns;
+        ready_queue.capacity = new_capacity;
+        ready_queue.head = 0;
+    }
+    ready_queue.conns[(ready_queue.head + ready_queue.count) % ready_queue.capacity] = c;
+    ready_queue.count++;
+    c->queued = 1;
+    __atomic_add_fetch(&load->queued_jobs, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&ready_queue.not_empty);
+    pthread_mutex_unlock(&ready_queue.lock);
+}
+
+// take the next ready connection, blocking until there is one
+struct conn *queue_pop() {
+    pthread_mutex_lock(&ready_queue.lock);
+    while (ready_queue.count == 0) {
+        pthread_cond_wait(&ready_queue.not_empty, &ready_queue.lock);
+    }
+    struct conn *c = ready_queue.conns[ready_queue.head];
+    ready_queue.head = (ready_queue.head + 1) % ready_queue.capacity;
+    ready_queue.count--;
+    pthread_mutex_unlock(&ready_queue.lock);
+    return c;
+}
+
+// Process client connection request
+void processclient(int client_fd) {
+    struct conn c;
+    memset(&c, 0, sizeof(c));
+    c.fd = client_fd;
+    while (handle_client_message(&c) == 0) {
+    }
+    close(client_fd);
+}
+
+// receive and run client command(s), returns -1 once the connection is done
+int handle_client_message(struct conn *c) {
+    clientfd = c->fd;
+    current_conn = c;
+    ssize_t num_bytes_received;
+
+    if (!c->framed) {
+        memset(c->buf, 0, BUFFER_SIZE);
+        c->len = 0;
+    }
+
+    // Receive client command; only a legacy message needs room for the '\0' added below, frames use the whole buffer
+    num_bytes_received = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - (c->framed ? 0 : 1), 0);
+    if (num_bytes_received <= 0) {
+        if (num_bytes_received < 0) {
+            perror("recv");
+        }
+        return -1;
+    }
+    c->len += num_bytes_received;
+
+    // legacy commands are lower case text, so the frame magic cannot start one
+    if (!c->framed && c->len >= 2 && c->buf[0] == FRAME_MAGIC0 && c->buf[1] == FRAME_MAGIC1) {
+        c->framed = 1;
+    }
+    if (c->framed) {
+        return handle_frames(c);
+    }
+
+    // a legacy message is exactly what one recv returned
+    c->buf[c->len] = '\0';
+    return run_command(c->buf);
+}
+
+// run every complete frame in the connection buffer, in the order they were sent
+int handle_frames(struct conn *c) {
+    char command[MAX_FRAME_PAYLOAD + 1];
+    size_t offset = 0;
+    int ret = 0;
+
+    while (ret == 0 && c->len - offset >= FRAME_HEADER_SIZE) {
+        const unsigned char *header = (const unsigned char *)c->buf + offset;
+        uint32_t request_id;
+        uint64_t length;
+
+        memcpy(&request_id, header + 4, sizeof(request_id));
+        memcpy(&length, header + 8, sizeof(length));
+        request_id = be32toh(request_id);
+        length = be64toh(length);
+
+        if (header[0] != FRAME_MAGIC0 || header[1] != FRAME_MAGIC1 ||
+            length > (header[3] == FRAME_DELTA ? MAX_DELTA_REQUEST : MAX_FRAME_PAYLOAD)) {
+            fprintf(stderr, "bad frame from client, closing connection\n");
+            return -1;
+        }
+        // nothing after the header can be trusted in a version we do not speak
+        if (header[2] != FRAME_VERSION) {
+            fprintf(stderr, "frame version %d from client is not supported, closing connection\n", header[2]);
+            send_frame_header(FRAME_ERROR, request_id, 0);
+            return -1;
+        }
+        if (header[3] == FRAME_DELTA) {
+            c->request_id = request_id;
+            c->responded = 0;
+            ret = run_delta_frame(c, &offset, length);
+            continue;
+        }
+        if (c->len - offset < FRAME_HEADER_SIZE + length) {
+            // the rest of this frame is still on its way
+            break;
+        }
+
+        c->request_id = request_id;
+        c->responded = 0;
+        c->striped = header[3] == FRAME_STRIPE;
+        switch (header[3]) {
+        case FRAME_HELLO:
+            // the version was checked above and the reply carries ours, only the codec is left to pick
+            send_hello(c, (const char *)header + FRAME_HEADER_SIZE, length);
+            break;
+        case FRAME_COMMAND:
+        case FRAME_STRIPE:
+            memcpy(command, header + FRAME_HEADER_SIZE, length);
+            command[length] = '\0';
+            ret = run_command(command);
+            // every request gets exactly one response frame, even if the command sent none
+            if (!c->responded) {
+                send_frame_header(FRAME_ERROR, request_id, 0);
+            }
+            break;
+        default:
+            send_frame_header(FRAME_ERROR, request_id, 0);
+            break;
+        }
+        offset += FRAME_HEADER_SIZE + length;
+    }
+
+    memmove(c->buf, c->buf + offset, c->len - offset);
+    c->len -= offset;
+    return ret;
+}
+
+// pick the archive codec from a HELLO listing "name[:level]" in the client's order of preference
+void send_hello(struct conn *c, const char *offer, size_t length) {
+    char text[MAX_FRAME_PAYLOAD + 1];
+    char reply[64];
+    char *saveptr;
+
+    // an empty HELLO comes from a client that only knows gzip, it gets an empty answer
+    if (length == 0) {
+        send_frame_header(FRAME_HELLO, c->request_id, 0);
+        return;
+    }
+    memcpy(text, offer, length);
+    text[length] = '\0';
+
+    c->codec = CODEC_GZIP;
+    c->level = 0;
+    for (char *token = strtok_r(text, " ", &saveptr); token != NULL; token = strtok_r(NULL, " ", &saveptr)) {
+        char *level = strchr(token, ':');
+        if (level != NULL) {
+            *level++ = '\0';
+        }
+        int codec = codec_by_name(token);
+        // the shell archiver only writes gzip
+        if (codec == -1 || !codecs[codec].available || (archive_mode == ARCHIVE_SHELL && codec != CODEC_GZIP)) {
+            continue;
+        }
+        c->codec = codec;
+        if (level != NULL) {
+            c->level = atoi(level);
+            if (c->level < codecs[codec].min_level) {
+                c->level = codecs[codec].min_level;
+            } else if (c->level > codecs[codec].max_level) {
+                c->level = codecs[codec].max_level;
+            }
+        }
+        break;
+    }
+
+    // chunks of a striped archive are fetched by transfer id, so striping needs transfers kept
+    int len = snprintf(reply, sizeof(reply), "%s %d%s", codecs[c->codec].name,
+                       c->level != 0 ? c->level : codecs[c->codec].default_level, transfer_ttl > 0 ? " stripe" : "");
+    if (send_frame_header(FRAME_HELLO, c->request_id, len) == 0) {
+        send_all(clientfd, reply, len);
+    }
+}
+
+// run one text command, returns -1 when the client quits
+int run_command(char *buffer) {
+    const char *quit_command = "quit";
+
+    // Check for quit command
+    if (strncmp(buffer, quit_command, strlen(quit_command)) == 0) {
+        printf("Client has issued quit command. Closing connection.\n");
+        sendResponse("quit");
+        return -1;
+    }
+
+    // Process client command and send response, it counts as queued work until done
+    // unless the ready queue already counts its connection
+    struct timespec start;
+    int counted = current_conn == NULL || !current_conn->queued;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    metric_command = METRIC_OTHER;
+    if (counted) {
+        __atomic_add_fetch(&load->queued_jobs, 1, __ATOMIC_RELAXED);
+    }
+    executeCommand(buffer);
+    if (counted) {
+        __atomic_sub_fetch(&load->queued_jobs, 1, __ATOMIC_RELAXED);
+    }
+    metrics_observe(PHASE_REQUEST, &start);
+    return 0;
+}
+
+// run a delta request, its signatures outgrow the connection buffer so the rest is read from the socket
+int run_delta_frame(struct conn *c, size_t *offset, uint64_t length) {
+    size_t in_buffer = c->len - *offset - FRAME_HEADER_SIZE;
+    struct timespec start;
+
+    if (in_buffer > length) {
+        in_buffer = length;
+    }
+    char *payload = malloc(length + 1);
+    if (payload == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    memcpy(payload, c->buf + *offset + FRAME_HEADER_SIZE, in_buffer);
+    *offset += FRAME_HEADER_SIZE + in_buffer;
+    if (recv_all(c->fd, payload + in_buffer, length - in_buffer) == -1) {
+        free(payload);
+        return -1;
+    }
+    payload[length] = '\0';
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    metric_command = METRIC_OTHER;
+    if (!c->queued) {
+        __atomic_add_fetch(&load->queued_jobs, 1, __ATOMIC_RELAXED);
+    }
+    handle_delta_request(payload, length);
+    if (!c->queued) {
+        __atomic_sub_fetch(&load->queued_jobs, 1, __ATOMIC_RELAXED);
+    }
+    metrics_observe(PHASE_REQUEST, &start);
+    free(payload);
+
+    if (!c->responded) {
+        send_frame_header(FRAME_ERROR, c->request_id, 0);
+    }
+    return 0;
+}
+
+// send the header of a response frame for the current request
+int send_frame_header(int type, uint32_t request_id, uint64_t length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint32_t id = htobe32(request_id);
+    uint64_t len = htobe64(length);
+
+    header[0] = FRAME_MAGIC0;
+    header[1] = FRAME_MAGIC1;
+    header[2] = FRAME_VERSION;
+    header[3] = type;
+    memcpy(header + 4, &id, sizeof(id));
+    memcpy(header + 8, &len, sizeof(len));
+    // a transfer id only announces the ARCHIVE frame that answers the request
+    if (current_conn != NULL && type != FRAME_TRANSFER) {
+        current_conn->responded = 1;
+    }
+    return send_all(clientfd, header, sizeof(header));
+}
+
+// Method to process command sent by client
+void executeCommand(char *command) {
+    remove_trailing_spaces(command);
+    printf("Received command: %s\n", command);
+
+    home_dir = getenv("HOME");
+    if (!home_dir) {
+        printf("Error: Home directory not found\n");
+        return;
+    }
+    
+    // Splitting command by delimiter(space)
+    char *saveptr;
+    char *token = strtok_r(command, " ", &saveptr);
+    argc = 0;
+    while (token != NULL && argc < 10) {
+        argv[argc++] = token;
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+    if (argc == 0) {
+        sendResponse("Invalid command\n");
+        return;
+    }
+    metric_command = metric_command_for(argv[0]);
+
+    // filtering commands
+    if (strncmp(argv[0], "findfile", 8) == 0) {
+        if (argc < 2) {
+            sendResponse("Invalid command\n");
+            return;
+        }
+        // every argument is a file name or a glob, all of them are matched in one pass over the names
+        struct name_matcher matcher;
+        struct find_result found = { .matcher = &matcher };
+        struct timespec start;
+        if (matcher_init(&matcher, argv + 1, argc - 1) == -1) {
+            sendResponse("Invalid command\n");
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (file_index.ready) {
+            index_find_files(&found);
+        } else {
+            // walker threads do not share this thread's connection, so the matches are sent from here
+            struct walk w = { .on_file = findfile_visit_file, .arg = &found, .want_stat = 1 };
+            walk_tree(&w, home_dir);
+        }
+        metrics_observe(PHASE_WALK, &start);
+        send_find_result(&found);
+        find_result_free(&found);
+        matcher_free(&matcher);
+    } else if (strncmp(argv[0], "sgetfiles", 9) == 0 || strncmp(argv[0], "dgetfiles", 9) == 0 ||
+               strcmp(argv[0], "gettargz") == 0 || strncmp(argv[0], "getfiles", 8) == 0) {
+        handle_archive_command();
+    } else if (strcmp(argv[0], "resume") == 0) {
+        handle_resume_command();
+    } else if (strcmp(argv[0], "stats") == 0) {
+        send_stats();
+    } else {
+        sendResponse("Invalid command\n");
+    }
+
+    return;
+}
+
+int get_file_types(char *arg[], int argc, char *file_types[]) {
+    int i, num_types = 0;
+    for (i = 1; i < argc && num_types < MAX_FILE_TYPES; i++) {
+        if (strlen(arg[i]) <= 5 && strncmp(arg[i], ".", 1) != 0) {
+            file_types[num_types++] = arg[i];
+        }
+    }
+    return num_types;
+}
+
+// generate command for creating tar file at tar_path
+char* generate_cmd(const char *tar_path) {
+    char *cmd;
+
+    if (strncmp("dgetfiles", argv[0], 9) == 0) {
+        cmd = malloc(BUFFER_SIZE);
+        snprintf(cmd, BUFFER_SIZE, "find ~ -type f -newermt %s ! -newermt %s | tar -czf %s -T -", argv[1], argv[2], tar_path);
+    } else if (strncmp("sgetfiles", argv[0], 9) == 0) {
+        cmd = malloc(BUFFER_SIZE);
+        snprintf(cmd, BUFFER_SIZE, "find %s -type f -size +%ldc -size -%ldc -print0 | tar -czf %s --null -T -", home_dir, atol(argv[1]), atol(argv[2]), tar_path);
+    } else {
+        char buf[BUFFER_SIZE], *filename;
+        char *file_types[MAX_FILE_TYPES];
+        int num_types = get_file_types(argv, argc, file_types);
+        cmd = malloc(BUFFER_SIZE);
+        filename = malloc(BUFFER_SIZE);
+        snprintf(cmd, BUFFER_SIZE, "find ~ -type f \\( -name '*.%s'", file_types[0]);
+        int i;
+        for (i = 1; i < num_types; i++) {
+            snprintf(buf, BUFFER_SIZE, " -o -name '*.%s'", file_types[i]);
+            strncat(cmd, buf, BUFFER_SIZE - strlen(cmd));
+        }
+        snprintf(buf, BUFFER_SIZE, " \\) -print0 | tar -czf %s -T -", tar_path);
+        strncat(cmd, buf, BUFFER_SIZE - strlen(cmd));
+        free(filename);
+    }
+    return cmd;
+}
+
+// for findfile command, walker callback checking each file in home directory against every pattern
+int findfile_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb) {
+    struct find_result *found = w->arg;
+
+    if (matcher_match(found->matcher, name)) {
+        return find_result_add(found, path, sb->st_size, sb->st_ctime);
+    }
+    return 0;
+}
+
+// send the findfile details of every match to the client, sorted by path
+void send_find_result(struct find_result *found) {
+    char *text = NULL;
+    size_t text_len = 0;
+    int shown = 0;
+
+    if (found->total == 0) {
+        sendResponse("File not found");
+        return;
+    }
+    qsort(found->items, found->count, sizeof(struct find_match), compare_find_matches);
+
+    FILE *out = open_memstream(&text, &text_len);
+    if (out == NULL) {
+        perror("open_memstream");
+        return;
+    }
+    for (; shown < found->count; shown++) {
+        struct find_match *match = &found->items[shown];
+        char entry[PATH_MAX + 128];
+        char date_created[20];
+        struct tm tm_created;
+
+        localtime_r(&match->ctime, &tm_created);
+        strftime(date_created, sizeof(date_created), "%Y-%m-%d %H:%M:%S", &tm_created);
+        int len = snprintf(entry, sizeof(entry), "File found: %s\nSize: %ld bytes\nDate created: %s\n",
+                           match->path, (long)match->size, date_created);
 
-    closedir(dir);
+        // a text protocol client reads one buffer, keep room for the line saying what was left out
+        if (!(current_conn != NULL && current_conn->framed) && ftell(out) + len > BUFFER_SIZE - 64) {
+            break;
+        }
+        fputs(entry, out);
+    }
+    if (shown < found->total) {
+        fprintf(out, "... and %d more matches\n", found->total - shown);
+    }
+    fclose(out);
+    sendResponse(text);
+    free(text);
+}
+
+// keep a findfile match, returns 1 once there are so many that the search can stop
+int find_result_add(struct find_result *found, const char *path, off_t size, time_t ctime) {
+    found->total++;
+    if (found->count == MAX_FIND_MATCHES) {
+        return 0;
+    }
+    if (found->count == found->capacity) {
+        int capacity = found->capacity ? found->capacity * 2 : 16;
+        struct find_match *items = realloc(found->items, capacity * sizeof(struct find_match));
+        if (items == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        found->items = items;
+        found->capacity = capacity;
+    }
+    struct find_match *match = &found->items[found->count];
+    match->path = strdup(path);
+    if (match->path == NULL) {
+        perror("strdup failed");
+        return 1;
+    }
+    match->size = size;
+    match->ctime = ctime;
+    found->count++;
+    return 0;
+}
+
+// release the matches of a findfile request
+void find_result_free(struct find_result *found) {
+    for (int i = 0; i < found->count; i++) {
+        free(found->items[i].path);
+    }
+    free(found->items);
+    found->items = NULL;
+    found->count = found->capacity = 0;
+}
+
+int compare_find_matches(const void *a, const void *b) {
+    return strcmp(((const struct find_match *)a)->path, ((const struct find_match *)b)->path);
+}
+
+// build the automaton over the literal part of each pattern, globs are confirmed with fnmatch
+int matcher_init(struct name_matcher *m, char **patterns, int num_patterns) {
+    // filename characters from most to least common, bytes not listed count as rarest
+    static const char common[] = "._etaoinsrlcdmhpgufbywvkxjzq-0123456789";
+    size_t total = 1;
+    int *fail = NULL;
+    int *queue = NULL;
+
+    memset(m, 0, sizeof(*m));
+    if (num_patterns < 1 || num_patterns > 32) {
+        return -1;
+    }
+    m->patterns = patterns;
+    m->num_patterns = num_patterns;
+    for (int i = 0; i < num_patterns; i++) {
+        size_t len;
+        glob_literal(patterns[i], &len);
+        total += len;
+        if (strpbrk(patterns[i], "*?[\\") != NULL) {
+            m->num_globs++;
+        }
+    }
+
+    m->next = malloc(total * 256 * sizeof(int));
+    m->out = calloc(total, sizeof(uint32_t));
+    fail = malloc(total * sizeof(int));
+    queue = malloc(total * sizeof(int));
+    if (m->next == NULL || m->out == NULL || fail == NULL || queue == NULL) {
+        perror("malloc failed");
+        free(fail);
+        free(queue);
+        matcher_free(m);
+        return -1;
+    }
+    memset(m->next, -1, 256 * sizeof(int));
+    m->num_states = 1;
+
+    // trie of the literals, each pattern also picks its rarest byte for the prefilter
+    int too_many = 0;
+    for (int i = 0; i < num_patterns; i++) {
+        size_t len;
+        const unsigned char *literal = (const unsigned char *)glob_literal(patterns[i], &len);
+        int state = 0;
+        int rarest = -1;
+        unsigned char pick = 0;
+
+        if (len == 0) {
+            // nothing every match must contain, each name is a candidate
+            m->always |= 1u << i;
+            continue;
+        }
+        for (size_t j = 0; j < len; j++) {
+            int *slot = &m->next[state * 256 + literal[j]];
+            if (*slot == -1) {
+                *slot = m->num_states;
+                memset(&m->next[m->num_states * 256], -1, 256 * sizeof(int));
+                m->num_states++;
+            }
+            state = *slot;
+
+            const char *rank = literal[j] ? strchr(common, literal[j]) : NULL;
+            int score = rank != NULL ? rank - common : (int)sizeof(common);
+            if (score > rarest) {
+                rarest = score;
+                pick = literal[j];
+            }
+        }
+        m->out[state] |= 1u << i;
+
+        if (memchr(m->rare, pick, m->num_rare) == NULL) {
+            if (m->num_rare == MATCHER_RARE_BYTES) {
+                too_many = 1;
+            } else {
+                m->rare[m->num_rare++] = pick;
+            }
+        }
+    }
+    // without a byte every match must contain, every name goes through the automaton
+    if (too_many || m->always != 0) {
+        m->num_rare = 0;
+    }
+
+    // breadth first, a missing transition takes the one of the longest proper suffix
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        int child = m->next[c];
+        if (child == -1) {
+            m->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        for (int c = 0; c < 256; c++) {
+            int child = m->next[state * 256 + c];
+            int fallback = m->next[fail[state] * 256 + c];
+            if (child == -1) {
+                m->next[state * 256 + c] = fallback;
+            } else {
+                fail[child] = fallback;
+                m->out[child] |= m->out[fallback];
+                queue[tail++] = child;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+// release the automaton of a matcher
+void matcher_free(struct name_matcher *m) {
+    free(m->next);
+    free(m->out);
+    m->next = NULL;
+    m->out = NULL;
+}
+
+// longest run of plain characters in a glob, any name it matches has to contain it
+const char *glob_literal(const char *pattern, size_t *len) {
+    const char *best = pattern;
+    size_t best_len = 0;
+    const char *p = pattern;
+
+    while (*p != '\0') {
+        const char *run = p;
+        while (*p != '\0' && strchr("*?[\\", *p) == NULL) {
+            p++;
+        }
+        if ((size_t)(p - run) > best_len) {
+            best = run;
+            best_len = p - run;
+        }
+        if (*p == '[') {
+            // skip the bracket expression, a ] right after [ or [! is part of it
+            p++;
+            if (*p == '!' || *p == '^') {
+                p++;
+            }
+            if (*p == ']') {
+                p++;
+            }
+            while (*p != '\0' && *p != ']') {
+                p++;
+            }
+        } else if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        if (*p != '\0') {
+            p++;
+        }
+    }
+    *len = best_len;
+    return best;
+}
+
+// whether name matches any pattern, the automaton narrows down which patterns fnmatch has to check
+int matcher_match(const struct name_matcher *m, const char *name) {
+    size_t len = strlen(name);
+    uint32_t candidates = m->always;
+
+    if (m->num_rare == 0 || matcher_prefilter(m, name, len)) {
+        int state = 0;
+        for (size_t i = 0; i < len; i++) {
+            state = m->next[state * 256 + (unsigned char)name[i]];
+            candidates |= m->out[state];
+        }
+    }
+    for (int i = 0; candidates != 0; i++, candidates >>= 1) {
+        if ((candidates & 1) && fnmatch(m->patterns[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// whether name holds a rare byte of some literal, 16 bytes per step where SSE2 is available
+int matcher_prefilter(const struct name_matcher *m, const char *name, size_t len) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i needles[MATCHER_RARE_BYTES];
+    for (int k = 0; k < m->num_rare; k++) {
+        needles[k] = _mm_set1_epi8((char)m->rare[k]);
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(name + i));
+        __m128i hits = _mm_cmpeq_epi8(chunk, needles[0]);
+        for (int k = 1; k < m->num_rare; k++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[k]));
+        }
+        if (_mm_movemask_epi8(hits) != 0) {
+            return 1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        for (int k = 0; k < m->num_rare; k++) {
+            if ((unsigned char)name[i] == m->rare[k]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// remove trailing spaces from command send by client
+void remove_trailing_spaces(char *str) {
+    int i = strlen(str) - 1;
+    while (i >= 0 && (str[i] == ' ' || str[i] == '\n' || str[i] == '\r')) {
+        str[i] = '\0';
+        i--;
+    }
+}
+
+// send the response back to client
+void sendResponse(char* response) {
+    if (current_conn != NULL && current_conn->framed) {
+        // later responses to the same request would break the framing
+        if (current_conn->responded) {
+            return;
+        }
+        send_frame_header(FRAME_TEXT, current_conn->request_id, strlen(response));
+        send_all(clientfd, response, strlen(response));
+        return;
+    }
+
+    // a failed send is noticed by the next recv on this connection
+    ssize_t sent = send(clientfd, response, strlen(response), 0);
+    if (sent == -1) {
+        perror("send");
+        return;
+    }
+    __atomic_add_fetch(&metrics->bytes_sent, sent, __ATOMIC_RELAXED);
+}
+
+
+// send an archive that is open on fd, -1 tells the client there is none
+void send_archive_fd(int fd) {
+    send_archive_range(fd, 0, -1);
+}
+
+// send length bytes of an archive from offset, or everything after offset when length is -1
+void send_archive_range(int fd, off_t offset, off_t length) {
+    long file_size = 0;
+    struct stat sb;
+
+    // if tar file does not exist
+    if (fd == -1 || fstat(fd, &sb) == -1 || offset < 0 || offset > sb.st_size) {
+        if (current_conn != NULL && current_conn->framed) {
+            send_frame_header(FRAME_ARCHIVE, current_conn->request_id, 0);
+            return;
+        }
+        send_all(clientfd, &file_size, sizeof(long));
+        return;
+    }
+    file_size = sb.st_size - offset;
+    if (length >= 0 && length < file_size) {
+        file_size = length;
+    }
+
+    // a framed archive is just its bytes, the frame length replaces size and trailer
+    if (current_conn != NULL && current_conn->framed) {
+        send_frame_header(FRAME_ARCHIVE, current_conn->request_id, file_size);
+        __atomic_add_fetch(&load->bytes_in_flight, file_size, __ATOMIC_RELAXED);
+        send_file_range(clientfd, fd, offset, file_size);
+        __atomic_sub_fetch(&load->bytes_in_flight, file_size, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // send file size to client
+    send_all(clientfd, &file_size, sizeof(long));
+
+    // an archive this small holds no files, the client expects nothing more
+    if (file_size > 50) {
+        __atomic_add_fetch(&load->bytes_in_flight, file_size, __ATOMIC_RELAXED);
+        // stream the file to the client without buffering it in memory
+        if (send_file_range(clientfd, fd, offset, file_size) == 0) {
+            // Send completion message
+            send_all(clientfd, "Tar received\n", 12);
+        }
+        __atomic_sub_fetch(&load->bytes_in_flight, file_size, __ATOMIC_RELAXED);
+    }
+}
+
+// send a whole buffer, retrying short writes
+int send_all(int sock, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t sent = send(sock, ptr, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        __atomic_add_fetch(&metrics->bytes_sent, sent, __ATOMIC_RELAXED);
+        ptr += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// receive exactly len bytes
+int recv_all(int sock, void *buf, size_t len) {
+    char *ptr = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, ptr, len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("recv");
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// send length bytes of fd starting at offset, in constant memory
+int send_file_range(int sock, int fd, off_t offset, off_t length) {
+    char buf[SEND_CHUNK];
+
+    while (length > 0) {
+        size_t chunk = length > SENDFILE_MAX ? SENDFILE_MAX : (size_t)length;
+        ssize_t sent = sendfile(sock, fd, &offset, chunk);
+        if (sent > 0) {
+            __atomic_add_fetch(&metrics->bytes_sent, sent, __ATOMIC_RELAXED);
+            length -= sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == 0) {
+            fprintf(stderr, "sendfile: file shrank during transfer\n");
+            return -1;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            perror("sendfile");
+            return -1;
+        }
+
+        // sendfile unsupported for this pair of descriptors, copy through a small buffer
+        while (length > 0) {
+            ssize_t n = pread(fd, buf, length > SEND_CHUNK ? SEND_CHUNK : (size_t)length, offset);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                perror("pread");
+                return -1;
+            }
+            if (send_all(sock, buf, n) == -1) {
+                return -1;
+            }
+            offset += n;
+            length -= n;
+        }
+    }
+    return 0;
+}
+
+// names searched for by search_files and where they were found
+struct name_search {
+    char **file_names;
+    bool *found_files;
+    int num_files;
+    int num_found;
+};
+
+// search for list of files, each name resolves to the first file found with it
+void search_files(const char *dir_name, char *file_names[], int num_files, bool *found_files) {
+    struct name_search search = { file_names, found_files, num_files, 0 };
+    struct walk w = { .on_file = search_visit_file, .arg = &search };
+
+    for (int i = 0; i < num_files; i++) {
+        if (found_files[i]) {
+            search.num_found++;
+        }
+    }
+    walk_tree(&w, dir_name);
+}
+
+// walker callback for search_files, stops once every name is found
+int search_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb) {
+    struct name_search *search = w->arg;
+    (void)sb;
+
+    for (int i = 0; i < search->num_files; i++) {
+        if (!search->found_files[i] && strcmp(search->file_names[i], name) == 0) {
+            search->file_names[i] = strdup(path);
+            printf("%s\n", path);
+            search->found_files[i] = true;
+            search->num_found++;
+        }
+    }
+    return search->num_found == search->num_files;
+}
+
+// walk every directory below root with walk_threads threads, returns 1 if a callback stopped it
+int walk_tree(struct walk *w, const char *root) {
+    int num_threads = walk_threads;
+    pthread_t tids[num_threads];
+    struct walk_thread threads[num_threads];
+
+    w->root = root;
+    w->num_threads = num_threads;
+    w->pending = 1;
+    w->idle = 0;
+    w->stop = 0;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->deques = calloc(num_threads, sizeof(struct walk_deque));
+    if (w->deques == NULL) {
+        perror("calloc failed");
+        return -1;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&w->deques[i].lock, NULL);
+    }
+    walk_push_dir(w, 0, strdup(root));
+
+    // the calling thread walks too, so a single thread walk starts no threads
+    int started = 1;
+    for (int i = 1; i < num_threads; i++) {
+        threads[i].walk = w;
+        threads[i].self = i;
+        if (pthread_create(&tids[i], NULL, walk_thread_main, &threads[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    threads[0].walk = w;
+    threads[0].self = 0;
+    walk_thread_main(&threads[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    // a stopped walk leaves directories behind
+    for (int i = 0; i < num_threads; i++) {
+        struct walk_deque *dq = &w->deques[i];
+        for (int j = dq->head; j < dq->tail; j++) {
+            free(dq->paths[j]);
+        }
+        free(dq->paths);
+        pthread_mutex_destroy(&dq->lock);
+    }
+    free(w->deques);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    return w->stop;
+}
+
+// take directories from our own deque, steal when it is empty, until the walk is done
+void *walk_thread_main(void *arg) {
+    struct walk_thread *thread = arg;
+    struct walk *w = thread->walk;
+    struct uring ring;
+    // one ring per walker thread batches the stats of every directory it reads
+    struct uring *batch = use_uring && w->want_stat && uring_init(&ring, URING_STAT_BATCH) == 0 ? &ring : NULL;
+
+    while (!w->stop) {
+        char *path = walk_next_dir(w, thread->self);
+        if (path == NULL) {
+            pthread_mutex_lock(&w->lock);
+            if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0 || w->stop) {
+                pthread_cond_broadcast(&w->cond);
+                pthread_mutex_unlock(&w->lock);
+                break;
+            }
+            // another thread is still reading a directory that may hand us work
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            w->idle++;
+            pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+            w->idle--;
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+
+        walk_dir(w, thread->self, path, batch);
+        free(path);
+        if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&w->lock);
+            pthread_cond_broadcast(&w->cond);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    if (batch != NULL) {
+        __atomic_add_fetch(&metrics->walk_syscalls, ring.syscalls, __ATOMIC_RELAXED);
+        uring_free(batch);
+    }
+    return NULL;
+}
+
+// newest directory of our own deque, or the oldest one of another thread's
+char *walk_next_dir(struct walk *w, int self) {
+    char *path = NULL;
+    struct walk_deque *dq = &w->deques[self];
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        path = dq->paths[--dq->tail];
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    // the oldest directories are nearest the root, so a steal takes the biggest subtree
+    for (int i = 1; path == NULL && i < w->num_threads; i++) {
+        struct walk_deque *victim = &w->deques[(self + i) % w->num_threads];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail > victim->head) {
+            path = victim->paths[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return path;
+}
+
+// queue a directory on a thread's deque, pending must already count it
+void walk_push_dir(struct walk *w, int self, char *path) {
+    struct walk_deque *dq = &w->deques[self];
+
+    if (path == NULL) {
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL);
+        return;
+    }
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->capacity) {
+        if (dq->head > 0) {
+            memmove(dq->paths, dq->paths + dq->head, (dq->tail - dq->head) * sizeof(char *));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            int new_capacity = dq->capacity ? dq->capacity * 2 : 64;
+            char **paths = realloc(dq->paths, new_capacity * sizeof(char *));
+            if (paths == NULL) {
+                perror("realloc failed");
+                pthread_mutex_unlock(&dq->lock);
+                free(path);
+                __atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL);
+                return;
+            }
+            dq->paths = paths;
+            dq->capacity = new_capacity;
+        }
+    }
+    dq->paths[dq->tail++] = path;
+    pthread_mutex_unlock(&dq->lock);
+
+    if (__atomic_load_n(&w->idle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// stat a directory entry relative to its open directory, without following links
+int walk_stat(int dir_fd, const char *name, struct stat *sb) {
+    struct statx stx;
+
+    // only the fields the callbacks use, and no revalidation round trip on network filesystems
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, WALK_STATX_MASK, &stx) == -1) {
+        if (errno == ENOSYS) {
+            return fstatat(dir_fd, name, sb, AT_SYMLINK_NOFOLLOW);
+        }
+        return -1;
+    }
+    statx_to_stat(&stx, sb);
+    return 0;
+}
+
+// the fields of a statx result the walk callbacks use
+void statx_to_stat(const struct statx *stx, struct stat *sb) {
+    memset(sb, 0, sizeof(*sb));
+    sb->st_mode = stx->stx_mode;
+    sb->st_ino = stx->stx_ino;
+    sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_size = stx->stx_size;
+    sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+// kernel directory entry returned by getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// read one directory in large getdents64 batches, queueing subdirectories and reporting regular files
+void walk_dir(struct walk *w, int self, char *path, struct uring *ring) {
+    char dents[WALK_DENTS_SIZE] __attribute__((aligned(8)));
+    char child[PATH_MAX];
+    // entries waiting for a batched statx, their names point into dents
+    const char *names[URING_STAT_BATCH];
+    struct statx stx[URING_STAT_BATCH];
+    size_t path_len = strlen(path);
+    struct stat sb;
+    long n;
+    // open and close, plus every getdents64 and plain stat
+    unsigned long calls = 2;
+
+    // the root may be a symlink, as $HOME often is; links below it are not followed
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (strcmp(path, w->root) == 0 ? 0 : O_NOFOLLOW);
+    int dir_fd = open(path, flags);
+    if (dir_fd == -1) {
+        return;
+    }
+    if (w->on_dir != NULL) {
+        pthread_mutex_lock(&w->lock);
+        if (!w->stop && w->on_dir(w, path) != 0) {
+            w->stop = 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    if (path_len + 2 >= sizeof(child)) {
+        close(dir_fd);
+        return;
+    }
+    memcpy(child, path, path_len);
+    child[path_len] = '/';
+
+    while (!w->stop && (n = syscall(SYS_getdents64, dir_fd, dents, sizeof(dents))) > 0) {
+        int queued = 0;
+        calls++;
+        for (long offset = 0; offset < n && !w->stop;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + offset);
+            const char *name = d->d_name;
+            int type = d->d_type;
+            offset += d->d_reclen;
+
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (path_len + 1 + strlen(name) >= sizeof(child)) {
+                continue;
+            }
+
+            // only filesystems without d_type need a stat to tell directories apart
+            int need_stat = type == DT_UNKNOWN || (type == DT_REG && w->want_stat);
+            if (need_stat && ring != NULL && !ring->broken) {
+                struct io_uring_sqe *sqe = uring_sqe(ring);
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = dir_fd;
+                sqe->addr = (uintptr_t)name;
+                sqe->len = WALK_STATX_MASK;
+                sqe->off = (uintptr_t)&stx[queued];
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+                sqe->user_data = queued;
+                names[queued++] = name;
+                if (queued == URING_STAT_BATCH) {
+                    walk_flush_stats(w, self, ring, dir_fd, child, path_len, names, stx, queued);
+                    queued = 0;
+                }
+                continue;
+            }
+            if (need_stat) {
+                calls++;
+                if (walk_stat(dir_fd, name, &sb) == -1) {
+                    continue;
+                }
+            }
+            walk_entry(w, self, child, path_len, name, type, need_stat ? &sb : NULL);
+        }
+        // the names live in dents, so the batch goes out before the next getdents64
+        if (queued > 0) {
+            walk_flush_stats(w, self, ring, dir_fd, child, path_len, names, stx, queued);
+        }
+    }
+    close(dir_fd);
+    // a ring counts its own io_uring_enter calls and goes into the metrics with them
+    if (ring == NULL) {
+        __atomic_add_fetch(&metrics->walk_syscalls, calls, __ATOMIC_RELAXED);
+    } else {
+        ring->syscalls += calls;
+    }
+}
+
+// stat count queued entries with one io_uring_enter and report them in directory order
+void walk_flush_stats(struct walk *w, int self, struct uring *ring, int dir_fd, char *child, size_t path_len,
+                      const char **names, struct statx *stx, int count) {
+    int results[URING_STAT_BATCH];
+    struct stat sb;
+
+    for (int i = 0; i < count; i++) {
+        results[i] = -1;
+    }
+    if (uring_submit(ring, count) == 0) {
+        for (int done = 0; done < count; done++) {
+            struct io_uring_cqe *cqe = uring_wait(ring);
+            if (cqe == NULL) {
+                break;
+            }
+            results[cqe->user_data] = cqe->res;
+            uring_seen(ring);
+        }
+    }
+
+    for (int i = 0; i < count && !w->stop; i++) {
+        if (results[i] == 0) {
+            statx_to_stat(&stx[i], &sb);
+        } else if (!ring->broken || walk_stat(dir_fd, names[i], &sb) == -1) {
+            // a broken ring leaves the batch to plain statx, other errors mean the entry is gone
+            continue;
+        }
+        walk_entry(w, self, child, path_len, names[i], DT_UNKNOWN, &sb);
+    }
+}
+
+// queue a subdirectory or report a regular file, a stat decides what the entry is when there is one
+void walk_entry(struct walk *w, int self, char *child, size_t path_len, const char *name, int type, const struct stat *sb) {
+    if (sb != NULL) {
+        type = S_ISDIR(sb->st_mode) ? DT_DIR : S_ISREG(sb->st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    memcpy(child + path_len + 1, name, strlen(name) + 1);
+
+    if (type == DT_DIR) {
+        __atomic_add_fetch(&w->pending, 1, __ATOMIC_ACQ_REL);
+        walk_push_dir(w, self, strdup(child));
+    } else if (type == DT_REG) {
+        pthread_mutex_lock(&w->lock);
+        if (!w->stop && w->on_file(w, child, name, sb) != 0) {
+            w->stop = 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// set up a ring with room for entries submissions, -1 where io_uring is missing, blocked or too old
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    ring->syscalls = 1;
+    if (ring->fd == -1) {
+        return -1;
+    }
+    // direct descriptors from openat came in 5.15, CQE_SKIP (5.17) is the nearest feature bit to test
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_CQE_SKIP)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    ring->syscalls += 2;
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->rings != MAP_FAILED) {
+            munmap(ring->rings, ring->rings_size);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    char *base = ring->rings;
+    ring->entries = p.sq_entries;
+    ring->sq_head = (unsigned *)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + p.sq_off.array);
+    ring->cq_head = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    return 0;
+}
+
+// unmap and close a ring, files and buffers registered with it go too
+void uring_free(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+    ring->syscalls += 3;
+}
+
+// next free submission entry, zeroed; callers never queue more than the ring holds
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    // the kernel reads the entry only in io_uring_enter, after it is filled in
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+// hand queued entries to the kernel and wait until wait completions are ready
+int uring_submit(struct uring *ring, unsigned wait) {
+    if (ring->broken) {
+        return -1;
+    }
+    while (1) {
+        ring->syscalls++;
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                          NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= ret;
+            if (ring->to_submit == 0) {
+                return 0;
+            }
+            continue;
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            perror("io_uring_enter");
+            ring->broken = 1;
+            return -1;
+        }
+    }
+}
+
+// next completion, waiting for it if none is ready; NULL if the ring broke
+struct io_uring_cqe *uring_wait(struct uring *ring) {
+    while (1) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            return &ring->cqes[head & *ring->cq_mask];
+        }
+        if (uring_submit(ring, 1) == -1) {
+            return NULL;
+        }
+    }
+}
+
+// release the completion uring_wait returned
+void uring_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// hash a file name for the index buckets (FNV-1a)
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// build the filename index of the home directory and start keeping it current
+int index_init(const char *root) {
+    if (index_alloc() == -1) {
+        return -1;
+    }
+    return index_build(root);
+}
+
+// set up the empty index
+int index_alloc() {
+    file_index.num_buckets = INDEX_BUCKETS;
+    file_index.buckets = malloc(file_index.num_buckets * sizeof(int));
+    if (file_index.buckets == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    for (int i = 0; i < file_index.num_buckets; i++) {
+        file_index.buckets[i] = -1;
+    }
+    file_index.free_head = -1;
+
+    // forked children get a consistent copy of the index
+    pthread_atfork(index_atfork_prepare, index_atfork_parent, index_atfork_child);
+    return 0;
+}
+
+// index everything below root, from the index file where there is one, and start the threads keeping it current
+int index_build(const char *root) {
+    struct timespec start, end;
+    pthread_t tid;
+    int rescanned = 0;
+    int loaded;
+
+    file_index.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (file_index.inotify_fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_wrlock(&file_index.lock);
+    loaded = strcmp(index_path, "0") != 0 && index_load(root, &rescanned) == 0;
+    if (!loaded) {
+        index_scan_dir(root);
+    } else if (rescanned == 0) {
+        // nothing changed since the file was written, only the background check can make it worth saving again
+        file_index.saved_generation = file_index.generation;
+    }
+    // sorting once is far cheaper than one ordered insert per scanned file
+    if (column_build(&file_index.by_size, 0) == 0 && column_build(&file_index.by_mtime, 1) == 0) {
+        file_index.columns_ready = 1;
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if (loaded) {
+        printf("Loaded %d files from %s in %ld ms, rescanned %d changed directories\n", file_index.num_files,
+               index_path, elapsed, rescanned);
+    } else {
+        printf("Indexed %d files in %ld ms\n", file_index.num_files, elapsed);
+    }
+
+    if (pthread_create(&tid, NULL, index_watch_main, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    file_index.root = root;
+    file_index.ready = 1;
+
+    // a missing saver only costs the next start a full walk
+    if (strcmp(index_path, "0") != 0) {
+        if (pthread_create(&tid, NULL, index_persist_main, (void *)(long)loaded) != 0) {
+            perror("pthread_create");
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    return 0;
+}
+
+// walker callback watching one directory of the index
+int index_visit_dir(struct walk *w, const char *path) {
+    (void)w;
+    index_add_watch(path);
+    return 0;
+}
+
+// walker callback adding one file to the index
+int index_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb) {
+    (void)w;
+    (void)name;
+    index_add_file(path, sb);
+    return 0;
+}
+
+// index everything below dir, caller holds the write lock
+void index_scan_dir(const char *dir) {
+    struct walk w = { .on_dir = index_visit_dir, .on_file = index_visit_file, .want_stat = 1 };
+    walk_tree(&w, dir);
+}
+
+// watch a directory for changes and remember its path and mtime by watch descriptor, -1 when it is not watched
+int index_add_watch(const char *dir) {
+    struct stat sb;
+
+    int wd = inotify_add_watch(file_index.inotify_fd, dir,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR);
+    if (wd == -1) {
+        // usually fs.inotify.max_user_watches, the directory is still indexed but may go stale
+        if (!file_index.watch_warned) {
+            perror("inotify_add_watch");
+            file_index.watch_warned = 1;
+        }
+        return -1;
+    }
+
+    if (wd >= file_index.num_dirs) {
+        int new_size = wd * 2 + 16;
+        struct index_dir *dirs = realloc(file_index.dirs, new_size * sizeof(struct index_dir));
+        if (dirs == NULL) {
+            perror("realloc failed");
+            return -1;
+        }
+        memset(dirs + file_index.num_dirs, 0, (new_size - file_index.num_dirs) * sizeof(struct index_dir));
+        file_index.dirs = dirs;
+        file_index.num_dirs = new_size;
+    }
+    struct index_dir *d = &file_index.dirs[wd];
+    free(d->path);
+    d->path = strdup(dir);
+
+    // taken after the watch is in place and before the directory is read, so any later change shows up in one of them;
+    // timestamps come from a coarse clock, so a directory changed within the last second may change again unseen
+    memset(&d->mtime, 0, sizeof(d->mtime));
+    if (stat(dir, &sb) == 0 && sb.st_mtim.tv_sec < time(NULL) - 1) {
+        d->mtime = sb.st_mtim;
+    }
+    return wd;
+}
+
+// add or refresh a file entry, caller holds the write lock
+void index_add_file(const char *path, const struct stat *sb) {
+    const char *name = strrchr(path, '/') + 1;
+    unsigned int bucket = hash_name(name) % file_index.num_buckets;
+
+    // an existing entry for the same path is updated in place
+    for (int i = file_index.buckets[bucket]; i != -1; i = file_index.entries[i].next) {
+        struct file_entry *e = &file_index.entries[i];
+        if (strcmp(e->path, path) == 0) {
+            if (file_index.columns_ready && e->size != sb->st_size) {
+                column_remove(&file_index.by_size, e->size, i);
+                column_insert(&file_index.by_size, sb->st_size, i);
+            }
+            if (file_index.columns_ready && e->mtime != sb->st_mtime) {
+                column_remove(&file_index.by_mtime, e->mtime, i);
+                column_insert(&file_index.by_mtime, sb->st_mtime, i);
+            }
+            e->size = sb->st_size;
+            e->ctime = sb->st_ctime;
+            e->mtime = sb->st_mtime;
+            file_index.generation++;
+            return;
+        }
+    }
+    index_insert_file(path, sb);
+}
+
+// add an entry for a path that is not indexed yet, caller holds the write lock
+void index_insert_file(const char *path, const struct stat *sb) {
+    const char *name = strrchr(path, '/') + 1;
+    unsigned int bucket = hash_name(name) % file_index.num_buckets;
+    int id;
+    if (file_index.free_head != -1) {
+        id = file_index.free_head;
+        file_index.free_head = file_index.entries[id].next;
+    } else {
+        if (file_index.num_entries == file_index.capacity) {
+            int new_capacity = file_index.capacity ? file_index.capacity * 2 : 1024;
+            struct file_entry *entries = realloc(file_index.entries, new_capacity * sizeof(struct file_entry));
+            if (entries == NULL) {
+                perror("realloc failed");
+                return;
+            }
+            file_index.entries = entries;
+            file_index.capacity = new_capacity;
+        }
+        id = file_index.num_entries++;
+    }
+
+    struct file_entry *e = &file_index.entries[id];
+    e->path = strdup(path);
+    e->name = strrchr(e->path, '/') + 1;
+    e->size = sb->st_size;
+    e->ctime = sb->st_ctime;
+    e->mtime = sb->st_mtime;
+    e->in_use = 1;
+    e->next = file_index.buckets[bucket];
+    file_index.buckets[bucket] = id;
+    file_index.num_files++;
+    file_index.generation++;
+    if (file_index.columns_ready) {
+        column_insert(&file_index.by_size, e->size, id);
+        column_insert(&file_index.by_mtime, e->mtime, id);
+    }
+}
+
+// drop the entry for path if it is indexed, caller holds the write lock
+void index_remove_file(const char *path) {
+    const char *name = strrchr(path, '/') + 1;
+    unsigned int bucket = hash_name(name) % file_index.num_buckets;
+    int *link = &file_index.buckets[bucket];
+
+    while (*link != -1) {
+        int id = *link;
+        struct file_entry *e = &file_index.entries[id];
+        if (strcmp(e->path, path) == 0) {
+            *link = e->next;
+            if (file_index.columns_ready) {
+                column_remove(&file_index.by_size, e->size, id);
+                column_remove(&file_index.by_mtime, e->mtime, id);
+            }
+            free(e->path);
+            e->path = NULL;
+            e->in_use = 0;
+            e->next = file_index.free_head;
+            file_index.free_head = id;
+            file_index.num_files--;
+            file_index.generation++;
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+// drop every file and watch below a directory that was removed or moved away
+void index_remove_dir(const char *dir) {
+    size_t len = strlen(dir);
+
+    for (int i = 0; i < file_index.num_entries; i++) {
+        struct file_entry *e = &file_index.entries[i];
+        if (e->in_use && strncmp(e->path, dir, len) == 0 && e->path[len] == '/') {
+            index_remove_file(e->path);
+        }
+    }
+    for (int wd = 0; wd < file_index.num_dirs; wd++) {
+        char *path = file_index.dirs[wd].path;
+        if (path != NULL && strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == '\0')) {
+            inotify_rm_watch(file_index.inotify_fd, wd);
+            free(path);
+            file_index.dirs[wd].path = NULL;
+        }
+    }
+}
+
+// first slot of a column whose (key, id) is not below the given pair
+int column_position(const struct sorted_column *col, int64_t key, int id) {
+    int low = 0;
+    int high = col->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (col->keys[mid] < key || (col->keys[mid] == key && col->ids[mid] < id)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// insert an entry into a column, caller holds the write lock
+void column_insert(struct sorted_column *col, int64_t key, int id) {
+    if (col->count == col->capacity) {
+        int new_capacity = col->capacity ? col->capacity * 2 : 1024;
+        int64_t *keys = realloc(col->keys, new_capacity * sizeof(int64_t));
+        if (keys == NULL) {
+            perror("realloc failed");
+            return;
+        }
+        col->keys = keys;
+        int *ids = realloc(col->ids, new_capacity * sizeof(int));
+        if (ids == NULL) {
+            perror("realloc failed");
+            return;
+        }
+        col->ids = ids;
+        col->capacity = new_capacity;
+    }
+
+    int pos = column_position(col, key, id);
+    memmove(col->keys + pos + 1, col->keys + pos, (col->count - pos) * sizeof(int64_t));
+    memmove(col->ids + pos + 1, col->ids + pos, (col->count - pos) * sizeof(int));
+    col->keys[pos] = key;
+    col->ids[pos] = id;
+    col->count++;
+}
+
+// remove an entry from a column, caller holds the write lock
+void column_remove(struct sorted_column *col, int64_t key, int id) {
+    int pos = column_position(col, key, id);
+    if (pos == col->count || col->keys[pos] != key || col->ids[pos] != id) {
+        return;
+    }
+    memmove(col->keys + pos, col->keys + pos + 1, (col->count - pos - 1) * sizeof(int64_t));
+    memmove(col->ids + pos, col->ids + pos + 1, (col->count - pos - 1) * sizeof(int));
+    col->count--;
+}
+
+// (key, id) pair used while sorting a column
+struct column_pair {
+    int64_t key;
+    int id;
+};
+
+int compare_column_pairs(const void *a, const void *b) {
+    const struct column_pair *x = a;
+    const struct column_pair *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// fill a column from every indexed file, caller holds the write lock
+int column_build(struct sorted_column *col, int by_mtime) {
+    int capacity = file_index.num_files > 0 ? file_index.num_files : 1;
+    struct column_pair *pairs = malloc(capacity * sizeof(struct column_pair));
+    int count = 0;
+
+    if (pairs == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    for (int id = 0; id < file_index.num_entries; id++) {
+        struct file_entry *e = &file_index.entries[id];
+        if (e->in_use && count < capacity) {
+            pairs[count].key = by_mtime ? e->mtime : e->size;
+            pairs[count].id = id;
+            count++;
+        }
+    }
+    qsort(pairs, count, sizeof(struct column_pair), compare_column_pairs);
+
+    free(col->keys);
+    free(col->ids);
+    col->keys = malloc(capacity * sizeof(int64_t));
+    col->ids = malloc(capacity * sizeof(int));
+    if (col->keys == NULL || col->ids == NULL) {
+        perror("malloc failed");
+        free(pairs);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        col->keys[i] = pairs[i].key;
+        col->ids[i] = pairs[i].id;
+    }
+    col->count = count;
+    col->capacity = capacity;
+    free(pairs);
+    return 0;
+}
+
+// add every file whose key is within [low, high] to a selection, caller holds the read lock
+int column_select(const struct sorted_column *col, int64_t low, int64_t high, struct file_list *list) {
+    if (low > high) {
+        return 0;
+    }
+    for (int i = column_position(col, low, INT_MIN); i < col->count && col->keys[i] <= high; i++) {
+        struct file_entry *e = &file_index.entries[col->ids[i]];
+        if (file_list_add(list, e->path, e->size, e->mtime) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// apply one inotify event to the index, caller holds the write lock
+void index_apply_event(const struct inotify_event *event) {
+    char path[PATH_MAX];
+    struct stat sb;
+
+    if (event->wd < 0 || event->wd >= file_index.num_dirs || file_index.dirs[event->wd].path == NULL) {
+        return;
+    }
+    struct index_dir *dir = &file_index.dirs[event->wd];
+    if (event->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+        free(dir->path);
+        dir->path = NULL;
+        return;
+    }
+    // a saved index may miss this change, the next start reads the directory again
+    memset(&dir->mtime, 0, sizeof(dir->mtime));
+    file_index.generation++;
+    if (event->len == 0) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir->path, event->name);
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (event->mask & IN_ISDIR) {
+            index_remove_dir(path);
+        } else {
+            index_remove_file(path);
+        }
+    } else if (lstat(path, &sb) == 0) {
+        if (S_ISDIR(sb.st_mode)) {
+            if (!(event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                return;
+            }
+            // files may have appeared before the new watch was in place
+            index_scan_dir(path);
+        } else if (S_ISREG(sb.st_mode)) {
+            index_add_file(path, &sb);
+        }
+    }
+}
+
+// thread draining inotify events into the index
+void *index_watch_main(void *arg) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    (void)arg;
+
+    while (1) {
+        ssize_t len = read(file_index.inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("inotify read");
+            file_index.ready = 0;
+            return NULL;
+        }
+
+        int overflowed = 0;
+        pthread_rwlock_wrlock(&file_index.lock);
+        for (char *ptr = buf; ptr < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, the index can no longer be trusted until the tree is read again
+                fprintf(stderr, "inotify queue overflow, falling back to tree walks while the index is rebuilt\n");
+                file_index.ready = 0;
+                overflowed = 1;
+            }
+            index_apply_event(event);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+        if (overflowed) {
+            index_recover();
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+    }
+    return NULL;
+}
+
+// read the whole tree again after lost events: every directory is watched again, the files found are added
+// or refreshed and the ones no longer there dropped, caller holds the write lock
+void index_recover() {
+    struct timespec start, end;
+    struct stat sb;
+    int removed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    index_scan_dir(file_index.root);
+    for (int id = 0; id < file_index.num_entries; id++) {
+        struct file_entry *e = &file_index.entries[id];
+        if (e->in_use && (lstat(e->path, &sb) == -1 || !S_ISREG(sb.st_mode))) {
+            index_remove_file(e->path);
+            removed++;
+        }
+    }
+    // mirrors were cut off when the events were lost and get a fresh snapshot once they connect again
+    file_index.ready = 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Rebuilt the index of %d files in %ld ms, dropped %d that were gone\n", file_index.num_files,
+           (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000, removed);
+}
+
+// fill the empty index from index_path, reading again only the directories whose mtime changed since it was saved;
+// caller holds the write lock, -1 leaves the index empty for a full walk
+int index_load(const char *root, int *rescanned) {
+    char path[PATH_MAX];
+    struct stat sb;
+
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror(index_path);
+        }
+        return -1;
+    }
+    if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(struct index_file_header)) {
+        fprintf(stderr, "%s is not an index file, indexing from scratch\n", index_path);
+        close(fd);
+        return -1;
+    }
+    size_t size = sb.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if (!index_file_valid(map, size, root)) {
+        fprintf(stderr, "%s is stale or damaged, indexing from scratch\n", index_path);
+        munmap(map, size);
+        return -1;
+    }
+    madvise(map, size, MADV_WILLNEED);
+
+    const struct index_file_header *header = map;
+    const struct index_file_dir *dirs = (const void *)(header + 1);
+    const struct index_file_entry *files = (const void *)(dirs + header->num_dirs);
+    const char *strings = (const char *)(files + header->num_files);
+    uint32_t *changed = malloc((header->num_dirs + 1) * sizeof(uint32_t));
+    uint32_t num_changed = 0;
+    if (changed == NULL) {
+        perror("malloc failed");
+        munmap(map, size);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        const struct index_file_dir *d = &dirs[i];
+        const char *dir = strings + d->path;
+
+        // a directory that is gone takes its files with it, its parent's mtime changed so the parent is read again
+        // the root is followed like the walk follows it
+        if ((strcmp(dir, root) == 0 ? stat(dir, &sb) : lstat(dir, &sb)) == -1 || !S_ISDIR(sb.st_mode)) {
+            continue;
+        }
+        int wd = index_add_watch(dir);
+        if (wd == -1 || (d->mtime_sec == 0 && d->mtime_nsec == 0) ||
+            file_index.dirs[wd].mtime.tv_sec != d->mtime_sec || file_index.dirs[wd].mtime.tv_nsec != d->mtime_nsec) {
+            changed[num_changed++] = i;
+            continue;
+        }
+
+        // nothing was added, removed or renamed here, the records stand in for a stat of each file;
+        // the file holds each path once, so until the changed directories are read nothing needs looking up
+        for (uint32_t j = d->first_file; j < d->first_file + d->num_files; j++) {
+            const struct index_file_entry *f = &files[j];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, strings + f->name) >= (int)sizeof(path)) {
+                continue;
+            }
+            memset(&sb, 0, sizeof(sb));
+            sb.st_size = f->size;
+            sb.st_ctime = f->ctime;
+            sb.st_mtime = f->mtime;
+            index_insert_file(path, &sb);
+        }
+    }
+    for (uint32_t i = 0; i < num_changed; i++) {
+        index_rescan_dir(strings + dirs[changed[i]].path, map);
+    }
+    *rescanned = num_changed;
+    free(changed);
+    munmap(map, size);
+    return 0;
+}
+
+// whether a mapped index file is complete, of this version and byte order, and was saved for root
+int index_file_valid(const void *map, size_t size, const char *root) {
+    const struct index_file_header *header = map;
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != INDEX_VERSION ||
+        header->byte_order != 0x01020304) {
+        return 0;
+    }
+    uint64_t records = sizeof(*header) + (uint64_t)header->num_dirs * sizeof(struct index_file_dir) +
+                       (uint64_t)header->num_files * sizeof(struct index_file_entry);
+    if (records > size || size - records != header->strings_size || header->strings_size == 0) {
+        return 0;
+    }
+
+    // every offset has to land in the string table and the table has to end in a terminator
+    const struct index_file_dir *dirs = (const void *)(header + 1);
+    const struct index_file_entry *files = (const void *)(dirs + header->num_dirs);
+    const char *strings = (const char *)map + records;
+    if (strings[header->strings_size - 1] != '\0' || header->root >= header->strings_size ||
+        strcmp(strings + header->root, root) != 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->num_files; i++) {
+        if (files[i].name >= header->strings_size) {
+            return 0;
+        }
+    }
+    // strictly sorted directories, and names within each, mean no path is loaded twice
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        const struct index_file_dir *d = &dirs[i];
+        if (d->path >= header->strings_size || (uint64_t)d->first_file + d->num_files > header->num_files ||
+            (i > 0 && strcmp(strings + dirs[i - 1].path, strings + d->path) >= 0)) {
+            return 0;
+        }
+        for (uint32_t j = d->first_file + 1; j < d->first_file + d->num_files; j++) {
+            if (strcmp(strings + files[j - 1].name, strings + files[j].name) >= 0) {
+                return 0;
+            }
+        }
+    }
+    return index_file_find_dir(map, root) != -1;
+}
+
+// record number of a directory in a valid index file, -1 when it has none
+long index_file_find_dir(const void *map, const char *path) {
+    const struct index_file_header *header = map;
+    const struct index_file_dir *dirs = (const void *)(header + 1);
+    const char *strings = (const char *)((const struct index_file_entry *)(dirs + header->num_dirs) + header->num_files);
+    long low = 0;
+    long high = header->num_dirs;
+
+    while (low < high) {
+        long mid = low + (high - low) / 2;
+        int cmp = strcmp(strings + dirs[mid].path, path);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+// read a changed directory again, subdirectories the index file knows have records of their own,
+// caller holds the write lock
+void index_rescan_dir(const char *dir, const void *map) {
+    char path[PATH_MAX];
+    struct stat sb;
+    struct dirent *entry;
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path) ||
+            walk_stat(dirfd(d), entry->d_name, &sb) == -1) {
+            continue;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            index_add_file(path, &sb);
+        } else if (S_ISDIR(sb.st_mode) && index_file_find_dir(map, path) == -1) {
+            index_scan_dir(path);
+        }
+    }
+    closedir(d);
+}
+
+// a directory of the index being saved, the path of one only known from its files is not terminated
+struct saved_dir {
+    const char *path;
+    size_t len;
+    struct timespec mtime;
+    uint32_t first_file;
+    uint32_t num_files;
+};
+
+// order entry ids by directory and then by name, so each directory's files are one run in path order
+int compare_saved_files(const void *a, const void *b) {
+    const struct file_entry *x = &file_index.entries[*(const int *)a];
+    const struct file_entry *y = &file_index.entries[*(const int *)b];
+    size_t x_len = x->name - x->path - 1;
+    size_t y_len = y->name - y->path - 1;
+    int cmp = memcmp(x->path, y->path, x_len < y_len ? x_len : y_len);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (x_len != y_len) {
+        return x_len < y_len ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// the same order as strcmp, for paths that are not terminated
+int compare_saved_dirs(const void *a, const void *b) {
+    const struct saved_dir *x = a;
+    const struct saved_dir *y = b;
+    int cmp = memcmp(x->path, y->path, x->len < y->len ? x->len : y->len);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+// save the index to index_path through a temporary file and a rename, 0 when it is saved or nothing changed
+int index_save() {
+    char tmp[PATH_MAX];
+    int ret = -1;
+    FILE *out = NULL;
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    unsigned long generation = file_index.generation;
+    // after lost events the index is not worth keeping
+    if (generation == file_index.saved_generation || !file_index.ready) {
+        pthread_rwlock_unlock(&file_index.lock);
+        return 0;
+    }
+
+    int *ids = malloc((file_index.num_files + 1) * sizeof(int));
+    struct saved_dir *watched = malloc((file_index.num_dirs + 1) * sizeof(struct saved_dir));
+    // each file's directory is watched or made up from its path, so there are never more records than this
+    struct saved_dir *dirs = malloc((file_index.num_dirs + file_index.num_files + 1) * sizeof(struct saved_dir));
+    snprintf(tmp, sizeof(tmp), "%s.%d", index_path, (int)getpid());
+    if (ids == NULL || watched == NULL || dirs == NULL) {
+        perror("malloc failed");
+    } else if ((out = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+    } else {
+        int num_ids = 0;
+        int num_watched = 0;
+        int num_dirs = 0;
+
+        for (int id = 0; id < file_index.num_entries; id++) {
+            if (file_index.entries[id].in_use) {
+                ids[num_ids++] = id;
+            }
+        }
+        qsort(ids, num_ids, sizeof(int), compare_saved_files);
+        for (int wd = 0; wd < file_index.num_dirs; wd++) {
+            struct index_dir *d = &file_index.dirs[wd];
+            if (d->path != NULL) {
+                watched[num_watched++] = (struct saved_dir){ d->path, strlen(d->path), d->mtime, 0, 0 };
+            }
+        }
+        qsort(watched, num_watched, sizeof(struct saved_dir), compare_saved_dirs);
+
+        // merge both into one record per directory, a directory without a watch gets mtime 0 and is always read again
+        int w = 0;
+        for (int i = 0; i < num_ids; ) {
+            const struct file_entry *e = &file_index.entries[ids[i]];
+            struct saved_dir group = { e->path, e->name - e->path - 1, { 0, 0 }, i, 0 };
+            for (; i < num_ids; i++, group.num_files++) {
+                const struct file_entry *f = &file_index.entries[ids[i]];
+                if ((size_t)(f->name - f->path - 1) != group.len || memcmp(f->path, group.path, group.len) != 0) {
+                    break;
+                }
+            }
+            for (; w < num_watched && compare_saved_dirs(&watched[w], &group) < 0; w++) {
+                if (num_dirs == 0 || compare_saved_dirs(&dirs[num_dirs - 1], &watched[w]) != 0) {
+                    dirs[num_dirs++] = watched[w];
+                }
+            }
+            for (int seen = 0; w < num_watched && compare_saved_dirs(&watched[w], &group) == 0; w++, seen++) {
+                // a directory replaced under the same path is briefly watched twice, trust neither
+                group.mtime = seen == 0 ? watched[w].mtime : (struct timespec){ 0, 0 };
+            }
+            dirs[num_dirs++] = group;
+        }
+        for (; w < num_watched; w++) {
+            if (num_dirs == 0 || compare_saved_dirs(&dirs[num_dirs - 1], &watched[w]) != 0) {
+                dirs[num_dirs++] = watched[w];
+            }
+        }
+        ret = index_write(out, file_index.root, dirs, num_dirs, ids, num_ids);
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+
+    // the records are in our buffer, the disk can be slow without holding up the index
+    if (out != NULL && (fflush(out) != 0 || fsync(fileno(out)) == -1)) {
+        ret = -1;
+    }
+    if (out != NULL && fclose(out) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp, index_path) == -1) {
+        perror(index_path);
+        ret = -1;
+    }
+    if (ret == 0) {
+        file_index.saved_generation = generation;
+    } else if (out != NULL) {
+        unlink(tmp);
+    }
+    free(ids);
+    free(watched);
+    free(dirs);
+    return ret;
+}
+
+// write the header, the records and the string table of a collected index, the string table starts with root
+int index_write(FILE *out, const char *root, const struct saved_dir *dirs, int num_dirs, const int *ids, int num_ids) {
+    struct index_file_header header;
+    uint64_t offset = strlen(root) + 1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.byte_order = 0x01020304;
+    header.num_dirs = num_dirs;
+    header.num_files = num_ids;
+    header.root = 0;
+    header.strings_size = offset;
+    for (int i = 0; i < num_dirs; i++) {
+        header.strings_size += dirs[i].len + 1;
+    }
+    for (int i = 0; i < num_ids; i++) {
+        header.strings_size += strlen(file_index.entries[ids[i]].name) + 1;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (int i = 0; i < num_dirs; i++) {
+        struct index_file_dir d = { offset, dirs[i].first_file, dirs[i].num_files, dirs[i].mtime.tv_sec,
+                                    dirs[i].mtime.tv_nsec };
+        fwrite(&d, sizeof(d), 1, out);
+        offset += dirs[i].len + 1;
+    }
+    for (int i = 0; i < num_ids; i++) {
+        const struct file_entry *e = &file_index.entries[ids[i]];
+        struct index_file_entry f = { offset, e->size, e->ctime, e->mtime };
+        fwrite(&f, sizeof(f), 1, out);
+        offset += strlen(e->name) + 1;
+    }
+
+    fwrite(root, strlen(root) + 1, 1, out);
+    for (int i = 0; i < num_dirs; i++) {
+        fwrite(dirs[i].path, dirs[i].len, 1, out);
+        fputc('\0', out);
+    }
+    for (int i = 0; i < num_ids; i++) {
+        const char *name = file_index.entries[ids[i]].name;
+        fwrite(name, strlen(name) + 1, 1, out);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+// stat every loaded file once, an edit in place while the server was down leaves the directory mtime alone
+void index_verify() {
+    char path[PATH_MAX];
+    struct stat sb;
+    int changed = 0;
+
+    for (int id = 0; ; id++) {
+        off_t size = 0;
+        time_t ctime = 0, mtime = 0;
+        int in_use = 0;
+
+        pthread_rwlock_rdlock(&file_index.lock);
+        if (id >= file_index.num_entries) {
+            pthread_rwlock_unlock(&file_index.lock);
+            break;
+        }
+        struct file_entry *e = &file_index.entries[id];
+        if (e->in_use) {
+            in_use = 1;
+            snprintf(path, sizeof(path), "%s", e->path);
+            size = e->size;
+            ctime = e->ctime;
+            mtime = e->mtime;
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+
+        if (!in_use || (lstat(path, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size == size &&
+                        sb.st_ctime == ctime && sb.st_mtime == mtime)) {
+            continue;
+        }
+        // look again under the lock, an inotify update in between must not be undone with an older stat
+        pthread_rwlock_wrlock(&file_index.lock);
+        if (lstat(path, &sb) == 0 && S_ISREG(sb.st_mode)) {
+            index_add_file(path, &sb);
+        } else {
+            index_remove_file(path);
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+        changed++;
+    }
+    printf("Checked the loaded index, %d files had changed\n", changed);
+}
+
+// check a loaded index against the tree once, then save the index every so often while it changes
+void *index_persist_main(void *arg) {
+    if ((long)arg) {
+        index_verify();
+    }
+    // every shard indexes the same tree, shard 0 keeps the file up to date for all of them
+    while (shard == 0) {
+        index_save();
+        sleep(INDEX_SAVE_INTERVAL);
+    }
+    return NULL;
+}
+
+// answer findfile from the index, plain names are hash lookups and globs check every name
+void index_find_files(struct find_result *found) {
+    const struct name_matcher *m = found->matcher;
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    if (m->num_globs == 0) {
+        for (int p = 0; p < m->num_patterns; p++) {
+            const char *name = m->patterns[p];
+            int repeated = 0;
+            for (int q = 0; q < p; q++) {
+                repeated |= strcmp(m->patterns[q], name) == 0;
+            }
+            if (repeated) {
+                continue;
+            }
+            unsigned int bucket = hash_name(name) % file_index.num_buckets;
+            for (int i = file_index.buckets[bucket]; i != -1; i = file_index.entries[i].next) {
+                struct file_entry *e = &file_index.entries[i];
+                if (strcmp(e->name, name) == 0) {
+                    find_result_add(found, e->path, e->size, e->ctime);
+                }
+            }
+        }
+    } else {
+        for (int i = 0; i < file_index.num_entries; i++) {
+            struct file_entry *e = &file_index.entries[i];
+            if (e->in_use && matcher_match(m, e->name)) {
+                find_result_add(found, e->path, e->size, e->ctime);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+}
+
+void index_atfork_prepare() {
+    pthread_rwlock_wrlock(&file_index.lock);
+}
+
+void index_atfork_parent() {
+    pthread_rwlock_unlock(&file_index.lock);
+}
+
+// the child has no index thread, start it with a fresh lock
+void index_atfork_child() {
+    pthread_rwlock_init(&file_index.lock, NULL);
+}
+
+// load the index from the primary on host:port's host in the background, walking ourselves only if it has none to give
+int start_replica(const char *primary) {
+    pthread_t tid;
+
+    const char *colon = strrchr(primary, ':');
+    char *host = colon != NULL ? strndup(primary, colon - primary) : NULL;
+    if (host == NULL || index_alloc() == -1) {
+        free(host);
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, replica_main, host) != 0) {
+        perror("pthread_create");
+        free(host);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// follow the primary's index, reconnecting when it goes away
+void *replica_main(void *arg) {
+    const char *host = arg;
+    int replicated = 0;
+    int attempts = 0;
+
+    home_dir = getenv("HOME");
+    while (1) {
+        int fd = replica_connect(host);
+        if (fd != -1) {
+            attempts = 0;
+            replica_receive(fd, &replicated);
+            close(fd);
+            if (file_index.ready) {
+                fprintf(stderr, "lost the primary's index, findfile will walk the tree until it is back\n");
+            }
+            file_index.ready = 0;
+        }
+        // a primary that never sent an index may not have one, build our own then
+        if (!replicated && ++attempts >= REPLICATION_ATTEMPTS) {
+            fprintf(stderr, "no index from the primary, indexing on our own\n");
+            pthread_rwlock_wrlock(&file_index.lock);
+            index_clear();
+            pthread_rwlock_unlock(&file_index.lock);
+            if (index_build(home_dir) == -1) {
+                fprintf(stderr, "file index unavailable, findfile will walk the tree\n");
+            }
+            return NULL;
+        }
+        sleep(REPLICATION_RETRY);
+    }
+    return NULL;
+}
+
+// connect to the primary's replication port
+int replica_connect(const char *host) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, replication_port, &hints, &res) != 0) {
+        return -1;
+    }
+    for (p = res; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// apply the primary's snapshot and changes until the connection ends, replicated is set once a snapshot is complete
+void replica_receive(int fd, int *replicated) {
+    struct timespec start, end;
+    char path[PATH_MAX];
+    unsigned char field[24];
+    struct stat sb;
+    int op;
+
+    FILE *in = fdopen(dup(fd), "r");
+    if (in == NULL) {
+        perror("fdopen");
+        return;
+    }
+    memset(&sb, 0, sizeof(sb));
+    // a READY without a snapshot before it reports the time since the connection was made
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((op = fgetc(in)) != EOF) {
+        if (op == REPLICA_KEEPALIVE) {
+            continue;
+        }
+        if (op != REPLICA_SNAPSHOT && op != REPLICA_ADD && op != REPLICA_REMOVE) {
+            if (op != REPLICA_READY) {
+                fprintf(stderr, "bad record %d from the primary\n", op);
+                break;
+            }
+            pthread_rwlock_wrlock(&file_index.lock);
+            // sorting once is far cheaper than one ordered insert per received file
+            if (column_build(&file_index.by_size, 0) == 0 && column_build(&file_index.by_mtime, 1) == 0) {
+                file_index.columns_ready = 1;
+            }
+            file_index.root = home_dir;
+            file_index.ready = 1;
+            pthread_rwlock_unlock(&file_index.lock);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            printf("Replicated %d files in %ld ms\n", file_index.num_files,
+                   (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+            *replicated = 1;
+            continue;
+        }
+
+        // every other record starts with a path, the root for a snapshot
+        if (fread(field, 1, 2, in) != 2) {
+            break;
+        }
+        size_t len = get_be(field, 2);
+        if (len >= sizeof(path) || fread(path, 1, len, in) != len) {
+            break;
+        }
+        path[len] = '\0';
+        if (path[0] != '/') {
+            break;
+        }
+
+        if (op == REPLICA_SNAPSHOT) {
+            // the paths are only valid if both of us serve the same tree
+            if (strcmp(path, home_dir) != 0) {
+                fprintf(stderr, "primary indexes %s, not %s\n", path, home_dir);
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pthread_rwlock_wrlock(&file_index.lock);
+            file_index.ready = 0;
+            index_clear();
+            pthread_rwlock_unlock(&file_index.lock);
+        } else if (op == REPLICA_ADD) {
+            if (fread(field, 1, 24, in) != 24) {
+                break;
+            }
+            sb.st_size = get_be(field, 8);
+            sb.st_ctime = get_be(field + 8, 8);
+            sb.st_mtime = get_be(field + 16, 8);
+            pthread_rwlock_wrlock(&file_index.lock);
+            index_add_file(path, &sb);
+            pthread_rwlock_unlock(&file_index.lock);
+        } else {
+            pthread_rwlock_wrlock(&file_index.lock);
+            index_remove_file(path);
+            pthread_rwlock_unlock(&file_index.lock);
+        }
+    }
+    fclose(in);
+}
+
+// drop every file from the index, caller holds the write lock
+void index_clear() {
+    for (int i = 0; i < file_index.num_entries; i++) {
+        free(file_index.entries[i].path);
+        file_index.entries[i].path = NULL;
+    }
+    file_index.num_entries = 0;
+    file_index.num_files = 0;
+    file_index.free_head = -1;
+    for (int i = 0; i < file_index.num_buckets; i++) {
+        file_index.buckets[i] = -1;
+    }
+    file_index.columns_ready = 0;
+    file_index.by_size.count = 0;
+    file_index.by_mtime.count = 0;
+}
+
+// parse the file selection of an archive command into a query
+int parse_file_query(struct file_query *query) {
+    memset(query, 0, sizeof(*query));
+
+    if (strncmp(argv[0], "sgetfiles", 9) == 0) {
+        if (argc < 3) {
+            return -1;
+        }
+        query->type = QUERY_SIZE;
+        query->min_size = atol(argv[1]);
+        query->max_size = atol(argv[2]);
+    } else if (strncmp(argv[0], "dgetfiles", 9) == 0) {
+        if (argc < 3 || parse_date(argv[1], &query->after) == -1 || parse_date(argv[2], &query->until) == -1) {
+            return -1;
+        }
+        query->type = QUERY_DATE;
+    } else if (strcmp(argv[0], "gettargz") == 0) {
+        char *file_types[MAX_FILE_TYPES];
+        int num_types = get_file_types(argv, argc, file_types);
+        query->type = QUERY_TYPES;
+        for (int i = 0; i < num_types; i++) {
+            if (strcmp(file_types[i], "-u") != 0) {
+                query->types[query->num_types++] = file_types[i];
+            }
+        }
+        if (query->num_types == 0) {
+            return -1;
+        }
+    } else {
+        query->type = QUERY_NAMES;
+        for (int i = 1; i < argc && query->num_names < MAX_QUERY_NAMES; i++) {
+            if (strcmp(argv[i], "-u") != 0) {
+                query->names[query->num_names++] = argv[i];
+            }
+        }
+        if (query->num_names == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// parse a YYYY-MM-DD date as local midnight, the way find -newermt does
+int parse_date(const char *date, time_t *result) {
+    struct tm tm = {0};
+    char *end = strptime(date, "%Y-%m-%d", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    *result = mktime(&tm);
+    return 0;
+}
+
+// check one file against a size, date or type query
+int query_match(const struct file_query *query, const char *name, off_t size, time_t mtime) {
+    switch (query->type) {
+    case QUERY_SIZE:
+        // same bounds as find -size +Xc -size -Yc
+        return size > query->min_size && size < query->max_size;
+    case QUERY_DATE:
+        // same bounds as find -newermt A ! -newermt B
+        return mtime > query->after && mtime <= query->until;
+    case QUERY_TYPES: {
+        size_t len = strlen(name);
+        for (int i = 0; i < query->num_types; i++) {
+            size_t type_len = strlen(query->types[i]);
+            if (len > type_len && name[len - type_len - 1] == '.' &&
+                strcmp(name + len - type_len, query->types[i]) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    }
+    return 0;
+}
+
+// append one file to a selection
+int file_list_add(struct file_list *list, const char *path, off_t size, time_t mtime) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        struct file_item *items = realloc(list->items, new_capacity * sizeof(struct file_item));
+        if (items == NULL) {
+            perror("realloc failed");
+            return -1;
+        }
+        list->items = items;
+        list->capacity = new_capacity;
+    }
+    list->items[list->count].path = strdup(path);
+    list->items[list->count].size = size;
+    list->items[list->count].mtime = mtime;
+    list->count++;
+    return 0;
+}
+
+void file_list_free(struct file_list *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// query and selection of a walk that replaces the index
+struct select_walk {
+    const struct file_query *query;
+    struct file_list *list;
+};
+
+// walker callback collecting matches when the index is not available
+int select_visit_file(struct walk *w, const char *path, const char *name, const struct stat *sb) {
+    struct select_walk *select = w->arg;
+
+    if (query_match(select->query, name, sb->st_size, sb->st_mtime)) {
+        file_list_add(select->list, path, sb->st_size, sb->st_mtime);
+    }
+    return 0;
+}
+
+// collect the files an archive command asks for
+int select_files(const struct file_query *query, struct file_list *list) {
+    if (query->type == QUERY_NAMES) {
+        // getfiles sends the first file found under each name
+        for (int i = 0; i < query->num_names; i++) {
+            const char *name = query->names[i];
+            if (file_index.ready) {
+                unsigned int bucket = hash_name(name) % file_index.num_buckets;
+                pthread_rwlock_rdlock(&file_index.lock);
+                for (int id = file_index.buckets[bucket]; id != -1; id = file_index.entries[id].next) {
+                    struct file_entry *e = &file_index.entries[id];
+                    if (strcmp(e->name, name) == 0) {
+                        file_list_add(list, e->path, e->size, e->mtime);
+                        break;
+                    }
+                }
+                pthread_rwlock_unlock(&file_index.lock);
+            } else {
+                char *file_names[1] = { (char *)name };
+                bool found_files[1] = { false };
+                struct stat sb;
+                search_files(home_dir, file_names, 1, found_files);
+                if (found_files[0] && stat(file_names[0], &sb) == 0) {
+                    file_list_add(list, file_names[0], sb.st_size, sb.st_mtime);
+                }
+                if (found_files[0]) {
+                    free(file_names[0]);
+                }
+            }
+        }
+        return 0;
+    }
+
+    // size and date ranges come straight out of the sorted columns
+    if (file_index.ready && file_index.columns_ready && query->type != QUERY_TYPES) {
+        int ret;
+        pthread_rwlock_rdlock(&file_index.lock);
+        if (query->type == QUERY_SIZE) {
+            // same bounds as find -size +Xc -size -Yc
+            ret = column_select(&file_index.by_size,
+                                query->min_size < INT64_MAX ? (int64_t)query->min_size + 1 : INT64_MAX,
+                                query->max_size > INT64_MIN ? (int64_t)query->max_size - 1 : INT64_MIN, list);
+        } else {
+            // same bounds as find -newermt A ! -newermt B
+            ret = column_select(&file_index.by_mtime,
+                                query->after < INT64_MAX ? (int64_t)query->after + 1 : INT64_MAX,
+                                query->until, list);
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+        return ret;
+    }
+
+    if (file_index.ready) {
+        pthread_rwlock_rdlock(&file_index.lock);
+        for (int id = 0; id < file_index.num_entries; id++) {
+            struct file_entry *e = &file_index.entries[id];
+            if (e->in_use && query_match(query, e->name, e->size, e->mtime)) {
+                file_list_add(list, e->path, e->size, e->mtime);
+            }
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+        return 0;
+    }
+
+    struct select_walk select = { query, list };
+    struct walk w = { .on_file = select_visit_file, .arg = &select, .want_stat = 1 };
+    return walk_tree(&w, home_dir) == -1 ? -1 : 0;
+}
+
+// write all of buf to fd
+int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, ptr, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// load the optional codec libraries
+void codecs_init() {
+    void *zstd = dlopen("libzstd.so.1", RTLD_NOW);
+    void *lz4 = dlopen("liblz4.so.1", RTLD_NOW);
+
+    if (zstd != NULL) {
+        codec_api.zstd_create = dlsym(zstd, "ZSTD_createCCtx");
+        codec_api.zstd_free = dlsym(zstd, "ZSTD_freeCCtx");
+        codec_api.zstd_set_parameter = dlsym(zstd, "ZSTD_CCtx_setParameter");
+        codec_api.zstd_compress = dlsym(zstd, "ZSTD_compressStream2");
+        codec_api.zstd_is_error = dlsym(zstd, "ZSTD_isError");
+        codec_api.zstd_min_level = dlsym(zstd, "ZSTD_minCLevel");
+        codecs[CODEC_ZSTD].available = codec_api.zstd_create != NULL && codec_api.zstd_free != NULL &&
+            codec_api.zstd_set_parameter != NULL && codec_api.zstd_compress != NULL &&
+            codec_api.zstd_is_error != NULL && codec_api.zstd_min_level != NULL;
+    }
+    if (lz4 != NULL) {
+        codec_api.lz4_create = dlsym(lz4, "LZ4F_createCompressionContext");
+        codec_api.lz4_free = dlsym(lz4, "LZ4F_freeCompressionContext");
+        codec_api.lz4_begin = dlsym(lz4, "LZ4F_compressBegin");
+        codec_api.lz4_bound = dlsym(lz4, "LZ4F_compressBound");
+        codec_api.lz4_update = dlsym(lz4, "LZ4F_compressUpdate");
+        codec_api.lz4_end = dlsym(lz4, "LZ4F_compressEnd");
+        codec_api.lz4_is_error = dlsym(lz4, "LZ4F_isError");
+        codecs[CODEC_LZ4].available = codec_api.lz4_create != NULL && codec_api.lz4_free != NULL &&
+            codec_api.lz4_begin != NULL && codec_api.lz4_bound != NULL && codec_api.lz4_update != NULL &&
+            codec_api.lz4_end != NULL && codec_api.lz4_is_error != NULL;
+    }
+    printf("Archive codecs:");
+    for (int i = 0; i < NUM_CODECS; i++) {
+        if (codecs[i].available) {
+            printf(" %s", codecs[i].name);
+        }
+    }
+    printf("\n");
+}
+
+// index of the codec called name, -1 if there is none
+int codec_by_name(const char *name) {
+    for (int i = 0; i < NUM_CODECS; i++) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// start a compressed tar stream written to fd, level 0 is the codec's default
+int archive_open(struct archive *ar, int fd, int codec, int level) {
+    memset(ar, 0, sizeof(*ar));
+    ar->fd = fd;
+    ar->codec = codec;
+    ar->level = level != 0 ? level : codecs[codec].default_level;
+
+    if (codec == CODEC_STORE) {
+        return 0;
+    }
+    if (codec == CODEC_ZSTD) {
+        return zstd_open(ar);
+    }
+    if (codec == CODEC_LZ4) {
+        return lz4_open(ar);
+    }
+
+    if (compress_threads > 1) {
+        // blocks are deflated on the compression pool, see pgz_submit()
+        static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        ar->parallel = 1;
+        ar->crc = crc32(0L, Z_NULL, 0);
+        ar->block = malloc(PGZ_BLOCK);
+        if (ar->block == NULL) {
+            perror("malloc failed");
+            return -1;
+        }
+        pthread_mutex_init(&ar->lock, NULL);
+        pthread_cond_init(&ar->job_done, NULL);
+        if (pgz_pool_start() == -1 || write_all(fd, gzip_header, sizeof(gzip_header)) == -1) {
+            archive_abort(ar);
+            return -1;
+        }
+        return 0;
+    }
+
+    // windowBits 15 + 16 selects the gzip wrapper
+    if (deflateInit2(&ar->zs, ar->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// zstd stream with a content checksum, -z threads also compress each zstd archive
+int zstd_open(struct archive *ar) {
+    ar->zstd = codec_api.zstd_create();
+    if (ar->zstd == NULL) {
+        fprintf(stderr, "ZSTD_createCCtx failed\n");
+        return -1;
+    }
+    if (codec_api.zstd_is_error(codec_api.zstd_set_parameter(ar->zstd, ZSTD_LEVEL_PARAM, ar->level)) ||
+        codec_api.zstd_is_error(codec_api.zstd_set_parameter(ar->zstd, ZSTD_CHECKSUM_PARAM, 1))) {
+        fprintf(stderr, "zstd parameters rejected\n");
+        archive_abort(ar);
+        return -1;
+    }
+    // a library built without threads refuses workers and compresses on this thread
+    if (compress_threads > 1) {
+        codec_api.zstd_set_parameter(ar->zstd, ZSTD_WORKERS_PARAM, compress_threads);
+    }
+    return 0;
+}
+
+// lz4 frame, its output buffer holds whatever one ARCHIVE_CHUNK of input can become
+int lz4_open(struct archive *ar) {
+    ar->lz4_prefs.level = ar->level;
+    ar->lz4_prefs.content_checksum = 1;
+    if (codec_api.lz4_is_error(codec_api.lz4_create(&ar->lz4, LZ4F_API_VERSION))) {
+        fprintf(stderr, "LZ4F_createCompressionContext failed\n");
+        ar->lz4 = NULL;
+        return -1;
+    }
+    ar->lz4_out_cap = codec_api.lz4_bound(ARCHIVE_CHUNK, &ar->lz4_prefs);
+    ar->lz4_out = malloc(ar->lz4_out_cap);
+    if (ar->lz4_out == NULL) {
+        perror("malloc failed");
+        archive_abort(ar);
+        return -1;
+    }
+    size_t n = codec_api.lz4_begin(ar->lz4, ar->lz4_out, ar->lz4_out_cap, &ar->lz4_prefs);
+    if (codec_api.lz4_is_error(n) || write_all(ar->fd, ar->lz4_out, n) == -1) {
+        fprintf(stderr, "lz4 frame header failed\n");
+        archive_abort(ar);
+        return -1;
+    }
+    return 0;
+}
+
+// compress len bytes of tar data into the output file
+int archive_write(struct archive *ar, const void *data, size_t len, int flush) {
+    if (ar->codec != CODEC_GZIP) {
+        return codec_write(ar, data, len, flush);
+    }
+    if (ar->parallel) {
+        return pgz_write(ar, data, len, flush);
+    }
+
+    ar->zs.next_in = (unsigned char *)data;
+    ar->zs.avail_in = len;
+    do {
+        ar->zs.next_out = ar->out;
+        ar->zs.avail_out = sizeof(ar->out);
+        int ret = deflate(&ar->zs, flush);
+        if (ret == Z_STREAM_ERROR) {
+            fprintf(stderr, "deflate failed\n");
+            return -1;
+        }
+        size_t have = sizeof(ar->out) - ar->zs.avail_out;
+        if (have > 0 && write_all(ar->fd, ar->out, have) == -1) {
+            perror("write");
+            return -1;
+        }
+    } while (ar->zs.avail_out == 0 || (flush == Z_FINISH && ar->zs.avail_in > 0));
+    ar->tar_bytes += len;
+    return 0;
+}
+
+// archive_write for the store, zstd and lz4 codecs, Z_FINISH ends the stream
+int codec_write(struct archive *ar, const void *data, size_t len, int flush) {
+    const unsigned char *ptr = data;
+
+    if (ar->codec == CODEC_STORE) {
+        if (write_all(ar->fd, data, len) == -1) {
+            perror("write");
+            return -1;
+        }
+        ar->tar_bytes += len;
+        return 0;
+    }
+
+    if (ar->codec == CODEC_ZSTD) {
+        struct zstd_buffer in = { (void *)data, len, 0 };
+        int end = flush == Z_FINISH ? ZSTD_END : ZSTD_CONTINUE;
+        size_t left;
+        do {
+            struct zstd_buffer out = { ar->out, sizeof(ar->out), 0 };
+            left = codec_api.zstd_compress(ar->zstd, &out, &in, end);
+            if (codec_api.zstd_is_error(left)) {
+                fprintf(stderr, "zstd compression failed\n");
+                return -1;
+            }
+            if (out.pos > 0 && write_all(ar->fd, ar->out, out.pos) == -1) {
+                perror("write");
+                return -1;
+            }
+        } while (in.pos < in.size || (end == ZSTD_END && left != 0));
+        ar->tar_bytes += len;
+        return 0;
+    }
+
+    // lz4 stores blocks that do not shrink by itself, so it never needs passthrough
+    ar->tar_bytes += len;
+    while (len > 0) {
+        size_t piece = len < ARCHIVE_CHUNK ? len : ARCHIVE_CHUNK;
+        size_t n = codec_api.lz4_update(ar->lz4, ar->lz4_out, ar->lz4_out_cap, ptr, piece, NULL);
+        if (codec_api.lz4_is_error(n) || write_all(ar->fd, ar->lz4_out, n) == -1) {
+            fprintf(stderr, "lz4 compression failed\n");
+            return -1;
+        }
+        ptr += piece;
+        len -= piece;
+    }
+    if (flush == Z_FINISH) {
+        size_t n = codec_api.lz4_end(ar->lz4, ar->lz4_out, ar->lz4_out_cap, NULL);
+        if (codec_api.lz4_is_error(n) || write_all(ar->fd, ar->lz4_out, n) == -1) {
+            fprintf(stderr, "lz4 frame end failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// switch between storing members that will not compress and compressing the rest
+int archive_passthrough(struct archive *ar, int stored) {
+    if (stored == ar->stored || ar->codec == CODEC_STORE || ar->codec == CODEC_LZ4) {
+        return 0;
+    }
+
+    if (ar->codec == CODEC_ZSTD) {
+        // the level is fixed per frame, so end this one; frames simply concatenate
+        if (codec_write(ar, NULL, 0, Z_FINISH) == -1) {
+            return -1;
+        }
+        ar->stored = stored;
+        int level = stored ? codec_api.zstd_min_level() : ar->level;
+        codec_api.zstd_set_parameter(ar->zstd, ZSTD_LEVEL_PARAM, level);
+        return 0;
+    }
+
+    if (ar->parallel) {
+        // the pool picks the level per block from ar->stored, so what is buffered is submitted before it flips
+        if (ar->block_len > 0 && pgz_submit(ar, 0) == -1) {
+            return -1;
+        }
+        ar->stored = stored;
+        return 0;
+    }
+
+    // deflate what is pending at the old level, level 0 then copies input into stored blocks
+    if (archive_write(ar, NULL, 0, Z_BLOCK) == -1) {
+        return -1;
+    }
+    ar->stored = stored;
+    ar->zs.next_out = ar->out;
+    ar->zs.avail_out = sizeof(ar->out);
+    int ret = deflateParams(&ar->zs, stored ? 0 : ar->level, Z_DEFAULT_STRATEGY);
+    size_t have = sizeof(ar->out) - ar->zs.avail_out;
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || (have > 0 && write_all(ar->fd, ar->out, have) == -1)) {
+        fprintf(stderr, "deflateParams failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// whether a member is worth compressing: known compressed formats are not, others by a sample
+int member_compressible(const char *path, const unsigned char *data, size_t len) {
+    static const char *compressed[] = {
+        ".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".zip", ".7z", ".rar", ".jar",
+        ".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".mov", ".avi", ".webm", ".ogg", ".flac",
+    };
+    unsigned char out[PASSTHROUGH_SAMPLE];
+
+    const char *ext = strrchr(path, '.');
+    if (ext != NULL && strchr(ext, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(compressed) / sizeof(compressed[0]); i++) {
+            if (strcasecmp(ext, compressed[i]) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    // a sample that the fastest deflate cannot shrink by 5% is taken as noise
+    if (len > PASSTHROUGH_SAMPLE) {
+        len = PASSTHROUGH_SAMPLE;
+    }
+    uLongf out_len = len - len / 20;
+    return compress2(out, &out_len, data, len, Z_BEST_SPEED) == Z_OK;
+}
+
+// store an octal number in a tar header field, base-256 if it does not fit
+void tar_number(char *field, int width, unsigned long long value) {
+    if (width == 12 && value >= 077777777777ULL) {
+        // GNU base-256 encoding for sizes of 8 GiB and up
+        memset(field, 0, width);
+        field[0] = (char)0x80;
+        for (int i = width - 1; i > 0 && value > 0; i--) {
+            field[i] = (char)(value & 0xff);
+            value >>= 8;
+        }
+        return;
+    }
+    snprintf(field, width, "%0*llo", width - 1, value);
+}
+
+// fill in a ustar header block, name and prefix already set
+void tar_header(unsigned char *block, char typeflag, mode_t mode, off_t size, time_t mtime, uid_t uid, gid_t gid) {
+    unsigned int sum = 0;
+
+    tar_number((char *)block + 100, 8, mode & 07777);
+    tar_number((char *)block + 108, 8, uid);
+    tar_number((char *)block + 116, 8, gid);
+    tar_number((char *)block + 124, 12, size);
+    tar_number((char *)block + 136, 12, mtime < 0 ? 0 : mtime);
+    block[156] = typeflag;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    // checksum is computed with the checksum field filled with spaces
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += block[i];
+    }
+    snprintf((char *)block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+// write the header(s) naming one archive member, long names use a pax record
+int tar_write_header(struct archive *ar, const char *name, char typeflag, const char *linkname,
+                     mode_t mode, off_t size, time_t mtime, uid_t uid, gid_t gid) {
+    unsigned char block[TAR_BLOCK];
+    size_t len = strlen(name);
+    size_t link_len = linkname ? strlen(linkname) : 0;
+    const char *split = NULL;
+
+    // try to split a long name into the ustar prefix and name fields
+    if (len > 100) {
+        for (const char *p = name + len - 1; p > name; p--) {
+            if (*p == '/' && (size_t)(p - name) <= 155 && len - (p - name) - 1 <= 100 && p[1] != '\0') {
+                split = p;
+                break;
+            }
+        }
+    }
+
+    if ((len > 100 && split == NULL) || link_len > 100) {
+        char record[2 * PATH_MAX + 64];
+        size_t record_len = 0;
+        if (len > 100 && split == NULL) {
+            record_len += pax_record(record + record_len, "path", name);
+        }
+        if (link_len > 100) {
+            record_len += pax_record(record + record_len, "linkpath", linkname);
+        }
+
+        memset(block, 0, TAR_BLOCK);
+        snprintf((char *)block, 100, "PaxHeaders/%.80s", strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+        tar_header(block, 'x', 0644, record_len, mtime, uid, gid);
+        if (archive_write(ar, block, TAR_BLOCK, Z_NO_FLUSH) == -1 ||
+            archive_write(ar, record, record_len, Z_NO_FLUSH) == -1 ||
+            tar_pad(ar, record_len) == -1) {
+            return -1;
+        }
+    }
+
+    memset(block, 0, TAR_BLOCK);
+    if (split != NULL) {
+        memcpy(block + 345, name, split - name);
+        memcpy(block, split + 1, len - (split - name) - 1);
+    } else {
+        memcpy(block, name, len > 100 ? 100 : len);
+    }
+    if (linkname != NULL) {
+        memcpy(block + 157, linkname, link_len > 100 ? 100 : link_len);
+    }
+    tar_header(block, typeflag, mode, size, mtime, uid, gid);
+    return archive_write(ar, block, TAR_BLOCK, Z_NO_FLUSH);
+}
+
+// format one "<len> key=value\n" pax record, returns its length
+size_t pax_record(char *out, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t total = body + 1;
+
+    // the length prefix counts its own digits
+    while (total != body + (size_t)snprintf(NULL, 0, "%zu", total)) {
+        total = body + snprintf(NULL, 0, "%zu", total);
+    }
+    return sprintf(out, "%zu %s=%s\n", total, key, value);
+}
+
+// pad the member data to a whole block
+int tar_pad(struct archive *ar, off_t size) {
+    static const unsigned char zeros[TAR_BLOCK];
+    size_t rem = size % TAR_BLOCK;
+    if (rem == 0) {
+        return 0;
+    }
+    return archive_write(ar, zeros, TAR_BLOCK - rem, Z_NO_FLUSH);
+}
+
+// add one regular file to the archive, stored without its leading '/'
+int archive_add_file(struct archive *ar, const char *path) {
+    unsigned char buf[ARCHIVE_CHUNK];
+    struct stat sb;
+    const char *name = path;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    // open, fstat and close, plus a read per chunk
+    ar->syscalls += 3;
+    if (fd == -1 || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        // a file removed since it was selected is skipped, like tar does
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    while (*name == '/') {
+        name++;
+    }
+
+    // a copy of a member already written becomes a hard link to it
+    int linked = dedup_link(ar, path, name, &sb);
+    if (linked != 0) {
+        close(fd);
+        return linked == -1 ? -1 : 0;
+    }
+    if (tar_write_header(ar, name, '0', NULL, sb.st_mode, sb.st_size, sb.st_mtime, sb.st_uid, sb.st_gid) == -1) {
+        close(fd);
+        return -1;
+    }
+    ar->member_hash = DEDUP_SEED;
+
+    // the header size is authoritative, a file that changes while read is cut or zero filled
+    off_t remaining = sb.st_size;
+    while (remaining > 0) {
+        ssize_t n = read(fd, buf, remaining > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)remaining);
+        ar->syscalls++;
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "%s: file shrank while archiving\n", path);
+            memset(buf, 0, sizeof(buf));
+            n = remaining > (off_t)sizeof(buf) ? (ssize_t)sizeof(buf) : (ssize_t)remaining;
+        }
+        // small members are not worth a mode switch, the first chunk decides for large ones
+        if (remaining == sb.st_size &&
+            archive_passthrough(ar, sb.st_size >= PASSTHROUGH_MIN && !member_compressible(name, buf, n)) == -1) {
+            close(fd);
+            return -1;
+        }
+        if (archive_write(ar, buf, n, Z_NO_FLUSH) == -1) {
+            close(fd);
+            return -1;
+        }
+        if (ar->dedup) {
+            ar->member_hash = content_hash(ar->member_hash, buf, n);
+        }
+        remaining -= n;
+    }
+    close(fd);
+    ar->num_files++;
+    dedup_remember(ar, path, &sb);
+    return tar_pad(ar, sb.st_size);
+}
+
+// registered buffers and an empty file table for batched archive reads
+int reader_init(struct archive_reader *reader) {
+    struct iovec iov[URING_BATCH + 1];
+    int files[URING_BATCH];
+
+    memset(reader->used, 0, sizeof(reader->used));
+    if (uring_init(&reader->ring, URING_ENTRIES) == -1) {
+        return -1;
+    }
+    reader->buffers = mmap(NULL, (URING_BATCH + 1) * ARCHIVE_CHUNK, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    reader->ring.syscalls++;
+    if (reader->buffers == MAP_FAILED) {
+        uring_free(&reader->ring);
+        return -1;
+    }
+    for (int i = 0; i <= URING_BATCH; i++) {
+        iov[i].iov_base = reader->buffers + (size_t)i * ARCHIVE_CHUNK;
+        iov[i].iov_len = ARCHIVE_CHUNK;
+    }
+    for (int i = 0; i < URING_BATCH; i++) {
+        files[i] = -1;
+    }
+
+    // registered buffers count against RLIMIT_MEMLOCK, an archive that hits it reads the plain way
+    reader->ring.syscalls += 2;
+    if (syscall(__NR_io_uring_register, reader->ring.fd, IORING_REGISTER_BUFFERS, iov, URING_BATCH + 1) == -1 ||
+        syscall(__NR_io_uring_register, reader->ring.fd, IORING_REGISTER_FILES, files, URING_BATCH) == -1) {
+        reader_free(reader);
+        return -1;
+    }
+    return 0;
+}
+
+void reader_free(struct archive_reader *reader) {
+    munmap(reader->buffers, (URING_BATCH + 1) * ARCHIVE_CHUNK);
+    reader->ring.syscalls++;
+    uring_free(&reader->ring);
+}
+
+// add the files of a list URING_BATCH at a time: one io_uring_enter opens, stats and reads the first chunk of all of them
+int archive_add_files_uring(struct archive *ar, struct archive_reader *reader, const struct file_list *list) {
+    struct uring *ring = &reader->ring;
+    struct statx stx[URING_BATCH];
+    int opened[URING_BATCH];
+    int statted[URING_BATCH];
+    ssize_t first[URING_BATCH];
+
+    for (int start = 0; start < list->count; start += URING_BATCH) {
+        int count = list->count - start < URING_BATCH ? list->count - start : URING_BATCH;
+        int expected = 0;
+
+        for (int slot = 0; slot < count; slot++) {
+            const char *path = list->items[start + slot].path;
+            struct io_uring_sqe *sqe;
+
+            // the slot's previous file is closed first, then opened into and read, as one chain
+            if (reader->used[slot]) {
+                sqe = uring_sqe(ring);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->file_index = slot + 1;
+                // a hard link, so the open still runs should the close fail
+                sqe->flags = IOSQE_IO_HARDLINK;
+                sqe->user_data = (uint64_t)slot << 2 | URING_CLOSE;
+                expected++;
+                reader->used[slot] = 0;
+            }
+            sqe = uring_sqe(ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)path;
+            sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+            sqe->file_index = slot + 1;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = (uint64_t)slot << 2 | URING_OPEN;
+
+            sqe = uring_sqe(ring);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (uintptr_t)(reader->buffers + (size_t)slot * ARCHIVE_CHUNK);
+            sqe->len = ARCHIVE_CHUNK;
+            sqe->off = 0;
+            sqe->buf_index = slot;
+            sqe->user_data = (uint64_t)slot << 2 | URING_READ;
+
+            // by path and beside the chain, tar takes the header from it
+            sqe = uring_sqe(ring);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)path;
+            sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_UID | STATX_GID;
+            sqe->off = (uintptr_t)&stx[slot];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+            sqe->user_data = (uint64_t)slot << 2 | URING_STAT;
+            expected += 3;
+        }
+
+        if (uring_submit(ring, expected) == -1) {
+            return -1;
+        }
+        for (int done = 0; done < expected; done++) {
+            struct io_uring_cqe *cqe = uring_wait(ring);
+            if (cqe == NULL) {
+                return -1;
+            }
+            int slot = cqe->user_data >> 2;
+            switch (cqe->user_data & 3) {
+            case URING_OPEN:
+                opened[slot] = cqe->res >= 0;
+                break;
+            case URING_READ:
+                first[slot] = cqe->res;
+                break;
+            case URING_STAT:
+                statted[slot] = cqe->res == 0;
+                break;
+            }
+            uring_seen(ring);
+        }
+
+        for (int slot = 0; slot < count; slot++) {
+            reader->used[slot] = opened[slot];
+            // a file removed since it was selected is skipped, like tar does
+            if (!opened[slot] || !statted[slot] || !S_ISREG(stx[slot].stx_mode)) {
+                continue;
+            }
+            if (archive_add_member_uring(ar, reader, slot, list->items[start + slot].path, &stx[slot], first[slot]) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// write one member whose first chunk is already in its slot's buffer, reading ahead while a chunk is compressed
+int archive_add_member_uring(struct archive *ar, struct archive_reader *reader, int slot, const char *path,
+                             const struct statx *stx, ssize_t first) {
+    struct uring *ring = &reader->ring;
+    int buf_index = slot;
+    unsigned char *buf = reader->buffers + (size_t)slot * ARCHIVE_CHUNK;
+    const char *name = path;
+    ssize_t n = first;
+
+    while (*name == '/') {
+        name++;
+    }
+
+    // the fields dedup_link() and dedup_remember() look at
+    struct stat sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    sb.st_ino = stx->stx_ino;
+    sb.st_mode = stx->stx_mode;
+    sb.st_size = stx->stx_size;
+    sb.st_uid = stx->stx_uid;
+    sb.st_gid = stx->stx_gid;
+    sb.st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb.st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb.st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    sb.st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    int linked = dedup_link(ar, path, name, &sb);
+    if (linked != 0) {
+        return linked == -1 ? -1 : 0;
+    }
+
+    if (tar_write_header(ar, name, '0', NULL, stx->stx_mode, stx->stx_size, stx->stx_mtime.tv_sec,
+                         stx->stx_uid, stx->stx_gid) == -1) {
+        return -1;
+    }
+    ar->member_hash = DEDUP_SEED;
+
+    // the header size is authoritative, a file that changes while read is cut or zero filled
+    off_t size = stx->stx_size;
+    off_t remaining = size;
+    while (remaining > 0) {
+        int from_file = n > 0;
+        if (!from_file) {
+            fprintf(stderr, "%s: file shrank while archiving\n", path);
+            memset(buf, 0, ARCHIVE_CHUNK);
+            n = ARCHIVE_CHUNK;
+        }
+        if (n > remaining) {
+            n = remaining;
+        }
+
+        // the next chunk goes into the other buffer while this one is compressed
+        int next_index = buf_index == slot ? URING_BATCH : slot;
+        unsigned char *next = reader->buffers + (size_t)next_index * ARCHIVE_CHUNK;
+        int queued = from_file && remaining > n;
+        if (queued) {
+            struct io_uring_sqe *sqe = uring_sqe(ring);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (uintptr_t)next;
+            sqe->len = ARCHIVE_CHUNK;
+            sqe->off = size - remaining + n;
+            sqe->buf_index = next_index;
+            sqe->user_data = (uint64_t)slot << 2 | URING_READ;
+            if (uring_submit(ring, 0) == -1) {
+                return -1;
+            }
+        }
+
+        // small members are not worth a mode switch, the first chunk decides for large ones
+        if (remaining == size && archive_passthrough(ar, size >= PASSTHROUGH_MIN && !member_compressible(name, buf, n)) == -1) {
+            return -1;
+        }
+        if (archive_write(ar, buf, n, Z_NO_FLUSH) == -1) {
+            return -1;
+        }
+        if (ar->dedup) {
+            ar->member_hash = content_hash(ar->member_hash, buf, n);
+        }
+        remaining -= n;
+
+        n = 0;
+        if (queued) {
+            struct io_uring_cqe *cqe = uring_wait(ring);
+            if (cqe == NULL) {
+                return -1;
+            }
+            n = cqe->res;
+            uring_seen(ring);
+            buf_index = next_index;
+            buf = next;
+        }
+    }
+    ar->num_files++;
+    dedup_remember(ar, path, &sb);
+    return tar_pad(ar, size);
+}
+
+// map the inode hash cache where forked clients and shards share it
+int dedup_init() {
+    dedup_cache = mmap(NULL, DEDUP_CACHE_SLOTS * sizeof(struct dedup_cache_entry), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (dedup_cache == MAP_FAILED) {
+        perror("mmap");
+        dedup_cache = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// start an empty member table for an archive built with -a dedup
+int dedup_open(struct archive *ar) {
+    ar->size_buckets = malloc(DEDUP_BUCKETS * sizeof(int));
+    if (ar->size_buckets == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    for (int i = 0; i < DEDUP_BUCKETS; i++) {
+        ar->size_buckets[i] = -1;
+    }
+    ar->dedup = 1;
+    return 0;
+}
+
+void dedup_free(struct archive *ar) {
+    for (int i = 0; i < ar->num_members; i++) {
+        free(ar->members[i].path);
+    }
+    free(ar->members);
+    free(ar->size_buckets);
+    ar->members = NULL;
+    ar->size_buckets = NULL;
+    ar->num_members = ar->members_capacity = 0;
+}
+
+// write path as a hard link when a member with the same content is already in the archive;
+// 1 when it was, 0 when the caller writes the data, -1 on a write error
+int dedup_link(struct archive *ar, const char *path, const char *name, const struct stat *sb) {
+    unsigned long long hash = 0;
+    int hashed = 0;
+
+    if (!ar->dedup || sb->st_size < DEDUP_MIN_SIZE) {
+        return 0;
+    }
+    // only a file whose size matches an earlier member is hashed before it is written
+    for (int i = ar->size_buckets[sb->st_size % DEDUP_BUCKETS]; i != -1; i = ar->members[i].next) {
+        struct dedup_member *m = &ar->members[i];
+        if (m->size != sb->st_size) {
+            continue;
+        }
+        // a hard link in the tree has the same content without reading it
+        int same = m->dev == sb->st_dev && m->ino == sb->st_ino;
+        if (!same) {
+            if (!hashed && file_content_hash(path, sb, &hash) == -1) {
+                return 0;
+            }
+            hashed = 1;
+            // the hash only picks the candidate, a collision must not put the wrong content in the archive
+            same = m->hash == hash && files_equal(m->path, path, sb->st_size);
+        }
+        if (!same) {
+            continue;
+        }
+
+        const char *target = m->path;
+        while (*target == '/') {
+            target++;
+        }
+        if (tar_write_header(ar, name, '1', target, sb->st_mode, 0, sb->st_mtime, sb->st_uid, sb->st_gid) == -1) {
+            return -1;
+        }
+        ar->num_files++;
+        ar->num_linked++;
+        ar->bytes_linked += sb->st_size;
+        return 1;
+    }
+    return 0;
+}
+
+// record the member just written with the hash of its data, for the copies that may follow
+void dedup_remember(struct archive *ar, const char *path, const struct stat *sb) {
+    if (!ar->dedup || sb->st_size < DEDUP_MIN_SIZE) {
+        return;
+    }
+    if (ar->num_members == ar->members_capacity) {
+        int capacity = ar->members_capacity ? ar->members_capacity * 2 : 64;
+        struct dedup_member *members = realloc(ar->members, capacity * sizeof(struct dedup_member));
+        if (members == NULL) {
+            perror("realloc failed");
+            return;
+        }
+        ar->members = members;
+        ar->members_capacity = capacity;
+    }
+    struct dedup_member *m = &ar->members[ar->num_members];
+    m->path = strdup(path);
+    if (m->path == NULL) {
+        perror("strdup failed");
+        return;
+    }
+    m->dev = sb->st_dev;
+    m->ino = sb->st_ino;
+    m->size = sb->st_size;
+    m->hash = ar->member_hash;
+    m->next = ar->size_buckets[sb->st_size % DEDUP_BUCKETS];
+    ar->size_buckets[sb->st_size % DEDUP_BUCKETS] = ar->num_members++;
+
+    // the next archive taking this file finds its hash without reading it
+    struct dedup_cache_entry *e = dedup_cache_slot(sb);
+    if (e != NULL) {
+        e->dev = sb->st_dev;
+        e->ino = sb->st_ino;
+        e->size = sb->st_size;
+        e->mtime = sb->st_mtim;
+        e->ctime = sb->st_ctim;
+        e->hash = m->hash;
+    }
+}
+
+// the cache slot of an inode, NULL without a cache; another inode may hold it
+struct dedup_cache_entry *dedup_cache_slot(const struct stat *sb) {
+    if (dedup_cache == NULL) {
+        return NULL;
+    }
+    unsigned long long h = ((unsigned long long)sb->st_ino ^ ((unsigned long long)sb->st_dev << 32)) * DEDUP_SEED;
+    return &dedup_cache[(h >> 32) % DEDUP_CACHE_SLOTS];
+}
+
+// content hash of a file, from the inode cache while the file is unchanged, read in archive chunks otherwise
+int file_content_hash(const char *path, const struct stat *sb, unsigned long long *hash) {
+    unsigned char buf[ARCHIVE_CHUNK];
+    struct dedup_cache_entry *e = dedup_cache_slot(sb);
+
+    // entries are written without a lock, a torn one only costs a miss since candidates are compared anyway
+    if (e != NULL && e->dev == sb->st_dev && e->ino == sb->st_ino && e->size == sb->st_size &&
+        e->mtime.tv_sec == sb->st_mtim.tv_sec && e->mtime.tv_nsec == sb->st_mtim.tv_nsec &&
+        e->ctime.tv_sec == sb->st_ctim.tv_sec && e->ctime.tv_nsec == sb->st_ctim.tv_nsec) {
+        *hash = e->hash;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        return -1;
+    }
+    unsigned long long h = DEDUP_SEED;
+    off_t total = 0;
+    ssize_t n;
+    while ((n = read_chunk(fd, buf, sizeof(buf))) > 0) {
+        h = content_hash(h, buf, n);
+        total += n;
+    }
+    close(fd);
+    // a file that changed since it was listed is archived as it is read, not linked
+    if (n == -1 || total != sb->st_size) {
+        return -1;
+    }
+    *hash = h;
+    if (e != NULL) {
+        e->dev = sb->st_dev;
+        e->ino = sb->st_ino;
+        e->size = sb->st_size;
+        e->mtime = sb->st_mtim;
+        e->ctime = sb->st_ctim;
+        e->hash = h;
+    }
+    return 0;
+}
+
+// 64-bit hash of file data eight bytes per step, continuing from hash; chunks must split the file at the same offsets
+unsigned long long content_hash(unsigned long long hash, const void *data, size_t len) {
+    const unsigned char *ptr = data;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, ptr + i, sizeof(word));
+        hash = (hash ^ word) * DEDUP_SEED;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ ptr[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// whether two files hold the same size bytes
+int files_equal(const char *a, const char *b, off_t size) {
+    unsigned char buf_a[ARCHIVE_CHUNK], buf_b[ARCHIVE_CHUNK];
+    int fd_a = open(a, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    int fd_b = open(b, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    int equal = fd_a != -1 && fd_b != -1;
+    off_t compared = 0;
+
+    while (equal && compared < size) {
+        ssize_t n = read_chunk(fd_a, buf_a, sizeof(buf_a));
+        equal = n > 0 && read_chunk(fd_b, buf_b, sizeof(buf_b)) == n && memcmp(buf_a, buf_b, n) == 0;
+        compared += n;
+    }
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    return equal && compared == size;
+}
+
+// read until len bytes or the end of the file, so chunks start at the same offsets however read() splits them
+ssize_t read_chunk(int fd, unsigned char *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+// write the end of archive marker and finish the gzip stream
+int archive_close(struct archive *ar) {
+    static const unsigned char zeros[TAR_RECORD];
+    // two zero blocks, then pad to a full record like tar does
+    size_t end = 2 * TAR_BLOCK;
+    size_t rem = (ar->tar_bytes + end) % TAR_RECORD;
+    if (rem != 0) {
+        end += TAR_RECORD - rem;
+    }
+    int ret = archive_write(ar, zeros, end, Z_FINISH);
+    archive_abort(ar);
+    return ret;
+}
+
+// release the compressor of an archive, finished or not
+void archive_abort(struct archive *ar) {
+    if (ar->codec == CODEC_ZSTD && ar->zstd != NULL) {
+        codec_api.zstd_free(ar->zstd);
+        ar->zstd = NULL;
+    }
+    if (ar->codec == CODEC_LZ4) {
+        if (ar->lz4 != NULL) {
+            codec_api.lz4_free(ar->lz4);
+        }
+        free(ar->lz4_out);
+        ar->lz4 = NULL;
+        ar->lz4_out = NULL;
+    }
+    if (ar->codec != CODEC_GZIP) {
+        return;
+    }
+    if (!ar->parallel) {
+        deflateEnd(&ar->zs);
+        return;
+    }
+
+    // jobs still on the pool point at this archive, wait for them
+    pthread_mutex_lock(&ar->lock);
+    while (ar->jobs != NULL) {
+        while (!ar->jobs->done) {
+            pthread_cond_wait(&ar->job_done, &ar->lock);
+        }
+        struct pgz_job *job = ar->jobs;
+        ar->jobs = job->next_in_archive;
+        pgz_job_free(job);
+    }
+    pthread_mutex_unlock(&ar->lock);
+    pthread_mutex_destroy(&ar->lock);
+    pthread_cond_destroy(&ar->job_done);
+    free(ar->block);
+    ar->block = NULL;
+    ar->parallel = 0;
+}
+
+// buffer tar data into blocks for the compression pool
+int pgz_write(struct archive *ar, const void *data, size_t len, int flush) {
+    const unsigned char *ptr = data;
+
+    ar->tar_bytes += len;
+    while (len > 0) {
+        size_t room = PGZ_BLOCK - ar->block_len;
+        size_t n = len < room ? len : room;
+        memcpy(ar->block + ar->block_len, ptr, n);
+        ar->block_len += n;
+        ptr += n;
+        len -= n;
+        // keep the last block back so the final one is never empty
+        if (ar->block_len == PGZ_BLOCK && (len > 0 || flush != Z_FINISH)) {
+            if (pgz_submit(ar, 0) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    if (flush != Z_FINISH) {
+        return 0;
+    }
+    if (pgz_submit(ar, 1) == -1 || pgz_flush(ar, 1) == -1) {
+        return -1;
+    }
+
+    // gzip trailer: crc32 and length of the uncompressed data, little endian
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (ar->crc >> (8 * i)) & 0xff;
+        trailer[4 + i] = (ar->tar_bytes >> (8 * i)) & 0xff;
+    }
+    if (write_all(ar->fd, trailer, sizeof(trailer)) == -1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+// hand the current block to the compression pool
+int pgz_submit(struct archive *ar, int last) {
+    struct pgz_job *job = calloc(1, sizeof(struct pgz_job));
+    if (job == NULL) {
+        perror("calloc failed");
+        return -1;
+    }
+    job->ar = ar;
+    job->in = ar->block;
+    job->in_len = ar->block_len;
+    job->last = last;
+    job->level = ar->stored ? 0 : ar->level;
+
+    // the previous 32K of input primes the block's dictionary so ratios match serial gzip
+    memcpy(job->dict, ar->dict, ar->dict_len);
+    job->dict_len = ar->dict_len;
+    if (job->in_len >= PGZ_DICT) {
+        memcpy(ar->dict, job->in + job->in_len - PGZ_DICT, PGZ_DICT);
+        ar->dict_len = PGZ_DICT;
+    } else {
+        size_t keep = PGZ_DICT - job->in_len < ar->dict_len ? PGZ_DICT - job->in_len : ar->dict_len;
+        memmove(ar->dict, ar->dict + ar->dict_len - keep, keep);
+        memcpy(ar->dict + keep, job->in, job->in_len);
+        ar->dict_len = keep + job->in_len;
+    }
+
+    ar->block = last ? NULL : malloc(PGZ_BLOCK);
+    ar->block_len = 0;
+    if (!last && ar->block == NULL) {
+        perror("malloc failed");
+        pgz_job_free(job);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ar->lock);
+    if (ar->jobs_tail != NULL) {
+        ar->jobs_tail->next_in_archive = job;
+    } else {
+        ar->jobs = job;
+    }
+    ar->jobs_tail = job;
+    ar->in_flight++;
+    pthread_mutex_unlock(&ar->lock);
+
+    pthread_mutex_lock(&pgz_pool.lock);
+    if (pgz_pool.tail != NULL) {
+        pgz_pool.tail->next_in_pool = job;
+    } else {
+        pgz_pool.head = job;
+    }
+    pgz_pool.tail = job;
+    pthread_cond_signal(&pgz_pool.has_work);
+    pthread_mutex_unlock(&pgz_pool.lock);
+
+    // bound the memory held by blocks of one archive
+    return pgz_flush(ar, ar->in_flight > 2 * compress_threads ? 0 : -1);
+}
+
+// write finished blocks in order; all waits for every block, 0 for at least one, -1 for none
+int pgz_flush(struct archive *ar, int all) {
+    int ret = 0;
+
+    pthread_mutex_lock(&ar->lock);
+    while (ar->jobs != NULL) {
+        struct pgz_job *job = ar->jobs;
+        if (!job->done) {
+            if (all == 1 || all == 0) {
+                pthread_cond_wait(&ar->job_done, &ar->lock);
+                continue;
+            }
+            break;
+        }
+        ar->jobs = job->next_in_archive;
+        if (ar->jobs == NULL) {
+            ar->jobs_tail = NULL;
+        }
+        ar->in_flight--;
+        pthread_mutex_unlock(&ar->lock);
+
+        if (job->failed || (ret == 0 && write_all(ar->fd, job->out, job->out_len) == -1)) {
+            perror("write");
+            ret = -1;
+        }
+        ar->crc = crc32_combine(ar->crc, job->crc, job->in_len);
+        pgz_job_free(job);
+        if (all == 0) {
+            all = -1;
+        }
+
+        pthread_mutex_lock(&ar->lock);
+    }
+    pthread_mutex_unlock(&ar->lock);
+    return ret;
+}
+
+// deflate one block as a raw, byte aligned piece of the shared stream
+void pgz_compress(struct pgz_job *job) {
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    job->crc = crc32(crc32(0L, Z_NULL, 0), job->in, job->in_len);
+    if (deflateInit2(&zs, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        job->failed = 1;
+        return;
+    }
+    if (job->dict_len > 0) {
+        deflateSetDictionary(&zs, job->dict, job->dict_len);
+    }
+
+    job->out_cap = deflateBound(&zs, job->in_len) + 64;
+    job->out = malloc(job->out_cap);
+    if (job->out == NULL) {
+        job->failed = 1;
+        deflateEnd(&zs);
+        return;
+    }
+
+    // a sync flush ends non-final blocks on a byte boundary so they can be concatenated
+    zs.next_in = job->in;
+    zs.avail_in = job->in_len;
+    zs.next_out = job->out;
+    zs.avail_out = job->out_cap;
+    int ret = deflate(&zs, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_ERROR || zs.avail_in != 0 || (job->last && ret != Z_STREAM_END)) {
+        job->failed = 1;
+    }
+    job->out_len = job->out_cap - zs.avail_out;
+    deflateEnd(&zs);
+}
+
+void pgz_job_free(struct pgz_job *job) {
+    free(job->in);
+    free(job->out);
+    free(job);
+}
+
+// compression pool thread
+void *pgz_worker_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pgz_pool.lock);
+        while (pgz_pool.head == NULL) {
+            pthread_cond_wait(&pgz_pool.has_work, &pgz_pool.lock);
+        }
+        struct pgz_job *job = pgz_pool.head;
+        pgz_pool.head = job->next_in_pool;
+        if (pgz_pool.head == NULL) {
+            pgz_pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&pgz_pool.lock);
+
+        pgz_compress(job);
+
+        struct archive *ar = job->ar;
+        pthread_mutex_lock(&ar->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&ar->job_done);
+        pthread_mutex_unlock(&ar->lock);
+    }
+    return NULL;
+}
+
+// start the compression pool in this process, forked children start their own
+int pgz_pool_start() {
+    pthread_t tid;
+    int ret = 0;
+
+    pthread_mutex_lock(&pgz_start_lock);
+    if (pgz_pool.pid != getpid()) {
+        pthread_mutex_init(&pgz_pool.lock, NULL);
+        pthread_cond_init(&pgz_pool.has_work, NULL);
+        pgz_pool.head = pgz_pool.tail = NULL;
+        for (int i = 0; i < compress_threads; i++) {
+            if (pthread_create(&tid, NULL, pgz_worker_main, NULL) != 0) {
+                perror("pthread_create");
+                ret = -1;
+                break;
+            }
+            pthread_detach(tid);
+        }
+        pgz_pool.pid = getpid();
+    }
+    pthread_mutex_unlock(&pgz_start_lock);
+    return ret;
+}
+
+// open an unnamed file in dir for one request's archive, it only gets a name if it is kept
+int archive_tmpfile(const char *dir) {
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        // a filesystem without O_TMPFILE still gets private archives, they just cannot be kept
+        fd = memfd_create("archive", MFD_CLOEXEC);
+        if (fd == -1) {
+            perror("archive file");
+        }
+    }
+    return fd;
+}
+
+// build the archive for the current command into fd, returns the number of files
+int create_archive(int fd, const struct file_list *list, int codec, int level) {
+    struct archive ar;
+    struct archive_reader reader;
+
+    int ret = archive_open(&ar, fd, codec, level);
+    // without its table an archive is still built, just with every copy in it
+    if (ret == 0 && archive_mode == ARCHIVE_DEDUP) {
+        dedup_open(&ar);
+    }
+    // batched reads where io_uring works, a read per chunk otherwise
+    int batched = ret == 0 && use_uring && reader_init(&reader) == 0;
+    if (batched) {
+        ret = archive_add_files_uring(&ar, &reader, list);
+        reader_free(&reader);
+        ar.syscalls += reader.ring.syscalls;
+    }
+    for (int i = 0; !batched && ret == 0 && i < list->count; i++) {
+        ret = archive_add_file(&ar, list->items[i].path);
+    }
+    __atomic_add_fetch(&metrics->archive_syscalls, ar.syscalls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->files_archived, ar.num_files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->files_deduplicated, ar.num_linked, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->bytes_deduplicated, ar.bytes_linked, __ATOMIC_RELAXED);
+    if (ar.num_linked > 0) {
+        printf("linked %d duplicate files, %llu bytes not compressed again\n", ar.num_linked, ar.bytes_linked);
+    }
+    dedup_free(&ar);
+    if (ret == 0) {
+        ret = archive_close(&ar);
+    } else {
+        archive_abort(&ar);
+    }
+    return ret == -1 ? -1 : ar.num_files;
+}
+
+// run the legacy find | tar pipeline for the current command, writing the archive to fd
+void create_archive_shell(int fd) {
+    char tar_path[64];
+
+    // tar opens our descriptor through /proc, so fd need not be inherited by every other request's shell
+    snprintf(tar_path, sizeof(tar_path), "/proc/%d/fd/%d", getpid(), fd);
+
+    if (strncmp(argv[0], "getfiles", 8) == 0) {
+        int num_files = 0;
+        char *file_names[10];
+        bool found_files[10];
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "-u") != 0) {
+                file_names[num_files] = argv[i];
+                found_files[num_files++] = false;
+            }
+        }
+        search_files(home_dir, file_names, num_files, found_files);
+
+        char cmd[2048];
+        snprintf(cmd, sizeof(cmd), "tar czf %s", tar_path);
+        for (int i = 0; i < num_files; i++) {
+            if (found_files[i]) {
+                snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " %s", file_names[i]);
+            }
+        }
+        system(cmd);
+        return;
+    }
+
+    char *cmd = generate_cmd(tar_path);
+    printf("command: %s\n", cmd);
+    system(cmd);
+    free(cmd);
+}
+
+// build and send the archive for an sgetfiles/dgetfiles/gettargz/getfiles request
+void handle_archive_command() {
+    struct timespec start, built, end;
+    struct rusage self_start, self_end, children_start, children_end;
+    struct file_query query;
+    struct file_list list = {0};
+    // shell archives have no selection to derive an id from, they get a random one
+    char key[CACHE_KEY_LEN + 1] = "";
+    const char *source = archive_mode == ARCHIVE_DEDUP ? "dedup" : "builtin";
+    int cache_hit = 0;
+    struct stat sb;
+    int fd = -1;
+    // compression pool threads work for this request too
+    int who = compress_threads > 1 ? RUSAGE_SELF : RUSAGE_THREAD;
+    // text protocol clients always get gzip
+    int codec = current_conn != NULL && current_conn->framed ? current_conn->codec : CODEC_GZIP;
+    int level = current_conn != NULL && current_conn->framed ? current_conn->level : 0;
+
+    // builds take a slot, so a burst of clients queues here instead of starting more sh/find/tar than the box can run
+    if (archive_job_admit() == -1) {
+        send_busy();
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(who, &self_start);
+    getrusage(RUSAGE_CHILDREN, &children_start);
+
+    if (archive_mode == ARCHIVE_SHELL) {
+        source = "shell";
+        // find and tar run as one pipeline, all of it counts as building
+        fd = archive_tmpfile(".");
+        if (fd != -1) {
+            create_archive_shell(fd);
+            // tar writes nothing when it refuses to create an empty archive
+            if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        metrics_observe(PHASE_BUILD, &start);
+    } else if (parse_file_query(&query) == -1) {
+        fprintf(stderr, "invalid file selection for %s\n", argv[0]);
+    } else {
+        select_files(&query, &list);
+        metrics_observe(PHASE_WALK, &start);
+        clock_gettime(CLOCK_MONOTONIC, &built);
+        // a stable order makes the archive, and its cache key, deterministic
+        qsort(list.items, list.count, sizeof(struct file_item), compare_file_items);
+
+        // the cache key doubles as the transfer id
+        if (list.count > 0) {
+            cache_key(&query, &list, codec, level, key);
+        }
+
+        if (list.count > 0 && cache_dir != NULL) {
+            fd = cache_lookup(key);
+            if (fd != -1) {
+                source = "cache hit";
+                cache_hit = 1;
+                __atomic_add_fetch(&metrics->cache_hits, 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_add_fetch(&metrics->cache_misses, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        // every request builds into its own unnamed file, so concurrent requests never share one
+        if (list.count > 0 && fd == -1) {
+            // created in the cache directory so the finished archive can be linked into it
+            fd = archive_tmpfile(cache_dir != NULL ? cache_dir : ".");
+            if (fd != -1 && create_archive(fd, &list, codec, level) <= 0) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd != -1 && cache_dir != NULL) {
+                cache_insert(fd, key);
+            }
+        }
+        // a cache hit builds nothing and is left out of the build times
+        if (list.count > 0 && !cache_hit) {
+            metrics_observe(PHASE_BUILD, &built);
+        }
+        file_list_free(&list);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(who, &self_end);
+    getrusage(RUSAGE_CHILDREN, &children_end);
+
+    // per request cost, children covers the sh/find/tar processes of the shell path
+    printf("%s archive (%s, %s): %.1f ms wall, %.1f ms cpu\n", argv[0], source, codecs[codec].name,
+           elapsed_ms(&start, &end),
+           cpu_ms(&self_start.ru_utime, &self_end.ru_utime) + cpu_ms(&self_start.ru_stime, &self_end.ru_stime) +
+           cpu_ms(&children_start.ru_utime, &children_end.ru_utime) + cpu_ms(&children_start.ru_stime, &children_end.ru_stime));
+    // sending is limited by the bytes in flight, not by the slot
+    archive_job_done();
+
+    // framed clients learn where to resume the archive from if the transfer breaks
+    if (fd != -1 && transfer_ttl > 0 && transfer_store(fd, key) == 0) {
+        off_t size = lseek(fd, 0, SEEK_END);
+        off_t chunk = stripe_chunk_size(size);
+
+        // a striped request gets the first chunk here, the client fetches the others over more connections
+        if (current_conn != NULL && current_conn->striped && chunk < size &&
+            send_stripe_layout(key, fd, size, chunk) == 0) {
+            __atomic_add_fetch(&metrics->striped_archives, 1, __ATOMIC_RELAXED);
+            send_archive_range(fd, 0, chunk);
+            close(fd);
+            return;
+        }
+        send_transfer_id(key, size);
+    }
+
+    // the archive stays readable through fd even if it is evicted meanwhile, and goes away with it
+    send_archive_fd(fd);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+// tell a framed client the transfer id and full size of the archive that follows
+void send_transfer_id(const char *id, off_t size) {
+    char msg[CACHE_KEY_LEN + 32];
+
+    if (current_conn == NULL || !current_conn->framed) {
+        return;
+    }
+    int len = snprintf(msg, sizeof(msg), "%s %ld", id, (long)size);
+    send_frame_header(FRAME_TRANSFER, current_conn->request_id, len);
+    send_all(clientfd, msg, len);
+}
+
+// chunk size a striped archive of size bytes is split into, a few dozen chunks keep K connections busy
+off_t stripe_chunk_size(off_t size) {
+    off_t chunk = (size + STRIPE_MAX_CHUNKS - 1) / STRIPE_MAX_CHUNKS;
+
+    if (chunk < STRIPE_MIN_CHUNK) {
+        chunk = STRIPE_MIN_CHUNK;
+    }
+    return (chunk + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+}
+
+// tell a framed client how a striped archive is split: transfer id, size, chunk size and the crc32 of each chunk
+int send_stripe_layout(const char *id, int fd, off_t size, off_t chunk) {
+    char msg[CACHE_KEY_LEN + 64 + STRIPE_MAX_CHUNKS * 9];
+
+    const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    int len = snprintf(msg, sizeof(msg), "%s %ld %ld", id, (long)size, (long)chunk);
+    for (off_t offset = 0; offset < size; offset += chunk) {
+        size_t n = size - offset < chunk ? (size_t)(size - offset) : (size_t)chunk;
+        len += snprintf(msg + len, sizeof(msg) - len, " %08lx", crc32_z(0, data + offset, n));
+    }
+    munmap((void *)data, size);
+
+    send_frame_header(FRAME_TRANSFER, current_conn->request_id, len);
+    return send_all(clientfd, msg, len);
+}
+
+// keep a finished archive under its transfer id, generating one if id is empty
+int transfer_store(int fd, char *id) {
+    char name[CACHE_KEY_LEN + 16];
+
+    if (id[0] == '\0') {
+        unsigned char random[CACHE_KEY_LEN / 2];
+        if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+            return -1;
+        }
+        for (size_t i = 0; i < sizeof(random); i++) {
+            sprintf(id + i * 2, "%02x", random[i]);
+        }
+    }
+
+    // link the open file rather than copy it, the same inode may also sit in the cache
+    snprintf(name, sizeof(name), "%s.tar.gz", id);
+    if (link_open_file(fd, TRANSFER_DIR, name) == -1) {
+        perror("transfer link");
+        return -1;
+    }
+    // the retention period starts now, even for an old cached archive
+    futimens(fd, NULL);
+    transfer_expire();
+    return 0;
+}
+
+// give the file open on fd the name dir/name, replacing any file already there
+int link_open_file(int fd, const char *dir, const char *name) {
+    char source[64];
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+
+    // linked under a private name first, a reader never sees a half published file
+    snprintf(source, sizeof(source), "/proc/self/fd/%d", fd);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp.%d.%ld.%s", dir, getpid(), (long)pthread_self(), name);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (linkat(AT_FDCWD, source, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW) == -1) {
+        return -1;
+    }
+    if (rename(tmp_path, path) == -1) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// drop transfers nobody resumed within the retention period
+void transfer_expire() {
+    static time_t last_sweep;
+    struct dirent *entry;
+    struct stat sb;
+    time_t now = time(NULL);
+
+    // a sweep per archive would cost a directory scan each, once a minute is plenty
+    if (now - __atomic_load_n(&last_sweep, __ATOMIC_RELAXED) < TRANSFER_SWEEP_INTERVAL) {
+        return;
+    }
+    __atomic_store_n(&last_sweep, now, __ATOMIC_RELAXED);
+
+    DIR *d = opendir(TRANSFER_DIR);
+    if (d == NULL) {
+        return;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.' && strncmp(entry->d_name, ".tmp.", 5) != 0) {
+            continue;
+        }
+        if (fstatat(dirfd(d), entry->d_name, &sb, 0) == 0 && now - sb.st_mtime > transfer_ttl) {
+            unlinkat(dirfd(d), entry->d_name, 0);
+        }
+    }
+    closedir(d);
+}
+
+// create the transfer directory, transfers of an earlier run stay resumable until they expire
+int transfer_init() {
+    if (mkdir(TRANSFER_DIR, 0700) == -1 && errno != EEXIST) {
+        perror("transfer mkdir");
+        return -1;
+    }
+    transfer_expire();
+    return 0;
+}
+
+// resume <id> <offset> [length] sends part of a kept archive
+void handle_resume_command() {
+    char path[PATH_MAX];
+    int fd = -1;
+
+    if (argc < 3 || strlen(argv[1]) != CACHE_KEY_LEN || strspn(argv[1], "0123456789abcdef") != CACHE_KEY_LEN) {
+        fprintf(stderr, "invalid resume request\n");
+    } else {
+        snprintf(path, sizeof(path), "%s/%s.tar.gz", TRANSFER_DIR, argv[1]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (fd == -1) {
+        // expired or never existed, the client sees an empty archive
+        send_archive_fd(-1);
+        return;
+    }
+    printf("resuming transfer %s at %s\n", argv[1], argv[2]);
+
+    // every resume restarts the retention period
+    futimens(fd, NULL);
+    send_transfer_id(argv[1], lseek(fd, 0, SEEK_END));
+    send_archive_range(fd, atol(argv[2]), argc > 3 ? atol(argv[3]) : -1);
+    close(fd);
+}
+
+// answer a delta request: "getfiles name..." on its own line, then the client's block signature of each name
+void handle_delta_request(char *payload, size_t length) {
+    const unsigned char *sig, *end = (const unsigned char *)payload + length;
+    char *newline = memchr(payload, '\n', length);
+    char *saveptr;
+
+    if (newline == NULL) {
+        sendResponse("Invalid delta request\n");
+        return;
+    }
+    *newline = '\0';
+    sig = (const unsigned char *)newline + 1;
+    printf("Received delta request: %s\n", payload);
+
+    home_dir = getenv("HOME");
+    argc = 0;
+    char *token = strtok_r(payload, " ", &saveptr);
+    while (token != NULL && argc < 10) {
+        argv[argc++] = token;
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+    if (home_dir == NULL || argc < 2 || strcmp(argv[0], "getfiles") != 0) {
+        sendResponse("Invalid delta request\n");
+        return;
+    }
+    metric_command = METRIC_GETFILES;
+
+    // the reply is only sized once every file is diffed, it is built in a private file first
+    int fd = archive_tmpfile(".");
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w+");
+    if (out == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        sendResponse("Delta transfer failed\n");
+        return;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        struct delta_signature signature;
+        struct file_query query = { .type = QUERY_NAMES, .num_names = 1 };
+        struct file_list list = {0};
+
+        // block size, size of the client's copy and block count, then one entry per block
+        if (end - sig < DELTA_SIGNATURE_HEADER) {
+            break;
+        }
+        signature.block_size = get_be(sig, 4);
+        signature.basis_size = get_be(sig + 4, 8);
+        signature.count = get_be(sig + 12, 4);
+        signature.entries = sig + DELTA_SIGNATURE_HEADER;
+        if ((size_t)(end - signature.entries) / DELTA_ENTRY_LEN < signature.count ||
+            (signature.count > 0 && (signature.block_size == 0 || signature.block_size > DELTA_MAX_BLOCK ||
+             signature.basis_size > (uint64_t)signature.count * signature.block_size ||
+             signature.basis_size <= (uint64_t)(signature.count - 1) * signature.block_size))) {
+            break;
+        }
+        sig = signature.entries + (size_t)signature.count * DELTA_ENTRY_LEN;
+
+        query.names[0] = argv[i];
+        select_files(&query, &list);
+        if (list.count == 0 || delta_file(out, list.items[0].path, &signature) == -1) {
+            // the client is told the file is not there
+            fputc(0, out);
+        }
+        file_list_free(&list);
+    }
+
+    if (sig != end || fflush(out) == EOF) {
+        fclose(out);
+        sendResponse("Invalid delta request\n");
+        return;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    printf("delta reply: %ld bytes\n", (long)size);
+    if (current_conn != NULL && current_conn->framed) {
+        send_frame_header(FRAME_DELTA, current_conn->request_id, size);
+        send_file_range(clientfd, fd, 0, size);
+    }
+    fclose(out);
+}
+
+// write one file as copies of the client's blocks and literal data, preceded by where and what it is
+int delta_file(FILE *out, const char *path, const struct delta_signature *sig) {
+    struct stat sb;
+    unsigned char *data = NULL;
+    unsigned long long whole[2] = { DELTA_SEED0, DELTA_SEED1 };
+    uint32_t block = sig->block_size;
+    uint32_t last_len = sig->count > 0 ? sig->basis_size - (uint64_t)(sig->count - 1) * block : 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1 || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    off_t size = sb.st_size;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    // the client writes the file where extracting the archive would have put it
+    const char *name = path;
+    while (*name == '/') {
+        name++;
+    }
+    strong_sum(whole, data, size);
+    fputc(1, out);
+    put_be(out, strlen(name), 2);
+    fwrite(name, 1, strlen(name), out);
+    put_be(out, size, 8);
+    put_be(out, sb.st_mtime, 8);
+    put_be(out, sb.st_mode & 0777, 4);
+    put_be(out, whole[0], 8);
+    put_be(out, whole[1], 8);
+
+    // weak checksum -> block ids, chained like the file index buckets
+    int num_buckets = 1;
+    while (num_buckets < 2 * (int)sig->count) {
+        num_buckets <<= 1;
+    }
+    int *buckets = malloc(num_buckets * sizeof(int));
+    int *next = malloc((sig->count + 1) * sizeof(int));
+    if (buckets == NULL || next == NULL) {
+        perror("malloc failed");
+        free(buckets);
+        free(next);
+        if (data != NULL) {
+            munmap(data, size);
+        }
+        return -1;
+    }
+    memset(buckets, -1, num_buckets * sizeof(int));
+    // inserted backwards so each chain lists lower blocks first
+    for (int id = sig->count - 1; id >= 0; id--) {
+        int bucket = delta_bucket(get_be(sig->entries + (size_t)id * DELTA_ENTRY_LEN, 4), num_buckets);
+        next[id] = buckets[bucket];
+        buckets[bucket] = id;
+    }
+
+    struct delta_run run = { -1, 0 };
+    off_t pos = 0;
+    off_t literal = 0;
+    uint32_t a = 0, b = 0;
+    if (sig->count > 0 && size >= block) {
+        weak_sum(data, block, &a, &b);
+    }
+    while (sig->count > 0 && pos + block <= size) {
+        int id = delta_match(sig, buckets, next, num_buckets, (a & 0xffff) | (b << 16), data + pos, block, &run);
+        if (id == -1) {
+            // slide the window one byte
+            if (pos + block < size) {
+                a += data[pos + block] - data[pos];
+                b += a - block * data[pos];
+            }
+            pos++;
+            continue;
+        }
+        delta_emit(out, data, literal, pos, &run, id);
+        pos += block;
+        literal = pos;
+        if (pos + block <= size) {
+            weak_sum(data + pos, block, &a, &b);
+        }
+    }
+
+    // a shorter last block can only match at the very end
+    if (sig->count > 0 && last_len < block && size >= last_len && size - last_len >= literal) {
+        off_t tail = size - last_len;
+        unsigned long long strong[2] = { DELTA_SEED0, DELTA_SEED1 };
+        const unsigned char *entry = sig->entries + (size_t)(sig->count - 1) * DELTA_ENTRY_LEN;
+
+        weak_sum(data + tail, last_len, &a, &b);
+        strong_sum(strong, data + tail, last_len);
+        if (get_be(entry, 4) == ((a & 0xffff) | (b << 16)) &&
+            get_be(entry + 4, 8) == strong[0] && get_be(entry + 12, 8) == strong[1]) {
+            delta_emit(out, data, literal, tail, &run, sig->count - 1);
+            literal = size;
+        }
+    }
+    delta_emit(out, data, literal, size, &run, -1);
+    fputc(DELTA_END, out);
+
+    free(buckets);
+    free(next);
+    if (data != NULL) {
+        munmap(data, size);
+    }
+    return 0;
+}
+
+// id of the client block the window matches, preferring the one that continues the current run
+int delta_match(const struct delta_signature *sig, const int *buckets, const int *next, int num_buckets,
+                uint32_t weak, const unsigned char *window, uint32_t len, const struct delta_run *run) {
+    unsigned long long strong[2];
+    int have_strong = 0;
+    int found = -1;
+
+    for (int id = buckets[delta_bucket(weak, num_buckets)]; id != -1; id = next[id]) {
+        const unsigned char *entry = sig->entries + (size_t)id * DELTA_ENTRY_LEN;
+        // the last block may be shorter, it is matched separately
+        if (get_be(entry, 4) != weak || (id == (int)sig->count - 1 && sig->basis_size % sig->block_size != 0)) {
+            continue;
+        }
+        if (!have_strong) {
+            strong[0] = DELTA_SEED0;
+            strong[1] = DELTA_SEED1;
+            strong_sum(strong, window, len);
+            have_strong = 1;
+        }
+        if (get_be(entry + 4, 8) == strong[0] && get_be(entry + 12, 8) == strong[1]) {
+            if (id == run->first + run->count) {
+                return id;
+            }
+            if (found == -1) {
+                found = id;
+            }
+        }
+    }
+    return found;
+}
+
+// write the literal bytes before end, then extend or restart the copy run with block id (-1 ends it)
+void delta_emit(FILE *out, const unsigned char *data, off_t literal, off_t end, struct delta_run *run, int id) {
+    if (literal < end || id == -1 || id != run->first + run->count) {
+        if (run->count > 0) {
+            fputc(DELTA_COPY, out);
+            put_be(out, run->first, 4);
+            put_be(out, run->count, 4);
+        }
+        run->first = id;
+        run->count = 0;
+    }
+    while (literal < end) {
+        uint32_t len = end - literal > DELTA_MAX_LITERAL ? DELTA_MAX_LITERAL : end - literal;
+        fputc(DELTA_LITERAL, out);
+        put_be(out, len, 4);
+        fwrite(data + literal, 1, len, out);
+        literal += len;
+    }
+    if (id != -1) {
+        run->count++;
+    }
+}
+
+// hash bucket of a weak checksum, its low half alone is just a byte sum and clusters badly
+int delta_bucket(uint32_t weak, int num_buckets) {
+    return (uint32_t)(((uint64_t)weak * 0x9e3779b97f4a7c15ULL) >> 32) & (num_buckets - 1);
+}
+
+// rsync's rolling checksum of a block, its two 16 bit halves
+void weak_sum(const unsigned char *data, uint32_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        s1 += data[i];
+        s2 += (len - i) * data[i];
+    }
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+}
+
+// 128 bit checksum built from two differently seeded hash64 runs, sum is updated in place
+void strong_sum(unsigned long long *sum, const void *data, size_t len) {
+    sum[0] = hash64(sum[0], data, len);
+    sum[1] = hash64(sum[1], data, len);
+}
+
+// write the low bytes of value big endian
+void put_be(FILE *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        fputc((value >> (i * 8)) & 0xff, out);
+    }
+}
+
+// read a big endian number of the given size
+uint64_t get_be(const unsigned char *ptr, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | ptr[i];
+    }
+    return value;
+}
+
+int compare_file_items(const void *a, const void *b) {
+    return strcmp(((const struct file_item *)a)->path, ((const struct file_item *)b)->path);
+}
+
+// 64-bit FNV-1a over len bytes, continuing from hash
+unsigned long long hash64(unsigned long long hash, const void *data, size_t len) {
+    const unsigned char *ptr = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// cache key: the normalized command and codec plus a fingerprint of every matched file
+void cache_key(const struct file_query *query, const struct file_list *list, int codec, int level, char *key) {
+    char command[BUFFER_SIZE];
+    // two differently seeded hashes give a 128-bit key
+    unsigned long long h1 = 14695981039346656037ULL;
+    unsigned long long h2 = 0x9e3779b97f4a7c15ULL;
+
+    normalize_query(query, command, sizeof(command));
+    // gzip at its default keeps the keys, and cached archives, of older servers
+    if (codec != CODEC_GZIP || level != 0) {
+        snprintf(command + strlen(command), sizeof(command) - strlen(command), " %s:%d", codecs[codec].name, level);
+    }
+    // links stand where other archives hold the data, so the two are cached apart
+    if (archive_mode == ARCHIVE_DEDUP) {
+        snprintf(command + strlen(command), sizeof(command) - strlen(command), " dedup");
+    }
+    h1 = hash64(h1, command, strlen(command) + 1);
+    h2 = hash64(h2, command, strlen(command) + 1);
+    for (int i = 0; i < list->count; i++) {
+        const struct file_item *item = &list->items[i];
+        h1 = hash64(h1, item->path, strlen(item->path) + 1);
+        h1 = hash64(h1, &item->size, sizeof(item->size));
+        h1 = hash64(h1, &item->mtime, sizeof(item->mtime));
+        h2 = hash64(h2, item->path, strlen(item->path) + 1);
+        h2 = hash64(h2, &item->size, sizeof(item->size));
+        h2 = hash64(h2, &item->mtime, sizeof(item->mtime));
+    }
+    snprintf(key, CACHE_KEY_LEN + 1, "%016llx%016llx", h1, h2);
+}
+
+// canonical text of a query, so "gettargz txt c" and "gettargz c txt -u" share a key
+void normalize_query(const struct file_query *query, char *out, size_t size) {
+    char *sorted[MAX_QUERY_NAMES > MAX_FILE_TYPES ? MAX_QUERY_NAMES : MAX_FILE_TYPES];
+    int count = 0;
+
+    switch (query->type) {
+    case QUERY_SIZE:
+        snprintf(out, size, "sgetfiles %ld %ld", (long)query->min_size, (long)query->max_size);
+        return;
+    case QUERY_DATE:
+        snprintf(out, size, "dgetfiles %ld %ld", (long)query->after, (long)query->until);
+        return;
+    case QUERY_TYPES:
+        snprintf(out, size, "gettargz");
+        count = query->num_types;
+        memcpy(sorted, query->types, count * sizeof(char *));
+        break;
+    default:
+        snprintf(out, size, "getfiles");
+        count = query->num_names;
+        memcpy(sorted, query->names, count * sizeof(char *));
+        break;
+    }
+    qsort(sorted, count, sizeof(char *), compare_strings);
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && strcmp(sorted[i], sorted[i - 1]) == 0) {
+            continue;
+        }
+        snprintf(out + strlen(out), size - strlen(out), " %s", sorted[i]);
+    }
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// open a cached archive and mark it recently used, -1 on a miss
+int cache_lookup(const char *key) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.tar.gz", cache_dir, key);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        // the file mtime is the LRU clock shared by every process using the cache
+        futimens(fd, NULL);
+    }
+    return fd;
+}
+
+// publish a freshly built archive open on fd under its key and enforce the byte budget
+int cache_insert(int fd, const char *key) {
+    char name[CACHE_KEY_LEN + 16];
+    snprintf(name, sizeof(name), "%s.tar.gz", key);
+
+    // fd keeps the archive readable even if eviction by another process takes it right away
+    if (link_open_file(fd, cache_dir, name) == -1) {
+        perror("cache insert");
+        return -1;
+    }
+    cache_evict();
+    return 0;
+}
+
+// drop least recently used archives until the cache fits its budget
+void cache_evict() {
+    char path[PATH_MAX];
+    struct cache_file *files = NULL;
+    int count = 0, capacity = 0;
+    unsigned long long total = 0;
+    struct dirent *entry;
+    struct stat sb;
+
+    // the server and mirror may share the directory, one evictor at a time
+    snprintf(path, sizeof(path), "%s/.lock", cache_dir);
+    int lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+        perror("cache lock");
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+        return;
+    }
+
+    DIR *dir = opendir(cache_dir);
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 7 || strcmp(entry->d_name + len - 7, ".tar.gz") != 0 ||
+            fstatat(dirfd(dir), entry->d_name, &sb, 0) == -1) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct cache_file *grown = realloc(files, capacity * sizeof(struct cache_file));
+            if (grown == NULL) {
+                break;
+            }
+            files = grown;
+        }
+        snprintf(files[count].name, sizeof(files[count].name), "%s", entry->d_name);
+        files[count].size = sb.st_size;
+        files[count].used = sb.st_mtim;
+        count++;
+        total += sb.st_size;
+    }
+
+    if (total > cache_budget) {
+        qsort(files, count, sizeof(struct cache_file), compare_cache_files);
+        for (int i = 0; i < count && total > cache_budget; i++) {
+            if (unlinkat(dirfd(dir), files[i].name, 0) == 0) {
+                total -= files[i].size;
+            }
+        }
+    }
+
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    free(files);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// oldest use first
+int compare_cache_files(const void *a, const void *b) {
+    const struct timespec *x = &((const struct cache_file *)a)->used;
+    const struct timespec *y = &((const struct cache_file *)b)->used;
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return x->tv_nsec < y->tv_nsec ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+
+// create the cache directory and clear temp files left by a crash
+int cache_init(const char *dir) {
+    struct dirent *entry;
+
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("cache mkdir");
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("cache opendir");
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, ".tmp.", 5) == 0) {
+            unlinkat(dirfd(d), entry->d_name, 0);
+        }
+    }
+    closedir(d);
+    cache_dir = dir;
+    cache_evict();
+    return 0;
+}
+
+double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+double cpu_ms(const struct timeval *start, const struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_usec - start->tv_usec) / 1000.0;
+}
+
+// metrics slot of a command name
+int metric_command_for(const char *name) {
+    for (int i = 0; i < METRIC_OTHER; i++) {
+        if (strcmp(name, metric_command_names[i]) == 0) {
+            return i;
+        }
+    }
+    return METRIC_OTHER;
+}
+
+// record how long a phase of the current command took since start
+void metrics_observe(int phase, const struct timespec *start) {
+    struct timespec now;
+    struct histogram *h = &metrics->latency[metric_command][phase];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long us = elapsed_ms(start, &now) * 1000;
+    // bucket by bit length, so bucket i holds [2^(i-1), 2^i) microseconds
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzl(us);
+    if (bucket >= METRIC_BUCKETS) {
+        bucket = METRIC_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+// upper bound in milliseconds of the bucket quantile q of the samples falls in
+double histogram_quantile(const struct histogram *h, double q) {
+    unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    unsigned long seen = 0;
+
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen > 0 && seen >= q * count) {
+            return (1UL << i) / 1000.0;
+        }
+    }
+    return (1UL << (METRIC_BUCKETS - 1)) / 1000.0;
+}
+
+// answer the stats command, small enough to fit in one legacy reply
+void send_stats() {
+    char out[BUFFER_SIZE];
+    size_t len;
+
+    len = snprintf(out, sizeof(out), "uptime %lds connections %lu active %ld queued %ld sent %lu bytes "
+                   "redirects %lu rejected %lu cache %lu hits %lu misses %lu striped\n"
+                   "syscalls %lu walking, %lu archiving %lu files%s, %lu deduplicated %lu bytes\n",
+                   (long)(time(NULL) - metrics->started),
+                   __atomic_load_n(&metrics->connections, __ATOMIC_RELAXED),
+                   __atomic_load_n(&load->active_connections, __ATOMIC_RELAXED),
+                   __atomic_load_n(&load->queued_jobs, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->bytes_sent, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->redirects, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->rejected, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->cache_hits, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->cache_misses, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->striped_archives, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->walk_syscalls, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->archive_syscalls, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->files_archived, __ATOMIC_RELAXED), use_uring ? " (io_uring)" : "",
+                   __atomic_load_n(&metrics->files_deduplicated, __ATOMIC_RELAXED),
+                   __atomic_load_n(&metrics->bytes_deduplicated, __ATOMIC_RELAXED));
+
+    // one line per command seen so far, latencies are bucket bounds in ms
+    for (int i = 0; i < NUM_METRIC_COMMANDS && len < sizeof(out); i++) {
+        const struct histogram *h = metrics->latency[i];
+        if (__atomic_load_n(&h[PHASE_REQUEST].count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        len += snprintf(out + len, sizeof(out) - len, "%s %lu requests p50 %.3g p99 %.3g ms",
+                        metric_command_names[i], __atomic_load_n(&h[PHASE_REQUEST].count, __ATOMIC_RELAXED),
+                        histogram_quantile(&h[PHASE_REQUEST], 0.5), histogram_quantile(&h[PHASE_REQUEST], 0.99));
+        if (len < sizeof(out) && __atomic_load_n(&h[PHASE_WALK].count, __ATOMIC_RELAXED) > 0) {
+            len += snprintf(out + len, sizeof(out) - len, ", walk p50 %.3g ms", histogram_quantile(&h[PHASE_WALK], 0.5));
+        }
+        if (len < sizeof(out) && __atomic_load_n(&h[PHASE_BUILD].count, __ATOMIC_RELAXED) > 0) {
+            len += snprintf(out + len, sizeof(out) - len, ", build p50 %.3g ms", histogram_quantile(&h[PHASE_BUILD], 0.5));
+        }
+        if (len < sizeof(out)) {
+            len += snprintf(out + len, sizeof(out) - len, "\n");
+        }
+    }
+    sendResponse(out);
+}
+
+// bind the local port metrics are scraped from and serve it from its own thread
+int start_metrics_listener() {
+    pthread_t tid;
+
+    int fd = listen_local(metrics_port);
+    if (fd == -1) {
+        perror("metrics bind");
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, metrics_main, (void *)(long)fd) != 0) {
+        perror("pthread_create");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// listening socket on a loopback port, only reachable from this host
+int listen_local(const char *port) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
+    int reuse = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port, &hints, &res) != 0) {
+        perror("getaddrinfo");
+        return -1;
+    }
+    for (p = res; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, BACKLOG) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// answer every connection with the metrics in the Prometheus text format, whatever it asked for
+void *metrics_main(void *arg) {
+    int fd = (int)(long)arg;
+    struct timeval timeout = { 1, 0 };
+    char request[BUFFER_SIZE];
+    char header[128];
+
+    while (1) {
+        char *body = NULL;
+        size_t body_len = 0;
+
+        int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            continue;
+        }
+        // a scraper that never sends its request must not hold up the next one
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        recv(client_fd, request, sizeof(request), 0);
+
+        FILE *out = open_memstream(&body, &body_len);
+        if (out != NULL) {
+            write_metrics(out);
+            fclose(out);
+            int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n\r\n", body_len);
+            if (write_all(client_fd, header, len) == 0) {
+                write_all(client_fd, body, body_len);
+            }
+            free(body);
+        }
+        close(client_fd);
+    }
+    return NULL;
+}
+
+// write counters, gauges and latency histograms in the Prometheus text format
+void write_metrics(FILE *out) {
+    const char *families[NUM_METRIC_PHASES] = {
+        "fs_request_duration_seconds", "fs_walk_duration_seconds", "fs_build_duration_seconds"
+    };
+    const char *help[NUM_METRIC_PHASES] = {
+        "Time to answer a command.", "Time spent finding the files of a command.", "Time spent building an archive."
+    };
+    long waiting_clients = 0;
+
+    for (int i = 0; i < num_shards; i++) {
+        waiting_clients += __atomic_load_n(&load->waiting_clients[i], __ATOMIC_RELAXED);
+    }
+
+    fprintf(out, "# HELP fs_connections_total Client connections accepted.\n# TYPE fs_connections_total counter\n"
+            "fs_connections_total %lu\n", __atomic_load_n(&metrics->connections, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_redirects_total Clients sent to a mirror.\n# TYPE fs_redirects_total counter\n"
+            "fs_redirects_total %lu\n", __atomic_load_n(&metrics->redirects, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_rejected_total Clients and archive requests turned away as busy.\n"
+            "# TYPE fs_rejected_total counter\n"
+            "fs_rejected_total %lu\n", __atomic_load_n(&metrics->rejected, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_sent_bytes_total Bytes sent to clients.\n# TYPE fs_sent_bytes_total counter\n"
+            "fs_sent_bytes_total %lu\n", __atomic_load_n(&metrics->bytes_sent, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_cache_hits_total Archives served from the cache.\n# TYPE fs_cache_hits_total counter\n"
+            "fs_cache_hits_total %lu\n", __atomic_load_n(&metrics->cache_hits, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_cache_misses_total Archives built for the cache.\n# TYPE fs_cache_misses_total counter\n"
+            "fs_cache_misses_total %lu\n", __atomic_load_n(&metrics->cache_misses, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_striped_archives_total Archives sent in chunks over several connections.\n"
+            "# TYPE fs_striped_archives_total counter\n"
+            "fs_striped_archives_total %lu\n", __atomic_load_n(&metrics->striped_archives, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_walk_syscalls_total Syscalls made walking directories.\n# TYPE fs_walk_syscalls_total counter\n"
+            "fs_walk_syscalls_total %lu\n", __atomic_load_n(&metrics->walk_syscalls, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_archive_syscalls_total Syscalls made reading files into archives.\n"
+            "# TYPE fs_archive_syscalls_total counter\n"
+            "fs_archive_syscalls_total %lu\n", __atomic_load_n(&metrics->archive_syscalls, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_archived_files_total Files written into archives.\n# TYPE fs_archived_files_total counter\n"
+            "fs_archived_files_total %lu\n", __atomic_load_n(&metrics->files_archived, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_deduplicated_files_total Files written as links to an identical member.\n"
+            "# TYPE fs_deduplicated_files_total counter\n"
+            "fs_deduplicated_files_total %lu\n", __atomic_load_n(&metrics->files_deduplicated, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_deduplicated_bytes_total File bytes linked instead of archived again.\n"
+            "# TYPE fs_deduplicated_bytes_total counter\n"
+            "fs_deduplicated_bytes_total %lu\n", __atomic_load_n(&metrics->bytes_deduplicated, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_active_connections Clients connected now.\n# TYPE fs_active_connections gauge\n"
+            "fs_active_connections %ld\n", __atomic_load_n(&load->active_connections, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_queued_jobs Commands waiting or running.\n# TYPE fs_queued_jobs gauge\n"
+            "fs_queued_jobs %ld\n", __atomic_load_n(&load->queued_jobs, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_bytes_in_flight Archive bytes still being sent.\n# TYPE fs_bytes_in_flight gauge\n"
+            "fs_bytes_in_flight %ld\n", __atomic_load_n(&load->bytes_in_flight, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP fs_waiting_clients Clients queued for a connection slot.\n# TYPE fs_waiting_clients gauge\n"
+            "fs_waiting_clients %ld\n", waiting_clients);
+    fprintf(out, "# HELP fs_waiting_jobs Archive requests queued for a build slot.\n# TYPE fs_waiting_jobs gauge\n"
+            "fs_waiting_jobs %ld\n", __atomic_load_n(&load->waiting_jobs, __ATOMIC_RELAXED));
+
+    for (int phase = 0; phase < NUM_METRIC_PHASES; phase++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", families[phase], help[phase], families[phase]);
+        for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+            const struct histogram *h = &metrics->latency[i][phase];
+            // commands that never ran this phase have no series
+            if (__atomic_load_n(&h->count, __ATOMIC_RELAXED) > 0) {
+                write_histogram(out, families[phase], metric_command_names[i], h);
+            }
+        }
+    }
+}
+
+// write one histogram series with cumulative buckets, the slowest bucket only shows up as +Inf
+void write_histogram(FILE *out, const char *family, const char *command, const struct histogram *h) {
+    unsigned long cumulative = 0;
+
+    for (int i = 0; i < METRIC_BUCKETS - 1; i++) {
+        cumulative += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        fprintf(out, "%s_bucket{command=\"%s\",le=\"%g\"} %lu\n", family, command, (1UL << i) / 1e6, cumulative);
+    }
+    cumulative += __atomic_load_n(&h->buckets[METRIC_BUCKETS - 1], __ATOMIC_RELAXED);
+    fprintf(out, "%s_bucket{command=\"%s\",le=\"+Inf\"} %lu\n", family, command, cumulative);
+    fprintf(out, "%s_sum{command=\"%s\"} %g\n", family, command, __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1e6);
+    fprintf(out, "%s_count{command=\"%s\"} %lu\n", family, command, cumulative);
 }